@@ -0,0 +1,26 @@
+include(ExternalProject)
+
+set(ZLIB_CMAKE_ARGS
+  -DCMAKE_POLICY_DEFAULT_CMP0091:STRING=NEW
+  -DCMAKE_MSVC_RUNTIME_LIBRARY:STRING=MultiThreaded$<$<CONFIG:Debug>:Debug>
+  -DZLIB_BUILD_EXAMPLES:BOOLEAN=OFF)
+
+ExternalProject_Add(
+  zlib_project
+  GIT_REPOSITORY    https://github.com/madler/zlib.git
+  GIT_TAG           master
+  GIT_SHALLOW       1
+  PREFIX            ${PROJECT_SOURCE_DIR}/extern/zlib
+  DOWNLOAD_DIR      ${PROJECT_SOURCE_DIR}/extern/zlib
+  SOURCE_DIR        ${PROJECT_SOURCE_DIR}/extern/zlib/source
+  BINARY_DIR        ${PROJECT_SOURCE_DIR}/extern/zlib/build
+  CMAKE_ARGS        ${ZLIB_CMAKE_ARGS}
+  INSTALL_COMMAND   ""
+  TEST_COMMAND      ""
+)
+
+ExternalProject_Get_Property(zlib_project source_dir)
+ExternalProject_Get_Property(zlib_project binary_dir)
+# zconf.h is generated in the build directory
+set(ZLIB_HEADERS ${source_dir} ${binary_dir})
+set(ZLIB_LIBS ${binary_dir})
@@ -0,0 +1,78 @@
+#include "AccessTrace.h"
+#include <fstream>
+#include <stdexcept>
+#include <cstdlib>
+
+static const char *TRACE_HEADER = "# pak access trace v1";
+
+AccessTrace::AccessTrace()
+  : m_Start(std::chrono::steady_clock::now())
+{
+}
+
+AccessTrace AccessTrace::load(const char *path) {
+  std::ifstream input(path, std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    throw std::runtime_error("failed to open trace");
+  }
+
+  AccessTrace result;
+  std::string line;
+  while (std::getline(input, line)) {
+    if (!line.empty() && (line.back() == '\r')) {
+      line.pop_back();
+    }
+    if (line.empty() || (line[0] == '#')) {
+      continue;
+    }
+
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos) {
+      result.add(line, 0);
+    } else {
+      result.add(line.substr(tab + 1), strtoull(line.substr(0, tab).c_str(), nullptr, 10));
+    }
+  }
+
+  if (input.bad()) {
+    throw std::runtime_error("failed to read trace");
+  }
+
+  return result;
+}
+
+void AccessTrace::record(const std::string &name) {
+  if (m_Ranks.find(name) != m_Ranks.end()) {
+    return;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_Start);
+  add(name, static_cast<uint64_t>(elapsed.count()));
+}
+
+void AccessTrace::add(const std::string &name, uint64_t milliseconds) {
+  if (m_Ranks.insert(std::make_pair(name, m_Accesses.size())).second) {
+    m_Accesses.push_back({ name, milliseconds });
+  }
+}
+
+void AccessTrace::save(const char *path) const {
+  std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!output.is_open()) {
+    throw std::runtime_error("failed to create trace");
+  }
+
+  output << TRACE_HEADER << '\n';
+  for (const Access &access : m_Accesses) {
+    output << access.milliseconds << '\t' << access.name << '\n';
+  }
+
+  output.close();
+  if (output.fail()) {
+    throw std::runtime_error("failed to write trace");
+  }
+}
+
+size_t AccessTrace::rank(const std::string &name) const {
+  auto iter = m_Ranks.find(name);
+  return iter != m_Ranks.end() ? iter->second : NOT_TRACED;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * order in which the entries of an archive were first accessed.
+ * Recorded from the reads on an open archive and used to lay out a decrypted archive in load order.
+ * The file format is plain text, one "<milliseconds since start>\t<name>" line per entry in order of first
+ * access. Lines starting with # are ignored, lines without a tab are taken as a name alone, so a simple
+ * list of names (e.g. from a manifest) works as a trace as well.
+ * Not thread safe.
+ */
+class AccessTrace
+{
+public:
+
+  static const size_t NOT_TRACED = static_cast<size_t>(-1);
+
+  struct Access {
+    std::string name;
+    uint64_t milliseconds;
+  };
+
+public:
+
+  AccessTrace();
+
+  /// throws a std::runtime_error if the file can't be read
+  static AccessTrace load(const char *path);
+
+  /// record an access, only the first one per name is kept
+  void record(const std::string &name);
+
+  /// throws a std::runtime_error if the file can't be written
+  void save(const char *path) const;
+
+  /// position of the first access of name in the trace or NOT_TRACED
+  size_t rank(const std::string &name) const;
+
+  const std::vector<Access> &accesses() const { return m_Accesses; }
+
+private:
+
+  void add(const std::string &name, uint64_t milliseconds);
+
+private:
+
+  std::chrono::steady_clock::time_point m_Start;
+  std::vector<Access> m_Accesses;
+  std::unordered_map<std::string, size_t> m_Ranks;
+
+};
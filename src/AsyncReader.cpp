@@ -0,0 +1,242 @@
+#include "AsyncReader.h"
+#include "errors.h"
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+AsyncReader::AsyncReader(const ReadFunction &read, size_t numThreads)
+  : m_Read(read)
+  , m_NextTicket(1)
+  , m_Stop(false)
+{
+#ifdef _WIN32
+  // manual reset, it stays signaled while there are completions to poll
+  m_Event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+  if (m_Event == nullptr) {
+    throw std::runtime_error("failed to create event");
+  }
+#elif defined(__linux__)
+  m_SignalRead = m_SignalWrite = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_SignalRead == -1) {
+    throw std::runtime_error("failed to create eventfd");
+  }
+#else
+  int fds[2];
+  if (pipe(fds) != 0) {
+    throw std::runtime_error("failed to create pipe");
+  }
+  m_SignalRead = fds[0];
+  m_SignalWrite = fds[1];
+  fcntl(m_SignalRead, F_SETFL, O_NONBLOCK);
+  fcntl(m_SignalWrite, F_SETFL, O_NONBLOCK);
+#endif
+
+  if (numThreads == 0) {
+    numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  m_Threads.reserve(numThreads);
+  for (size_t i = 0; i < numThreads; ++i) {
+    m_Threads.push_back(std::thread(&AsyncReader::run, this));
+  }
+}
+
+AsyncReader::~AsyncReader() {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stop = true;
+    for (auto &request : m_Requests) {
+      request.second->cancelled = true;
+    }
+  }
+  m_RequestAvailable.notify_all();
+  for (std::thread &thread : m_Threads) {
+    thread.join();
+  }
+
+#ifdef _WIN32
+  CloseHandle(m_Event);
+#else
+  ::close(m_SignalRead);
+  if (m_SignalWrite != m_SignalRead) {
+    ::close(m_SignalWrite);
+  }
+#endif
+}
+
+AsyncReader::Ticket AsyncReader::submit(size_t entry, int priority, const Callback &callback) {
+  std::unique_ptr<Request> request(new Request());
+  request->entry = entry;
+  request->priority = priority;
+  request->callback = callback;
+  request->cancelled = false;
+
+  Ticket ticket;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ticket = request->ticket = m_NextTicket++;
+    m_Queue.insert(request.get());
+    m_Requests[ticket] = std::move(request);
+  }
+  m_RequestAvailable.notify_one();
+  return ticket;
+}
+
+bool AsyncReader::setPriority(Ticket ticket, int priority) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto iter = m_Requests.find(ticket);
+  if (iter == m_Requests.end()) {
+    return false;
+  }
+  Request *request = iter->second.get();
+  // the position in the queue depends on the priority so it has to be reinserted
+  if (m_Queue.erase(request) == 0) {
+    return false;
+  }
+  request->priority = priority;
+  m_Queue.insert(request);
+  return true;
+}
+
+bool AsyncReader::cancel(Ticket ticket) {
+  std::unique_ptr<Request> request;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto iter = m_Requests.find(ticket);
+    if (iter == m_Requests.end()) {
+      return false;
+    }
+    iter->second->cancelled = true;
+    if (m_Queue.erase(iter->second.get()) == 0) {
+      // in flight, the worker completes it
+      return true;
+    }
+    request = std::move(iter->second);
+    m_Requests.erase(iter);
+  }
+
+  std::vector<char> data;
+  complete(*request, ERROR_CANCELLED, data);
+  return true;
+}
+
+std::vector<AsyncReader::Completion> AsyncReader::poll(size_t maxCompletions) {
+  std::vector<AsyncReader::Completion> result;
+  std::lock_guard<std::mutex> lock(m_CompletedMutex);
+  while (!m_Completed.empty() && (result.size() < maxCompletions)) {
+    result.push_back(std::move(m_Completed.front()));
+    m_Completed.pop_front();
+  }
+  if (m_Completed.empty()) {
+    clearSignal();
+  }
+  return result;
+}
+
+intptr_t AsyncReader::completionHandle() const {
+#ifdef _WIN32
+  return reinterpret_cast<intptr_t>(m_Event);
+#else
+  return m_SignalRead;
+#endif
+}
+
+void AsyncReader::run() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (true) {
+    m_RequestAvailable.wait(lock, [this]() { return m_Stop || !m_Queue.empty(); });
+    if (m_Queue.empty()) {
+      // stopping
+      return;
+    }
+
+    Request *request = *m_Queue.begin();
+    m_Queue.erase(m_Queue.begin());
+    lock.unlock();
+
+    std::vector<char> data;
+    int result;
+    if (request->cancelled) {
+      result = ERROR_CANCELLED;
+    } else {
+      try {
+        result = m_Read(request->entry, data, request->cancelled);
+      }
+      catch (...) {
+        result = ERROR_UNKNOWN;
+      }
+      if (request->cancelled) {
+        result = ERROR_CANCELLED;
+      }
+    }
+
+    lock.lock();
+    std::unique_ptr<Request> owned = std::move(m_Requests[request->ticket]);
+    m_Requests.erase(request->ticket);
+    lock.unlock();
+
+    complete(*owned, result, data);
+
+    lock.lock();
+  }
+}
+
+void AsyncReader::complete(Request &request, int result, std::vector<char> &data) {
+  Completion completion;
+  completion.ticket = request.ticket;
+  completion.result = result;
+  if (result == ERROR_NONE) {
+    completion.data.swap(data);
+  }
+
+  if (request.callback) {
+    request.callback(completion);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_CompletedMutex);
+    m_Completed.push_back(std::move(completion));
+  }
+  signal();
+}
+
+void AsyncReader::signal() {
+#ifdef _WIN32
+  SetEvent(m_Event);
+#elif defined(__linux__)
+  uint64_t value = 1;
+  ssize_t written = ::write(m_SignalWrite, &value, sizeof(uint64_t));
+  (void)written;
+#else
+  char value = 1;
+  ssize_t written = ::write(m_SignalWrite, &value, 1);
+  (void)written;
+#endif
+}
+
+void AsyncReader::clearSignal() {
+#ifdef _WIN32
+  ResetEvent(m_Event);
+#elif defined(__linux__)
+  uint64_t value;
+  ssize_t read = ::read(m_SignalRead, &value, sizeof(uint64_t));
+  (void)read;
+#else
+  char buffer[64];
+  while (::read(m_SignalRead, buffer, sizeof(buffer)) > 0) {
+  }
+#endif
+}
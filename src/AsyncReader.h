@@ -0,0 +1,118 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <set>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+/**
+ * queue of read requests processed in the background, highest priority first.
+ * Requests can be reprioritized while queued and cancelled while queued or in flight (the read function
+ * is expected to check the cancel flag regularly). Every request completes exactly once, either through
+ * its callback (called on a worker thread) or by being queued for poll(). Whenever a completion is
+ * queued for polling, the completion handle (an eventfd on linux) gets signaled so it can be waited on
+ * along with other event sources.
+ */
+class AsyncReader
+{
+public:
+
+  typedef uint64_t Ticket;
+
+  struct Completion {
+    Ticket ticket;
+    int result;
+    std::vector<char> data;
+  };
+
+  /// reads the entry into data, returns an error code. Should return early if cancelled gets set
+  typedef std::function<int(size_t entry, std::vector<char> &data, const std::atomic<bool> &cancelled)> ReadFunction;
+
+  typedef std::function<void(Completion &completion)> Callback;
+
+public:
+
+  /// numThreads == 0 uses one thread per hardware thread
+  AsyncReader(const ReadFunction &read, size_t numThreads = 0);
+  /// cancels all requests and waits for the ones in flight. Callbacks are still invoked
+  ~AsyncReader();
+
+  /// queue a read. Requests with a higher priority are processed first, equal priority in submission order.
+  /// If callback is empty, the completion is queued for poll()
+  Ticket submit(size_t entry, int priority, const Callback &callback);
+
+  /// change the priority of a queued request. Returns false if the request isn't queued (anymore)
+  bool setPriority(Ticket ticket, int priority);
+
+  /// cancel a queued or in-flight request, it completes with ERROR_CANCELLED unless it finished before noticing.
+  /// Returns false if the request already completed
+  bool cancel(Ticket ticket);
+
+  /// retrieve up to maxCompletions queued completions, doesn't block
+  std::vector<Completion> poll(size_t maxCompletions);
+
+  /// handle that gets signaled when completions are queued for polling.
+  /// eventfd on linux, the read end of a pipe on other posix systems, an event HANDLE on windows
+  intptr_t completionHandle() const;
+
+private:
+
+  struct Request {
+    Ticket ticket;
+    size_t entry;
+    int priority;
+    Callback callback;
+    std::atomic<bool> cancelled;
+  };
+
+  // highest priority first, then oldest first
+  struct Order {
+    bool operator()(const Request *lhs, const Request *rhs) const {
+      if (lhs->priority != rhs->priority) {
+        return lhs->priority > rhs->priority;
+      }
+      return lhs->ticket < rhs->ticket;
+    }
+  };
+
+private:
+
+  AsyncReader(const AsyncReader&);
+  AsyncReader &operator=(const AsyncReader&);
+
+  void run();
+  void complete(Request &request, int result, std::vector<char> &data);
+  void signal();
+  void clearSignal();
+
+private:
+
+  ReadFunction m_Read;
+  std::vector<std::thread> m_Threads;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_RequestAvailable;
+  std::set<Request*, Order> m_Queue;
+  // all requests that haven't completed yet, queued or in flight
+  std::map<Ticket, std::unique_ptr<Request>> m_Requests;
+  Ticket m_NextTicket;
+  bool m_Stop;
+
+  std::mutex m_CompletedMutex;
+  std::deque<Completion> m_Completed;
+
+#ifdef _WIN32
+  void *m_Event;
+#else
+  int m_SignalRead;
+  int m_SignalWrite;
+#endif
+
+};
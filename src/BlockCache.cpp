@@ -0,0 +1,157 @@
+#include "BlockCache.h"
+#include "Sharding.h"
+#include <functional>
+
+typedef Sharding<3> CacheShards;
+
+size_t BlockCache::KeyHash::operator()(const Key &key) const {
+  size_t result = std::hash<uint64_t>()(key.archive);
+  result ^= std::hash<uint64_t>()(key.entry) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  result ^= std::hash<uint64_t>()(key.block) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  return result;
+}
+
+bool BlockCache::KeyEqual::operator()(const Key &lhs, const Key &rhs) const {
+  return (lhs.archive == rhs.archive) && (lhs.entry == rhs.entry) && (lhs.block == rhs.block);
+}
+
+BlockCache::BlockCache()
+  : m_Budget(0)
+{
+  for (size_t i = 0; i < CacheShards::COUNT; ++i) {
+    m_Shards.push_back(std::unique_ptr<Shard>(new Shard()));
+  }
+}
+
+BlockCache &BlockCache::instance() {
+  static BlockCache s_Instance;
+  return s_Instance;
+}
+
+BlockCache::Shard &BlockCache::shardFor(const Key &key) {
+  return *m_Shards[CacheShards::shardOf(KeyHash()(key))];
+}
+
+uint64_t BlockCache::shardBudget() const {
+  return CacheShards::share(m_Budget);
+}
+
+void BlockCache::setBudget(uint64_t bytes) {
+  m_Budget = bytes;
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    evict(*shard, shardBudget());
+  }
+}
+
+BlockCache::Data BlockCache::get(const Key &key) {
+  Shard &shard = shardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto iter = shard.index.find(key);
+  if (iter == shard.index.end()) {
+    ++shard.misses;
+    return Data();
+  }
+
+  ++shard.hits;
+  Slot &slot = shard.slots[iter->second];
+  slot.referenced = true;
+  return slot.data;
+}
+
+void BlockCache::put(const Key &key, const Data &data) {
+  Shard &shard = shardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  uint64_t budget = shardBudget();
+  if (data->size() > budget) {
+    // also covers the cache being disabled
+    return;
+  }
+
+  if (shard.index.find(key) != shard.index.end()) {
+    // another thread decrypted the same block in the meantime
+    return;
+  }
+
+  evict(shard, budget - data->size());
+
+  size_t index;
+  if (!shard.freeSlots.empty()) {
+    index = shard.freeSlots.back();
+    shard.freeSlots.pop_back();
+  } else {
+    index = shard.slots.size();
+    shard.slots.push_back(Slot());
+  }
+
+  Slot &slot = shard.slots[index];
+  slot.key = key;
+  slot.data = data;
+  slot.referenced = false;
+  shard.index[key] = index;
+  shard.bytes += data->size();
+}
+
+void BlockCache::removeArchive(uint64_t archive) {
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    for (size_t i = 0; i < shard->slots.size(); ++i) {
+      if (shard->slots[i].data && (shard->slots[i].key.archive == archive)) {
+        release(*shard, i);
+      }
+    }
+  }
+}
+
+void BlockCache::clear() {
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->index.clear();
+    shard->slots.clear();
+    shard->freeSlots.clear();
+    shard->hand = 0;
+    shard->bytes = 0;
+    shard->hits = shard->misses = 0;
+  }
+}
+
+BlockCache::Statistics BlockCache::statistics() {
+  Statistics result;
+  result.hits = result.misses = result.bytes = result.blocks = 0;
+  result.budget = m_Budget;
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    result.hits += shard->hits;
+    result.misses += shard->misses;
+    result.bytes += shard->bytes;
+    result.blocks += shard->index.size();
+  }
+  return result;
+}
+
+void BlockCache::release(Shard &shard, size_t slot) {
+  shard.bytes -= shard.slots[slot].data->size();
+  shard.index.erase(shard.slots[slot].key);
+  shard.slots[slot].data.reset();
+  shard.freeSlots.push_back(slot);
+}
+
+void BlockCache::evict(Shard &shard, uint64_t budget) {
+  // CLOCK: blocks accessed since the hand last passed get a second chance
+  while (shard.bytes > budget) {
+    if (shard.hand >= shard.slots.size()) {
+      shard.hand = 0;
+    }
+    Slot &slot = shard.slots[shard.hand];
+    if (slot.data) {
+      if (slot.referenced) {
+        slot.referenced = false;
+      } else {
+        release(shard, shard.hand);
+      }
+    }
+    ++shard.hand;
+  }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * process-wide cache of decrypted blocks of entry data, for repeated reads of (overlapping) ranges.
+ * Blocks are BLOCK_SIZE bytes of the stored (still compressed) data of an entry, identified by the
+ * archive they come from, the entry and their index in the entry.
+ * Blocks are split into shards by key (see Sharding.h), each evicting with the CLOCK algorithm: a hand sweeps
+ * over the slots, clearing the referenced flag set by lookups and evicting the first block that wasn't
+ * accessed since its last pass. Unlike an LRU list, a hit only sets a flag.
+ * The cache is disabled (budget 0) until a memory budget is set.
+ */
+class BlockCache
+{
+public:
+
+  static const size_t BLOCK_SIZE = 64 * 1024;
+
+  struct Key {
+    /// process-unique id of the open archive
+    uint64_t archive;
+    uint64_t entry;
+    uint64_t block;
+  };
+
+  typedef std::shared_ptr<const std::vector<uint8_t>> Data;
+
+  struct Statistics {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t budget;
+  };
+
+public:
+
+  static BlockCache &instance();
+
+  /// set the maximum number of bytes of block data to keep. 0 disables the cache
+  void setBudget(uint64_t bytes);
+
+  bool enabled() const { return m_Budget != 0; }
+
+  /// returns nullptr if the block isn't cached
+  Data get(const Key &key);
+
+  void put(const Key &key, const Data &data);
+
+  /// drop all blocks of an archive, after it was closed
+  void removeArchive(uint64_t archive);
+
+  void clear();
+
+  Statistics statistics();
+
+private:
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key &lhs, const Key &rhs) const;
+  };
+
+  struct Slot {
+    Key key;
+    // null if the slot is free
+    Data data;
+    // set on access, cleared when the clock hand passes
+    bool referenced;
+  };
+
+  struct Shard {
+    Shard() : hand(0), bytes(0), hits(0), misses(0) {}
+
+    std::mutex mutex;
+    std::unordered_map<Key, size_t, KeyHash, KeyEqual> index;
+    std::vector<Slot> slots;
+    std::vector<size_t> freeSlots;
+    size_t hand;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+private:
+
+  BlockCache();
+
+  Shard &shardFor(const Key &key);
+  void evict(Shard &shard, uint64_t budget);
+  void release(Shard &shard, size_t slot);
+  uint64_t shardBudget() const;
+
+private:
+
+  std::atomic<uint64_t> m_Budget;
+  std::vector<std::unique_ptr<Shard>> m_Shards;
+
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * fixed capacity ring buffer for passing items between threads.
+ * push blocks while the queue is full, pop blocks while it's empty. After close() all blocked calls
+ * return, pop still returns the remaining items.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+
+  explicit BoundedQueue(size_t capacity)
+    : m_Items(capacity)
+    , m_Head(0)
+    , m_Count(0)
+    , m_Closed(false)
+  {
+  }
+
+  /// returns false if the queue was closed, the item is not added in that case
+  bool push(const T &item) {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_NotFull.wait(lock, [this]() { return m_Closed || (m_Count < m_Items.size()); });
+    if (m_Closed) {
+      return false;
+    }
+    m_Items[(m_Head + m_Count) % m_Items.size()] = item;
+    ++m_Count;
+    lock.unlock();
+    m_NotEmpty.notify_one();
+    return true;
+  }
+
+  /// returns false if the queue was closed and is empty
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_NotEmpty.wait(lock, [this]() { return m_Closed || (m_Count > 0); });
+    if (m_Count == 0) {
+      return false;
+    }
+    item = m_Items[m_Head];
+    m_Head = (m_Head + 1) % m_Items.size();
+    --m_Count;
+    lock.unlock();
+    m_NotFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Closed = true;
+    }
+    m_NotEmpty.notify_all();
+    m_NotFull.notify_all();
+  }
+
+private:
+
+  BoundedQueue(const BoundedQueue&);
+  BoundedQueue &operator=(const BoundedQueue&);
+
+private:
+
+  std::mutex m_Mutex;
+  std::condition_variable m_NotEmpty;
+  std::condition_variable m_NotFull;
+  std::vector<T> m_Items;
+  size_t m_Head;
+  size_t m_Count;
+  bool m_Closed;
+
+};
@@ -0,0 +1,174 @@
+#include "Crc32.h"
+#include <zlib.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32_PCLMUL
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_PCLMUL
+#define ALIGN16 __declspec(align(16))
+#else
+#include <cpuid.h>
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#define ALIGN16 __attribute__((aligned(16)))
+#endif
+#endif
+
+namespace Crc32 {
+
+#ifdef CRC32_PCLMUL
+
+  static bool detectPCLMUL() {
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    ecx = static_cast<unsigned int>(info[2]);
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+#endif
+    static const unsigned int PCLMULQDQ = 1 << 1;
+    static const unsigned int SSE41 = 1 << 19;
+    return (ecx & (PCLMULQDQ | SSE41)) == (PCLMULQDQ | SSE41);
+  }
+
+  static const bool s_HasPCLMUL = detectPCLMUL();
+
+  // folding by carry-less multiplication, see "Fast CRC Computation for Generic Polynomials Using
+  // PCLMULQDQ Instruction" (Gopal et al., Intel 2009). The constants are for the bit-reflected crc32
+  // polynomial.
+  // size has to be at least 64 and a multiple of 16, crc is the inverted (internal) state
+  TARGET_PCLMUL static uint32_t foldPCLMUL(uint32_t crc, const uint8_t *data, size_t size) {
+    static const uint64_t ALIGN16 k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t ALIGN16 k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t ALIGN16 k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t ALIGN16 poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+
+    data += 64;
+    size -= 64;
+
+    // fold four 128 bit lanes in parallel
+    while (size >= 64) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+      y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+      y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+      y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+      y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+      data += 64;
+      size -= 64;
+    }
+
+    // fold the lanes into one
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 16 byte blocks
+    while (size >= 16) {
+      x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+      data += 16;
+      size -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+  }
+
+#endif
+
+  uint32_t update(uint32_t crc, const uint8_t *data, size_t size) {
+#ifdef CRC32_PCLMUL
+    if (s_HasPCLMUL && (size >= 64)) {
+      size_t folded = size & ~static_cast<size_t>(15);
+      crc = ~foldPCLMUL(~crc, data, folded);
+      data += folded;
+      size -= folded;
+    }
+#endif
+    // zlib takes the length as uInt, feed huge buffers in pieces
+    while (size > 0) {
+      uInt chunk = static_cast<uInt>(size > 0x40000000 ? 0x40000000 : size);
+      crc = static_cast<uint32_t>(crc32(crc, data, chunk));
+      data += chunk;
+      size -= chunk;
+    }
+    return crc;
+  }
+
+  bool isAccelerated() {
+#ifdef CRC32_PCLMUL
+    return s_HasPCLMUL;
+#else
+    return false;
+#endif
+  }
+
+}
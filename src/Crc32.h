@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * crc32 as used by zip (same results as zlib crc32).
+ * Uses carry-less multiplication (PCLMULQDQ) where the cpu supports it.
+ */
+namespace Crc32 {
+
+  /// update crc with data. Start with a crc of 0
+  uint32_t update(uint32_t crc, const uint8_t *data, size_t size);
+
+  /// true if the hardware accelerated implementation is in use
+  bool isAccelerated();
+
+}
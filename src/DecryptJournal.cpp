@@ -0,0 +1,316 @@
+#include "DecryptJournal.h"
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+#include <algorithm>
+
+static const uint32_t JOURNAL_MAGIC = 0x4a444b50; // PKDJ
+static const uint32_t JOURNAL_VERSION = 2;
+static const uint32_t SLOT_MAGIC = 0x534c4f54;
+
+enum SlotType {
+  SLOT_WINDOW = 1,
+  SLOT_FINALIZE = 2
+};
+
+#pragma pack(push)
+#pragma pack(1)
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  DecryptJournal::Identity identity;
+  uint64_t sectionCount;
+  uint64_t checksum;
+};
+
+struct SlotHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t sequence;
+  uint64_t payloadSize;
+  uint64_t checksum;
+};
+
+struct WindowPayload {
+  DecryptJournal::Cursor start;
+  DecryptJournal::Cursor end;
+  uint64_t fileStart;
+  uint64_t fileEnd;
+  uint64_t pageCount;
+};
+
+struct FinalizePayload {
+  uint64_t offset;
+  uint64_t newFileSize;
+  uint64_t dataSize;
+  uint64_t dataChecksum;
+};
+
+#pragma pack(pop)
+
+static const uint64_t MAX_PAGES = DecryptJournal::WINDOW_SIZE / DecryptJournal::PAGE_SIZE + 2;
+static const uint64_t SLOT_SIZE = sizeof(SlotHeader) + sizeof(WindowPayload) + MAX_PAGES * sizeof(uint64_t);
+
+static uint64_t checksumContinue(uint64_t hash, const uint8_t *data, size_t size) {
+  // FNV-1a
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static const uint64_t CHECKSUM_BASIS = 14695981039346656037ULL;
+
+uint64_t DecryptJournal::checksum(const uint8_t *data, size_t size) {
+  return checksumContinue(CHECKSUM_BASIS, data, size);
+}
+
+std::vector<uint64_t> DecryptJournal::pageChecksums(const uint8_t *data, uint64_t fileStart, uint64_t fileEnd) {
+  std::vector<uint64_t> result;
+  uint64_t pos = fileStart;
+  while (pos < fileEnd) {
+    uint64_t pageEnd = std::min<uint64_t>((pos / PAGE_SIZE + 1) * PAGE_SIZE, fileEnd);
+    result.push_back(checksum(data + (pos - fileStart), static_cast<size_t>(pageEnd - pos)));
+    pos = pageEnd;
+  }
+  return result;
+}
+
+std::string DecryptJournal::pathFor(const char *archivePath) {
+  return std::string(archivePath) + ".journal";
+}
+
+DecryptJournal::DecryptJournal(const std::string &path, RandomAccessFile *file)
+  : m_Path(path)
+  , m_File(file)
+  , m_State(STATE_STARTED)
+  , m_Sequence(0)
+{
+}
+
+DecryptJournal::~DecryptJournal() {
+}
+
+std::unique_ptr<DecryptJournal> DecryptJournal::create(const std::string &path, const Identity &identity, const std::vector<Section> &plan) {
+  std::unique_ptr<DecryptJournal> result(new DecryptJournal(path, new RandomAccessFile(path.c_str(), RandomAccessFile::CREATE)));
+  result->m_Identity = identity;
+  result->m_Plan = plan;
+
+  const uint8_t *planData = reinterpret_cast<const uint8_t*>(plan.data());
+  size_t planSize = plan.size() * sizeof(Section);
+
+  JournalHeader header;
+  header.magic = JOURNAL_MAGIC;
+  header.version = JOURNAL_VERSION;
+  header.identity = identity;
+  header.sectionCount = plan.size();
+  header.checksum = checksumContinue(checksum(reinterpret_cast<const uint8_t*>(&header), offsetof(JournalHeader, checksum)),
+                                     planData, planSize);
+
+  result->m_File->writeAt(0, &header, sizeof(JournalHeader));
+  if (planSize > 0) {
+    result->m_File->writeAt(sizeof(JournalHeader), planData, planSize);
+  }
+  result->m_File->sync();
+
+  return result;
+}
+
+std::unique_ptr<DecryptJournal> DecryptJournal::open(const std::string &path) {
+  RandomAccessFile *file;
+  try {
+    file = new RandomAccessFile(path.c_str(), RandomAccessFile::READ_WRITE);
+  }
+  catch (const std::runtime_error&) {
+    return std::unique_ptr<DecryptJournal>();
+  }
+
+  std::unique_ptr<DecryptJournal> result(new DecryptJournal(path, file));
+
+  JournalHeader header;
+  if (file->size() < sizeof(JournalHeader)) {
+    return std::unique_ptr<DecryptJournal>();
+  }
+  file->readAt(0, &header, sizeof(JournalHeader));
+  if ((header.magic != JOURNAL_MAGIC)
+      || (header.version != JOURNAL_VERSION)
+      || (file->size() < sizeof(JournalHeader) + header.sectionCount * sizeof(Section))) {
+    return std::unique_ptr<DecryptJournal>();
+  }
+
+  result->m_Identity = header.identity;
+  result->m_Plan.resize(static_cast<size_t>(header.sectionCount));
+  size_t planSize = result->m_Plan.size() * sizeof(Section);
+  if (planSize > 0) {
+    file->readAt(sizeof(JournalHeader), result->m_Plan.data(), planSize);
+  }
+
+  uint64_t expected = checksumContinue(checksum(reinterpret_cast<const uint8_t*>(&header), offsetof(JournalHeader, checksum)),
+                                       reinterpret_cast<const uint8_t*>(result->m_Plan.data()), planSize);
+  if (expected != header.checksum) {
+    return std::unique_ptr<DecryptJournal>();
+  }
+
+  // the slot with the highest sequence number that isn't torn is the current one
+  Slot slots[2];
+  bool valid0 = result->readSlot(0, slots[0]);
+  bool valid1 = result->readSlot(1, slots[1]);
+  if (valid0 || valid1) {
+    const Slot &current = (valid0 && (!valid1 || (slots[0].sequence > slots[1].sequence))) ? slots[0] : slots[1];
+    result->m_State = current.state;
+    result->m_Sequence = current.sequence;
+    result->m_Window = current.window;
+    result->m_Finalization = current.finalization;
+  }
+
+  return result;
+}
+
+uint64_t DecryptJournal::slotOffset(int slot) const {
+  uint64_t base = sizeof(JournalHeader) + m_Plan.size() * sizeof(Section);
+  base = (base + PAGE_SIZE - 1) & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+  return base + slot * SLOT_SIZE;
+}
+
+uint64_t DecryptJournal::finalizationOffset() const {
+  return slotOffset(2);
+}
+
+bool DecryptJournal::readSlot(int slot, Slot &result) const {
+  uint64_t offset = slotOffset(slot);
+  if (m_File->size() < offset + sizeof(SlotHeader)) {
+    return false;
+  }
+
+  SlotHeader header;
+  m_File->readAt(offset, &header, sizeof(SlotHeader));
+  if ((header.magic != SLOT_MAGIC) || (header.payloadSize > SLOT_SIZE - sizeof(SlotHeader))
+      || (m_File->size() < offset + sizeof(SlotHeader) + header.payloadSize)) {
+    return false;
+  }
+
+  std::vector<uint8_t> payload(static_cast<size_t>(header.payloadSize));
+  m_File->readAt(offset + sizeof(SlotHeader), payload.data(), payload.size());
+  uint64_t expected = checksumContinue(checksum(reinterpret_cast<const uint8_t*>(&header), offsetof(SlotHeader, checksum)),
+                                       payload.data(), payload.size());
+  if (expected != header.checksum) {
+    return false;
+  }
+
+  if (header.type == SLOT_WINDOW) {
+    if (payload.size() < sizeof(WindowPayload)) {
+      return false;
+    }
+    const WindowPayload *window = reinterpret_cast<const WindowPayload*>(payload.data());
+    if (payload.size() != sizeof(WindowPayload) + window->pageCount * sizeof(uint64_t)) {
+      return false;
+    }
+    result.window.sequence = header.sequence;
+    result.window.start = window->start;
+    result.window.end = window->end;
+    result.window.fileStart = window->fileStart;
+    result.window.fileEnd = window->fileEnd;
+    result.window.pageChecksums.resize(static_cast<size_t>(window->pageCount));
+    memcpy(result.window.pageChecksums.data(), payload.data() + sizeof(WindowPayload), static_cast<size_t>(window->pageCount * sizeof(uint64_t)));
+    result.state = STATE_WINDOW;
+  } else if (header.type == SLOT_FINALIZE) {
+    if (payload.size() != sizeof(FinalizePayload)) {
+      return false;
+    }
+    const FinalizePayload *finalize = reinterpret_cast<const FinalizePayload*>(payload.data());
+    if (m_File->size() < finalizationOffset() + finalize->dataSize) {
+      return false;
+    }
+    result.finalization.offset = finalize->offset;
+    result.finalization.newFileSize = finalize->newFileSize;
+    result.finalization.data.resize(static_cast<size_t>(finalize->dataSize));
+    if (finalize->dataSize > 0) {
+      m_File->readAt(finalizationOffset(), result.finalization.data.data(), result.finalization.data.size());
+    }
+    if (checksum(result.finalization.data.data(), result.finalization.data.size()) != finalize->dataChecksum) {
+      return false;
+    }
+    result.state = STATE_FINALIZE;
+  } else {
+    return false;
+  }
+
+  result.sequence = header.sequence;
+  return true;
+}
+
+void DecryptJournal::writeSlot(uint32_t type, const std::vector<uint8_t> &payload) {
+  ++m_Sequence;
+
+  SlotHeader header;
+  header.magic = SLOT_MAGIC;
+  header.type = type;
+  header.sequence = m_Sequence;
+  header.payloadSize = payload.size();
+  header.checksum = checksumContinue(checksum(reinterpret_cast<const uint8_t*>(&header), offsetof(SlotHeader, checksum)),
+                                     payload.data(), payload.size());
+
+  std::vector<uint8_t> buffer(sizeof(SlotHeader) + payload.size());
+  memcpy(buffer.data(), &header, sizeof(SlotHeader));
+  memcpy(buffer.data() + sizeof(SlotHeader), payload.data(), payload.size());
+
+  m_File->writeAt(slotOffset(static_cast<int>(m_Sequence % 2)), buffer.data(), buffer.size());
+  m_File->sync();
+}
+
+void DecryptJournal::writeWindow(const Cursor &start, const Cursor &end, uint64_t fileStart, uint64_t fileEnd,
+                                 const std::vector<uint64_t> &pageChecksums) {
+  if (pageChecksums.size() > MAX_PAGES) {
+    throw std::runtime_error("window too large");
+  }
+
+  WindowPayload window;
+  window.start = start;
+  window.end = end;
+  window.fileStart = fileStart;
+  window.fileEnd = fileEnd;
+  window.pageCount = pageChecksums.size();
+
+  std::vector<uint8_t> payload(sizeof(WindowPayload) + pageChecksums.size() * sizeof(uint64_t));
+  memcpy(payload.data(), &window, sizeof(WindowPayload));
+  memcpy(payload.data() + sizeof(WindowPayload), pageChecksums.data(), pageChecksums.size() * sizeof(uint64_t));
+
+  writeSlot(SLOT_WINDOW, payload);
+
+  m_State = STATE_WINDOW;
+  m_Window.sequence = m_Sequence;
+  m_Window.start = start;
+  m_Window.end = end;
+  m_Window.fileStart = fileStart;
+  m_Window.fileEnd = fileEnd;
+  m_Window.pageChecksums = pageChecksums;
+}
+
+void DecryptJournal::writeFinalization(const Finalization &finalization) {
+  if (!finalization.data.empty()) {
+    m_File->writeAt(finalizationOffset(), finalization.data.data(), finalization.data.size());
+  }
+  m_File->sync();
+
+  FinalizePayload finalize;
+  finalize.offset = finalization.offset;
+  finalize.newFileSize = finalization.newFileSize;
+  finalize.dataSize = finalization.data.size();
+  finalize.dataChecksum = checksum(finalization.data.data(), finalization.data.size());
+
+  std::vector<uint8_t> payload(sizeof(FinalizePayload));
+  memcpy(payload.data(), &finalize, sizeof(FinalizePayload));
+
+  writeSlot(SLOT_FINALIZE, payload);
+
+  m_State = STATE_FINALIZE;
+  m_Finalization = finalization;
+}
+
+void DecryptJournal::remove() {
+  m_File.reset();
+  ::remove(m_Path.c_str());
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "RandomAccessFile.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+/**
+ * crash recovery journal for in-place decryption.
+ *
+ * Decryption is an xor with a keystream so it can't be applied twice, after a crash we need to know
+ * exactly which bytes of the archive are already decrypted. The archive is processed in windows of
+ * at most WINDOW_SIZE bytes. Before a window gets overwritten, the journal records its extent and a
+ * checksum of every PAGE_SIZE page of the still encrypted data. Pages whose checksum still matches after
+ * a crash were not written yet and need decrypting, all others are done.
+ * Window records alternate between two slots so a torn journal write always leaves the previous,
+ * completed, window intact.
+ * The final step (replacing the CDR and dropping the comment) is recorded with the full replacement
+ * data so it can be redone without access to the encryption header.
+ */
+class DecryptJournal
+{
+public:
+
+  static const uint32_t WINDOW_SIZE = 16 * 1024 * 1024;
+  static const uint32_t PAGE_SIZE = 512;
+
+  /// identifies the archive a journal belongs to
+  struct Identity {
+    uint64_t fileSize;
+    uint64_t cdrOffset;
+    uint64_t cdrSize;
+    uint64_t entryCount;
+  };
+
+  /// a range of the archive encrypted as one keystream
+  struct Section {
+    uint64_t offset;
+    uint64_t length;
+    // index of the entry (in cdr order) this section belongs to
+    uint32_t entry;
+  };
+
+  struct Cursor {
+    uint64_t section;
+    uint64_t sectionOffset;
+  };
+
+  struct Window {
+    uint64_t sequence;
+    Cursor start;
+    Cursor end;
+    uint64_t fileStart;
+    uint64_t fileEnd;
+    std::vector<uint64_t> pageChecksums;
+  };
+
+  struct Finalization {
+    uint64_t offset;
+    uint64_t newFileSize;
+    std::vector<uint8_t> data;
+  };
+
+  enum State {
+    STATE_STARTED,
+    STATE_WINDOW,
+    STATE_FINALIZE
+  };
+
+public:
+
+  /// path of the journal belonging to an archive
+  static std::string pathFor(const char *archivePath);
+
+  /// create a new journal with the decryption plan. Returns only once the journal is on disk
+  static std::unique_ptr<DecryptJournal> create(const std::string &path, const Identity &identity, const std::vector<Section> &plan);
+
+  /// open an existing journal. Returns nullptr if there is none or if it was never completely written,
+  /// in which case the archive wasn't modified yet
+  static std::unique_ptr<DecryptJournal> open(const std::string &path);
+
+  static uint64_t checksum(const uint8_t *data, size_t size);
+
+  /// checksums of all pages (aligned to absolute file offsets) in the range [fileStart, fileEnd)
+  static std::vector<uint64_t> pageChecksums(const uint8_t *data, uint64_t fileStart, uint64_t fileEnd);
+
+  ~DecryptJournal();
+
+  const Identity &identity() const { return m_Identity; }
+  const std::vector<Section> &plan() const { return m_Plan; }
+
+  State state() const { return m_State; }
+  const Window &window() const { return m_Window; }
+  const Finalization &finalization() const { return m_Finalization; }
+
+  /// record the window about to be written. Returns once the record is on disk
+  void writeWindow(const Cursor &start, const Cursor &end, uint64_t fileStart, uint64_t fileEnd,
+                   const std::vector<uint64_t> &pageChecksums);
+
+  /// record the final rewrite. Returns once the record is on disk
+  void writeFinalization(const Finalization &finalization);
+
+  /// delete the journal after the archive was fully decrypted
+  void remove();
+
+private:
+
+  struct Slot {
+    State state;
+    uint64_t sequence;
+    Window window;
+    Finalization finalization;
+  };
+
+private:
+
+  DecryptJournal(const std::string &path, RandomAccessFile *file);
+
+  uint64_t slotOffset(int slot) const;
+  uint64_t finalizationOffset() const;
+  bool readSlot(int slot, Slot &result) const;
+  void writeSlot(uint32_t type, const std::vector<uint8_t> &payload);
+
+private:
+
+  std::string m_Path;
+  std::unique_ptr<RandomAccessFile> m_File;
+
+  Identity m_Identity;
+  std::vector<Section> m_Plan;
+
+  State m_State;
+  uint64_t m_Sequence;
+  Window m_Window;
+  Finalization m_Finalization;
+
+};
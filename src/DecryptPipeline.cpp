@@ -0,0 +1,256 @@
+#include "DecryptPipeline.h"
+#include <thread>
+#include <algorithm>
+#include <cstring>
+
+using namespace ZipUtil;
+
+DecryptPipeline::DecryptPipeline(const RandomAccessFile &input, const TomCryption &crypto, CryEngineDecryptionKeys &keys,
+                                 size_t numDecryptThreads)
+  : m_Input(input)
+  , m_Crypto(crypto)
+  , m_Keys(keys)
+  , m_Schedule(crypto.scheduleKeys(keys.cipherKeyTable, BLOCK_CIPHER_NUM_KEYS))
+  , m_NumDecryptThreads(numDecryptThreads)
+  , m_ActiveProducers(0)
+{
+  if (m_NumDecryptThreads == 0) {
+    size_t hardwareThreads = std::thread::hardware_concurrency();
+    m_NumDecryptThreads = hardwareThreads > 2 ? hardwareThreads - 2 : 1;
+  }
+}
+
+void DecryptPipeline::run(const std::vector<const CDRecordWithData*> &entries, Sink &sink) {
+  // enough chunks that every stage has one to work on and one waiting
+  size_t numChunks = 2 * (m_NumDecryptThreads + 2);
+  std::vector<Chunk> chunks(numChunks);
+
+  m_Free.reset(new BoundedQueue<Chunk*>(numChunks));
+  m_Read.reset(new BoundedQueue<Chunk*>(numChunks));
+  m_Completed.clear();
+  m_ActiveProducers = m_NumDecryptThreads;
+  m_Error = std::exception_ptr();
+
+  for (Chunk &chunk : chunks) {
+    chunk.buffer.resize(CHUNK_SIZE);
+    m_Free->push(&chunk);
+  }
+
+  std::vector<std::thread> threads;
+  threads.push_back(std::thread(&DecryptPipeline::read, this, std::cref(entries)));
+  for (size_t i = 0; i < m_NumDecryptThreads; ++i) {
+    threads.push_back(std::thread(&DecryptPipeline::decrypt, this));
+  }
+
+  try {
+    uint64_t nextSequence = 0;
+    while (true) {
+      Chunk *chunk = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(m_CompletedMutex);
+        m_CompletedSignal.wait(lock, [&]() {
+          return (m_Completed.find(nextSequence) != m_Completed.end()) || (m_ActiveProducers == 0);
+          });
+        auto iter = m_Completed.find(nextSequence);
+        if (iter == m_Completed.end()) {
+          // all producers are done and there is nothing left
+          break;
+        }
+        chunk = iter->second;
+        m_Completed.erase(iter);
+      }
+
+      for (const Segment &segment : chunk->segments) {
+        if (segment.first) {
+          sink.beginEntry(segment.entry);
+        }
+        sink.write(segment.entry, chunk->buffer.data() + segment.offset, segment.size);
+        if (segment.last) {
+          sink.endEntry(segment.entry);
+        }
+      }
+
+      ++nextSequence;
+      m_Free->push(chunk);
+    }
+  }
+  catch (...) {
+    fail();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    throw;
+  }
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  if (m_Error) {
+    std::rethrow_exception(m_Error);
+  }
+}
+
+void DecryptPipeline::read(const std::vector<const CDRecordWithData*> &entries) {
+  try {
+    uint64_t sequence = 0;
+    Chunk *chunk = nullptr;
+
+    // segments that are adjacent in the file are read with a single call
+    uint64_t pendingOffset = 0;
+    size_t pendingStart = 0;
+    size_t pendingSize = 0;
+
+    auto flushRead = [&]() {
+      if (pendingSize > 0) {
+        m_Input.readAt(pendingOffset, chunk->buffer.data() + pendingStart, pendingSize);
+        pendingSize = 0;
+      }
+    };
+
+    auto submit = [&]() -> bool {
+      flushRead();
+      chunk->sequence = sequence++;
+      Chunk *full = chunk;
+      chunk = nullptr;
+      return m_Read->push(full);
+    };
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const CDRecordWithData &entry = *entries[i];
+
+      InitialVector iv;
+      getInitialVector(entry.record.descriptor, iv);
+      int keyIndex = getEncryptionKeyIndex(entry.record.descriptor.crc);
+
+      // the header has to be decrypted here already to know the size of the name and extra field
+      LocalFileHeader localHeader;
+      m_Input.readAt(entry.localHeaderOffset, &localHeader, sizeof(LocalFileHeader));
+      DecryptRequest headerRequest = { reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), keyIndex, iv, 0 };
+      m_Crypto.decryptBatch(m_Schedule, &headerRequest, 1);
+
+      // each section is encrypted separately, starting at the iv
+      uint64_t sections[3][2];
+      size_t numSections = 0;
+      uint64_t offset = entry.localHeaderOffset;
+      uint64_t headerLength = sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
+      sections[numSections][0] = offset;
+      sections[numSections++][1] = headerLength;
+      offset += headerLength;
+      if (entry.sizeCompressed > 0) {
+        sections[numSections][0] = offset;
+        sections[numSections++][1] = entry.sizeCompressed;
+        offset += entry.sizeCompressed;
+      }
+      if ((localHeader.flags & 0x08) != 0) {
+        uint8_t possibleSignature[4];
+        m_Input.readAt(offset, possibleSignature, 4);
+        DecryptRequest signatureRequest = { possibleSignature, 4, keyIndex, iv, 0 };
+        m_Crypto.decryptBatch(m_Schedule, &signatureRequest, 1);
+        sections[numSections][0] = offset;
+        sections[numSections++][1] = getDataDescriptorSize(possibleSignature, entry.zip64);
+      }
+
+      for (size_t section = 0; section < numSections; ++section) {
+        for (uint64_t pos = 0; pos < sections[section][1]; ) {
+          if (chunk == nullptr) {
+            if (!m_Free->pop(chunk)) {
+              // pipeline was shut down
+              return;
+            }
+            chunk->size = 0;
+            chunk->segments.clear();
+          }
+
+          Segment segment;
+          segment.entry = i;
+          segment.offset = chunk->size;
+          segment.size = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE - chunk->size, sections[section][1] - pos));
+          segment.first = (section == 0) && (pos == 0);
+          segment.last = (section == numSections - 1) && (pos + segment.size == sections[section][1]);
+          segment.keyIndex = keyIndex;
+          memcpy(segment.iv, iv, BLOCK_CIPHER_KEY_LENGTH);
+          segment.streamOffset = pos;
+
+          uint64_t fileOffset = sections[section][0] + pos;
+          if ((pendingSize > 0) && (pendingOffset + pendingSize == fileOffset)) {
+            pendingSize += segment.size;
+          } else {
+            flushRead();
+            pendingOffset = fileOffset;
+            pendingStart = chunk->size;
+            pendingSize = segment.size;
+          }
+
+          chunk->segments.push_back(segment);
+          chunk->size += segment.size;
+          pos += segment.size;
+
+          if ((chunk->size == CHUNK_SIZE) && !submit()) {
+            return;
+          }
+        }
+      }
+    }
+
+    if ((chunk != nullptr) && !submit()) {
+      return;
+    }
+  }
+  catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(m_ErrorMutex);
+      if (!m_Error) {
+        m_Error = std::current_exception();
+      }
+    }
+    fail();
+  }
+
+  m_Read->close();
+}
+
+void DecryptPipeline::decrypt() {
+  try {
+    std::vector<DecryptRequest> requests;
+    Chunk *chunk;
+    while (m_Read->pop(chunk)) {
+      requests.clear();
+      for (const Segment &segment : chunk->segments) {
+        DecryptRequest request = { chunk->buffer.data() + segment.offset, static_cast<unsigned long>(segment.size),
+                                   segment.keyIndex, segment.iv, segment.streamOffset };
+        requests.push_back(request);
+      }
+      m_Crypto.decryptBatch(m_Schedule, requests.data(), requests.size());
+      complete(chunk);
+    }
+  }
+  catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(m_ErrorMutex);
+      if (!m_Error) {
+        m_Error = std::current_exception();
+      }
+    }
+    fail();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_CompletedMutex);
+    --m_ActiveProducers;
+  }
+  m_CompletedSignal.notify_all();
+}
+
+void DecryptPipeline::complete(Chunk *chunk) {
+  {
+    std::lock_guard<std::mutex> lock(m_CompletedMutex);
+    m_Completed[chunk->sequence] = chunk;
+  }
+  m_CompletedSignal.notify_all();
+}
+
+void DecryptPipeline::fail() {
+  m_Free->close();
+  m_Read->close();
+}
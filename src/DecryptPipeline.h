@@ -0,0 +1,96 @@
+#pragma once
+
+#include "ZipUtil.h"
+#include "RandomAccessFile.h"
+#include "BoundedQueue.h"
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+/**
+ * decrypts a sequence of entries (local header, data and data descriptor of each) with reading,
+ * decryption and writing running concurrently.
+ * A reader thread reads the sections in chunks, one or more decryption threads decrypt them and the
+ * calling thread passes them to the sink in their original order. Chunks are recycled, so the memory
+ * use is bounded no matter how large the entries are.
+ * Small sections are packed into one chunk, so an archive of tiny files is decrypted in a few large batches
+ * instead of one call per section.
+ */
+class DecryptPipeline
+{
+public:
+
+  static const size_t CHUNK_SIZE = 1024 * 1024;
+
+  /// receives the decrypted data, always called on the thread that called run()
+  class Sink {
+  public:
+    virtual ~Sink() {}
+    /// called before the first data of an entry
+    virtual void beginEntry(size_t index) { (void)index; }
+    virtual void write(size_t index, const uint8_t *data, size_t size) = 0;
+    /// called after the last data of an entry
+    virtual void endEntry(size_t index) { (void)index; }
+  };
+
+public:
+
+  /// numDecryptThreads == 0 uses all hardware threads not taken by reading and writing
+  DecryptPipeline(const RandomAccessFile &input, const TomCryption &crypto, ZipUtil::CryEngineDecryptionKeys &keys,
+                  size_t numDecryptThreads = 0);
+
+  /// decrypt the entries in the order given. index in sink calls refers to the position in this list
+  void run(const std::vector<const ZipUtil::CDRecordWithData*> &entries, Sink &sink);
+
+private:
+
+  /// (part of) a section stored in a chunk
+  struct Segment {
+    size_t entry;
+    // position in the chunk buffer
+    size_t offset;
+    size_t size;
+    bool first;
+    bool last;
+    int keyIndex;
+    InitialVector iv;
+    uint64_t streamOffset;
+  };
+
+  struct Chunk {
+    std::vector<uint8_t> buffer;
+    size_t size;
+    uint64_t sequence;
+    std::vector<Segment> segments;
+  };
+
+private:
+
+  void read(const std::vector<const ZipUtil::CDRecordWithData*> &entries);
+  void decrypt();
+  void fail();
+  void complete(Chunk *chunk);
+
+private:
+
+  const RandomAccessFile &m_Input;
+  const TomCryption &m_Crypto;
+  ZipUtil::CryEngineDecryptionKeys &m_Keys;
+  KeySchedule m_Schedule;
+  size_t m_NumDecryptThreads;
+
+  std::unique_ptr<BoundedQueue<Chunk*>> m_Free;
+  std::unique_ptr<BoundedQueue<Chunk*>> m_Read;
+
+  std::mutex m_CompletedMutex;
+  std::condition_variable m_CompletedSignal;
+  std::map<uint64_t, Chunk*> m_Completed;
+  size_t m_ActiveProducers;
+
+  std::mutex m_ErrorMutex;
+  std::exception_ptr m_Error;
+
+};
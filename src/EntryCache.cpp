@@ -0,0 +1,139 @@
+#include "EntryCache.h"
+#include "Sharding.h"
+#include <functional>
+#include <cctype>
+
+typedef Sharding<3> CacheShards;
+
+EntryCache::Key::Key(const ZipUtil::CryEngineDecryptionKeys &archiveKeys, const ZipUtil::CDRecordWithData &entry)
+  : archive(reinterpret_cast<const char*>(archiveKeys.cdrInitialVector), sizeof(archiveKeys.cdrInitialVector))
+  , localHeaderOffset(entry.localHeaderOffset)
+  , descriptor(entry.record.descriptor)
+  , name(reinterpret_cast<const char*>(entry.data.data()), entry.record.nameLength)
+{
+  for (char &ch : this->name) {
+    ch = ch == '\\' ? '/' : static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+  }
+}
+
+size_t EntryCache::KeyHash::operator()(const Key &key) const {
+  size_t result = std::hash<std::string>()(key.name);
+  result ^= std::hash<uint32_t>()(key.descriptor.crc) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  result ^= std::hash<uint32_t>()(key.descriptor.sizeCompressed) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  result ^= std::hash<std::string>()(key.archive) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  result ^= std::hash<uint64_t>()(key.localHeaderOffset) + 0x9e3779b9 + (result << 6) + (result >> 2);
+  return result;
+}
+
+bool EntryCache::KeyEqual::operator()(const Key &lhs, const Key &rhs) const {
+  return (lhs.descriptor == rhs.descriptor) && (lhs.localHeaderOffset == rhs.localHeaderOffset)
+      && (lhs.name == rhs.name) && (lhs.archive == rhs.archive);
+}
+
+EntryCache::EntryCache()
+  : m_Budget(0)
+{
+  for (size_t i = 0; i < CacheShards::COUNT; ++i) {
+    m_Shards.push_back(std::unique_ptr<Shard>(new Shard()));
+  }
+}
+
+EntryCache &EntryCache::instance() {
+  static EntryCache s_Instance;
+  return s_Instance;
+}
+
+EntryCache::Shard &EntryCache::shardFor(const Key &key) {
+  return *m_Shards[CacheShards::shardOf(KeyHash()(key))];
+}
+
+uint64_t EntryCache::shardBudget() const {
+  return CacheShards::share(m_Budget);
+}
+
+void EntryCache::setBudget(uint64_t bytes) {
+  m_Budget = bytes;
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    evict(*shard, shardBudget());
+  }
+}
+
+EntryCache::Data EntryCache::get(const Key &key) {
+  if (!enabled()) {
+    return Data();
+  }
+
+  Shard &shard = shardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto iter = shard.index.find(key);
+  if (iter == shard.index.end()) {
+    ++shard.misses;
+    return Data();
+  }
+
+  ++shard.hits;
+  shard.items.splice(shard.items.begin(), shard.items, iter->second);
+  return iter->second->second;
+}
+
+void EntryCache::put(const Key &key, const Data &data) {
+  if (!fits(data->size())) {
+    // also covers the cache being disabled
+    return;
+  }
+
+  Shard &shard = shardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  uint64_t budget = shardBudget();
+  if (data->size() > budget) {
+    // the budget was lowered in the meantime
+    return;
+  }
+
+  auto iter = shard.index.find(key);
+  if (iter != shard.index.end()) {
+    // another thread decrypted the same entry in the meantime
+    shard.items.splice(shard.items.begin(), shard.items, iter->second);
+    return;
+  }
+
+  evict(shard, budget - data->size());
+
+  shard.items.push_front(std::make_pair(key, data));
+  shard.index[key] = shard.items.begin();
+  shard.bytes += data->size();
+}
+
+void EntryCache::clear() {
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    evict(*shard, 0);
+    shard->hits = shard->misses = 0;
+  }
+}
+
+EntryCache::Statistics EntryCache::statistics() {
+  Statistics result;
+  result.hits = result.misses = result.bytes = result.entries = 0;
+  result.budget = m_Budget;
+  for (const std::unique_ptr<Shard> &shard : m_Shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    result.hits += shard->hits;
+    result.misses += shard->misses;
+    result.bytes += shard->bytes;
+    result.entries += shard->items.size();
+  }
+  return result;
+}
+
+void EntryCache::evict(Shard &shard, uint64_t budget) {
+  while (shard.bytes > budget) {
+    const Item &item = shard.items.back();
+    shard.bytes -= item.second->size();
+    shard.index.erase(item.first);
+    shard.items.pop_back();
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "ZipUtil.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+/**
+ * process-wide LRU cache of decrypted entries, shared between all archives.
+ * Cached data includes the local header, which can differ between archives containing the same file, so
+ * entries are identified by the archive they come from as well as their name, crc and sizes. The archive is
+ * identified by the initial vector of its directory, which is random per archive, so the same archive opened
+ * repeatedly or through different paths still shares cache entries.
+ * The cache is split into shards by key (see Sharding.h), each with its own lock and LRU list and an equal
+ * part of the budget. Entries larger than that part aren't cached.
+ * The cache is disabled (budget 0) until a memory budget is set, lookups then don't take any lock.
+ */
+class EntryCache
+{
+public:
+
+  struct Key {
+    // initial vector of the directory of the archive
+    std::string archive;
+    uint64_t localHeaderOffset;
+    ZipUtil::DataDescriptor descriptor;
+    // lower case, forward slashes
+    std::string name;
+
+    Key(const ZipUtil::CryEngineDecryptionKeys &archiveKeys, const ZipUtil::CDRecordWithData &entry);
+  };
+
+  typedef std::shared_ptr<const std::vector<char>> Data;
+
+  struct Statistics {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t budget;
+  };
+
+public:
+
+  static EntryCache &instance();
+
+  /// set the maximum number of bytes of entry data to keep. 0 disables the cache
+  void setBudget(uint64_t bytes);
+
+  bool enabled() const { return m_Budget != 0; }
+
+  /// true if an entry of the specified size would be kept by put
+  bool fits(uint64_t size) const { return enabled() && (size <= shardBudget()); }
+
+  /// returns nullptr if the entry isn't cached
+  Data get(const Key &key);
+
+  void put(const Key &key, const Data &data);
+
+  void clear();
+
+  Statistics statistics();
+
+private:
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key &lhs, const Key &rhs) const;
+  };
+
+  typedef std::pair<Key, Data> Item;
+
+  struct Shard {
+    Shard() : bytes(0), hits(0), misses(0) {}
+
+    std::mutex mutex;
+    // most recently used at the front
+    std::list<Item> items;
+    std::unordered_map<Key, std::list<Item>::iterator, KeyHash, KeyEqual> index;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+private:
+
+  EntryCache();
+
+  Shard &shardFor(const Key &key);
+  void evict(Shard &shard, uint64_t budget);
+  uint64_t shardBudget() const;
+
+private:
+
+  std::atomic<uint64_t> m_Budget;
+  std::vector<std::unique_ptr<Shard>> m_Shards;
+
+};
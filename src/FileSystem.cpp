@@ -0,0 +1,81 @@
+#include "FileSystem.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+namespace FileSystem {
+
+  static bool isDirectory(const std::string &path) {
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return (attributes != INVALID_FILE_ATTRIBUTES) && ((attributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+#else
+    struct stat info;
+    return (stat(path.c_str(), &info) == 0) && S_ISDIR(info.st_mode);
+#endif
+  }
+
+  static bool createDirectory(const std::string &path) {
+#ifdef _WIN32
+    return (CreateDirectoryA(path.c_str(), nullptr) != 0) || (GetLastError() == ERROR_ALREADY_EXISTS);
+#else
+    return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+#endif
+  }
+
+  bool createDirectories(const std::string &path) {
+    if (path.empty() || isDirectory(path)) {
+      return true;
+    }
+
+    size_t separator = path.find_last_of("/\\");
+    if ((separator != std::string::npos) && (separator > 0)) {
+      if (!createDirectories(path.substr(0, separator))) {
+        return false;
+      }
+    }
+
+    // another thread may have created it in the meantime, that's fine
+    return createDirectory(path) && isDirectory(path);
+  }
+
+  bool sanitizeEntryPath(const std::string &name, std::string &result) {
+    result.clear();
+    result.reserve(name.size());
+
+    size_t start = 0;
+    while (start <= name.size()) {
+      size_t end = name.find_first_of("/\\", start);
+      if (end == std::string::npos) {
+        end = name.size();
+      }
+      std::string component = name.substr(start, end - start);
+      start = end + 1;
+
+      if (component.empty() || (component == ".")) {
+        if ((end == 0) && (name.size() > 0)) {
+          // leading separator, absolute path
+          return false;
+        }
+        continue;
+      }
+      if ((component == "..") || (component.find(':') != std::string::npos)) {
+        return false;
+      }
+
+      if (!result.empty()) {
+        result += '/';
+      }
+      result += component;
+    }
+
+    return !result.empty();
+  }
+
+}
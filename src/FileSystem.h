@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+/**
+ * the few file system operations not covered by the standard library
+ */
+namespace FileSystem {
+
+  /// create a directory including all missing parents. Returns false if it doesn't exist afterwards.
+  /// Both / and \ are accepted as separators
+  bool createDirectories(const std::string &path);
+
+  /// turn an entry name from an archive into a relative path with / as the separator.
+  /// Returns false if the name is absolute or would escape the target directory (.. components)
+  bool sanitizeEntryPath(const std::string &name, std::string &result);
+
+}
@@ -0,0 +1,94 @@
+#include "Keyring.h"
+#include <tomcrypt.h>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+using namespace ZipUtil;
+
+static const size_t NO_MATCH = static_cast<size_t>(-1);
+
+Keyring::Keyring() {
+}
+
+Keyring::~Keyring() {
+}
+
+size_t Keyring::add(const unsigned char *key, short keySize) {
+  std::shared_ptr<TomCryption> crypto(new TomCryption());
+  crypto->loadKeys(key, keySize);
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_Keys.push_back(crypto);
+  return m_Keys.size() - 1;
+}
+
+size_t Keyring::size() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Keys.size();
+}
+
+bool Keyring::tryKey(TomCryption &crypto, const CryEngineEncryptionHeader &header) {
+  // with the wrong key the OAEP padding doesn't decode (or the modulus size doesn't even match)
+  try {
+    crypto.decryptKey(header.keys[0], RSA_KEY_MESSAGE_LENGTH, LTC_PKCS_1_OAEP);
+    return true;
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+}
+
+bool Keyring::identify(const CryEngineEncryptionHeader &header, Match &result) {
+  // the wrapped keys are random per archive so the encrypted slot identifies the archive,
+  // independent of its path or whether it was modified otherwise
+  std::string slot(reinterpret_cast<const char*>(header.keys[0]), RSA_KEY_MESSAGE_LENGTH);
+
+  std::vector<std::shared_ptr<TomCryption>> keys;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto iter = m_Cache.find(slot);
+    if (iter != m_Cache.end()) {
+      result = iter->second;
+      return true;
+    }
+    // work on a copy so keys can be added while we search
+    keys = m_Keys;
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> found(NO_MATCH);
+  auto search = [&]() {
+    for (size_t i = next++; (i < keys.size()) && (found == NO_MATCH); i = next++) {
+      if (tryKey(*keys[i], header)) {
+        found = i;
+      }
+    }
+  };
+
+  size_t numWorkers = std::min<size_t>(keys.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::future<void>> workers;
+  for (size_t i = 1; i < numWorkers; ++i) {
+    workers.push_back(std::async(std::launch::async, search));
+  }
+  search();
+  for (std::future<void> &worker : workers) {
+    worker.get();
+  }
+
+  if (found == NO_MATCH) {
+    return false;
+  }
+
+  Match match;
+  match.keyIndex = found;
+  match.crypto = keys[found];
+  match.decryptionKeys = CryEngineDecryptionKeys::unwrap(header, *match.crypto);
+
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_Cache[slot] = match;
+  result = match;
+  return true;
+}
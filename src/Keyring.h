@@ -0,0 +1,58 @@
+#pragma once
+
+#include "TomCryption.h"
+#include "ZipUtil.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * set of public keys for archives that may have been encrypted for any of them.
+ * Every key is imported once when it's added. To find the key of an archive only the first key slot of
+ * its encryption header is unwrapped with each candidate (in parallel), OAEP decoding fails for all but
+ * the right key. The result, including the fully unwrapped keys, is cached by the encrypted slot so
+ * opening the same archive again doesn't cost any RSA operations.
+ * Thread safe.
+ */
+class Keyring
+{
+public:
+
+  struct Match {
+    size_t keyIndex;
+    /// the imported key, to be used for the archive
+    std::shared_ptr<TomCryption> crypto;
+    ZipUtil::CryEngineDecryptionKeys decryptionKeys;
+  };
+
+public:
+
+  Keyring();
+  ~Keyring();
+
+  /// import a key and return its index. Throws a std::runtime_error if the key is invalid
+  size_t add(const unsigned char *key, short keySize);
+
+  size_t size() const;
+
+  /// find the key the archive with the specified encryption header was encrypted for and unwrap
+  /// its keys. Returns false if none of the keys matches
+  bool identify(const ZipUtil::CryEngineEncryptionHeader &header, Match &result);
+
+private:
+
+  Keyring(const Keyring&);
+  Keyring &operator=(const Keyring&);
+
+  static bool tryKey(TomCryption &crypto, const ZipUtil::CryEngineEncryptionHeader &header);
+
+private:
+
+  mutable std::mutex m_Mutex;
+  std::vector<std::shared_ptr<TomCryption>> m_Keys;
+  std::unordered_map<std::string, Match> m_Cache;
+
+};
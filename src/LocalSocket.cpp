@@ -0,0 +1,381 @@
+#include "LocalSocket.h"
+#include <stdexcept>
+#include <cstring>
+#include <atomic>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
+
+// not available everywhere (macOS), descriptors are marked after the fact there
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+#endif
+
+#ifdef _WIN32
+
+std::unique_ptr<LocalSocket> LocalSocket::connect(const char*) {
+  throw std::runtime_error("unix domain sockets not supported");
+}
+
+SharedMemory::SharedMemory(size_t) {
+  throw std::runtime_error("shared memory not supported");
+}
+
+SharedMemory::SharedMemory(int, size_t) {
+  throw std::runtime_error("shared memory not supported");
+}
+
+SharedMemory::~SharedMemory() {
+}
+
+char *SharedMemory::release() {
+  return nullptr;
+}
+
+void SharedMemory::unmap(char*, size_t) {
+}
+
+LocalSocket::LocalSocket(int fd) : m_FD(fd) {
+}
+
+LocalSocket::~LocalSocket() {
+}
+
+void LocalSocket::send(const void*, size_t, int) {
+  throw std::runtime_error("unix domain sockets not supported");
+}
+
+bool LocalSocket::receive(void*, size_t, int*) {
+  throw std::runtime_error("unix domain sockets not supported");
+}
+
+void LocalSocket::shutdown() {
+}
+
+bool LocalSocket::peerIsSameUser() const {
+  return false;
+}
+
+LocalServerSocket::LocalServerSocket(const char*) {
+  throw std::runtime_error("unix domain sockets not supported");
+}
+
+LocalServerSocket::~LocalServerSocket() {
+}
+
+std::unique_ptr<LocalSocket> LocalServerSocket::accept() {
+  return std::unique_ptr<LocalSocket>();
+}
+
+void LocalServerSocket::close() {
+}
+
+#else
+
+static sockaddr_un socketAddress(const char *path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(sockaddr_un));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    throw std::runtime_error("socket path too long");
+  }
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  return address;
+}
+
+std::unique_ptr<LocalSocket> LocalSocket::connect(const char *path) {
+  sockaddr_un address = socketAddress(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::runtime_error("failed to create socket");
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_un)) != 0) {
+    ::close(fd);
+    throw std::runtime_error("failed to connect");
+  }
+  return std::unique_ptr<LocalSocket>(new LocalSocket(fd));
+}
+
+static int createSharedMemory() {
+#ifdef __linux__
+  int fd = memfd_create("pak", MFD_CLOEXEC);
+#else
+  // no memfd, use a named object that is unlinked right away
+  static std::atomic<unsigned int> s_Counter(0);
+  char name[64];
+  snprintf(name, sizeof(name), "/pak-%d-%u", static_cast<int>(getpid()), s_Counter++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd != -1) {
+    shm_unlink(name);
+  }
+#endif
+  if (fd == -1) {
+    throw std::runtime_error("failed to create shared memory");
+  }
+  return fd;
+}
+
+SharedMemory::SharedMemory(size_t size)
+  : m_FD(createSharedMemory())
+  , m_Data(nullptr)
+  , m_Size(size)
+{
+  if (size > 0) {
+    void *mapping = MAP_FAILED;
+    if (ftruncate(m_FD, static_cast<off_t>(size)) == 0) {
+      mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_FD, 0);
+    }
+    if (mapping == MAP_FAILED) {
+      ::close(m_FD);
+      throw std::runtime_error("failed to map shared memory");
+    }
+    m_Data = reinterpret_cast<char*>(mapping);
+  }
+}
+
+SharedMemory::SharedMemory(int fd, size_t size)
+  : m_FD(fd)
+  , m_Data(nullptr)
+  , m_Size(size)
+{
+  if (size > 0) {
+    // private so the receiver can modify the data without the sender seeing it
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_FD, 0);
+    if (mapping == MAP_FAILED) {
+      ::close(m_FD);
+      throw std::runtime_error("failed to map shared memory");
+    }
+    m_Data = reinterpret_cast<char*>(mapping);
+  }
+}
+
+SharedMemory::~SharedMemory() {
+  unmap(m_Data, m_Size);
+  ::close(m_FD);
+}
+
+char *SharedMemory::release() {
+  char *result = m_Data;
+  m_Data = nullptr;
+  return result;
+}
+
+void SharedMemory::unmap(char *data, size_t size) {
+  if (data != nullptr) {
+    munmap(data, size);
+  }
+}
+
+LocalSocket::LocalSocket(int fd)
+  : m_FD(fd)
+{
+}
+
+LocalSocket::~LocalSocket() {
+  ::close(m_FD);
+}
+
+void LocalSocket::send(const void *data, size_t size, int fd) {
+  const char *pos = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    iovec vector;
+    vector.iov_base = const_cast<char*>(pos);
+    vector.iov_len = size;
+
+    msghdr message;
+    memset(&message, 0, sizeof(msghdr));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd != -1) {
+      memset(control, 0, sizeof(control));
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+#ifdef MSG_NOSIGNAL
+    ssize_t sent = sendmsg(m_FD, &message, MSG_NOSIGNAL);
+#else
+    ssize_t sent = sendmsg(m_FD, &message, 0);
+#endif
+    if ((sent < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (sent <= 0) {
+      throw std::runtime_error("failed to send");
+    }
+    // the descriptor went out with the first part
+    fd = -1;
+    pos += sent;
+    size -= static_cast<size_t>(sent);
+  }
+}
+
+bool LocalSocket::receive(void *data, size_t size, int *fd) {
+  if (fd != nullptr) {
+    *fd = -1;
+  }
+
+  char *pos = reinterpret_cast<char*>(data);
+  size_t received = 0;
+  while (received < size) {
+    iovec vector;
+    vector.iov_base = pos + received;
+    vector.iov_len = size - received;
+
+    msghdr message;
+    memset(&message, 0, sizeof(msghdr));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t count = recvmsg(m_FD, &message, MSG_CMSG_CLOEXEC);
+    if ((count < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if ((count == 0) && (received == 0)) {
+      return false;
+    }
+    if (count <= 0) {
+      throw std::runtime_error("failed to receive");
+    }
+
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+      if ((header->cmsg_level == SOL_SOCKET) && (header->cmsg_type == SCM_RIGHTS)) {
+        int passed;
+        memcpy(&passed, CMSG_DATA(header), sizeof(int));
+        if ((fd != nullptr) && (*fd == -1)) {
+          *fd = passed;
+        } else {
+          ::close(passed);
+        }
+      }
+    }
+
+    received += static_cast<size_t>(count);
+  }
+
+  return true;
+}
+
+void LocalSocket::shutdown() {
+  ::shutdown(m_FD, SHUT_RDWR);
+}
+
+bool LocalSocket::peerIsSameUser() const {
+#ifdef SO_PEERCRED
+  ucred credentials;
+  socklen_t length = sizeof(ucred);
+  if (getsockopt(m_FD, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+    return false;
+  }
+  return credentials.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(m_FD, &uid, &gid) != 0) {
+    return false;
+  }
+  return uid == geteuid();
+#endif
+}
+
+LocalServerSocket::LocalServerSocket(const char *path)
+  : m_Path(path)
+  , m_FD(-1)
+  , m_WakeRead(-1)
+  , m_WakeWrite(-1)
+{
+  sockaddr_un address = socketAddress(path);
+
+  m_FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_FD == -1) {
+    throw std::runtime_error("failed to create socket");
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    ::close(m_FD);
+    throw std::runtime_error("failed to create pipe");
+  }
+  m_WakeRead = fds[0];
+  m_WakeWrite = fds[1];
+
+  // nobody can connect before listen, so restricting access in between leaves no window for other users
+  ::unlink(path);
+  if ((bind(m_FD, reinterpret_cast<sockaddr*>(&address), sizeof(sockaddr_un)) != 0)
+      || (chmod(path, S_IRUSR | S_IWUSR) != 0)
+      || (listen(m_FD, SOMAXCONN) != 0)) {
+    ::close(m_FD);
+    ::close(m_WakeRead);
+    ::close(m_WakeWrite);
+    throw std::runtime_error("failed to listen");
+  }
+}
+
+LocalServerSocket::~LocalServerSocket() {
+  ::close(m_FD);
+  ::close(m_WakeRead);
+  ::close(m_WakeWrite);
+  ::unlink(m_Path.c_str());
+}
+
+std::unique_ptr<LocalSocket> LocalServerSocket::accept() {
+  while (true) {
+    pollfd fds[2];
+    fds[0].fd = m_FD;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_WakeRead;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to wait for connections");
+    }
+
+    if (fds[1].revents != 0) {
+      return std::unique_ptr<LocalSocket>();
+    }
+
+    int fd = ::accept(m_FD, nullptr, nullptr);
+    if (fd == -1) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      throw std::runtime_error("failed to accept connection");
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return std::unique_ptr<LocalSocket>(new LocalSocket(fd));
+  }
+}
+
+void LocalServerSocket::close() {
+  char signal = 1;
+  while ((::write(m_WakeWrite, &signal, 1) < 0) && (errno == EINTR)) {
+  }
+}
+
+#endif
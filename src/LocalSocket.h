@@ -0,0 +1,116 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * mapped anonymous shared memory (memfd, or shm_open where that isn't available) whose descriptor can be passed
+ * to another process with LocalSocket::send. Data written into it by one process is visible to the other without
+ * any copying.
+ * Only available on POSIX systems, throws a std::runtime_error on Windows.
+ */
+class SharedMemory
+{
+public:
+
+  /// create and map size bytes
+  explicit SharedMemory(size_t size);
+  /// map memory received from another process, copy on write. Takes ownership of fd
+  SharedMemory(int fd, size_t size);
+  ~SharedMemory();
+
+  char *data() const { return m_Data; }
+  size_t size() const { return m_Size; }
+  int fd() const { return m_FD; }
+
+  /// hand the mapping over to the caller, it has to be freed with unmap
+  char *release();
+
+  static void unmap(char *data, size_t size);
+
+private:
+
+  SharedMemory(const SharedMemory&);
+  SharedMemory &operator=(const SharedMemory&);
+
+private:
+
+  int m_FD;
+  char *m_Data;
+  size_t m_Size;
+
+};
+
+/**
+ * stream connection over a unix domain socket. A file descriptor can be passed along with a message
+ * (SCM_RIGHTS), used to hand large payloads over in shared memory instead of copying them through the socket.
+ * Only available on POSIX systems, everything throws a std::runtime_error on Windows.
+ */
+class LocalSocket
+{
+public:
+
+  /// throws a std::runtime_error if there is no server listening at path
+  static std::unique_ptr<LocalSocket> connect(const char *path);
+
+  explicit LocalSocket(int fd);
+  ~LocalSocket();
+
+  /// send all of data. If fd isn't -1 it's passed along with the first byte
+  void send(const void *data, size_t size, int fd = -1);
+
+  /// receive exactly size bytes. If fd is set it receives a descriptor passed with them or -1.
+  /// Returns false if the connection was closed before the first byte, throws if it was closed midway
+  bool receive(void *data, size_t size, int *fd = nullptr);
+
+  /// wake up and fail pending and future receives, e.g. to stop a thread serving this connection
+  void shutdown();
+
+  /// true if the process at the other end runs as the same user as this one
+  bool peerIsSameUser() const;
+
+private:
+
+  LocalSocket(const LocalSocket&);
+  LocalSocket &operator=(const LocalSocket&);
+
+private:
+
+  int m_FD;
+
+};
+
+/**
+ * listening unix domain socket. The socket file is only accessible to the user who created it
+ */
+class LocalServerSocket
+{
+public:
+
+  /// a stale socket file at path gets replaced. Throws a std::runtime_error on error
+  explicit LocalServerSocket(const char *path);
+  /// removes the socket file
+  ~LocalServerSocket();
+
+  /// wait for the next connection. Returns nullptr once close was called
+  std::unique_ptr<LocalSocket> accept();
+
+  /// stop accepting connections, can be called from any thread
+  void close();
+
+private:
+
+  LocalServerSocket(const LocalServerSocket&);
+  LocalServerSocket &operator=(const LocalServerSocket&);
+
+private:
+
+  std::string m_Path;
+  int m_FD;
+  // written to by close() to wake up accept()
+  int m_WakeRead;
+  int m_WakeWrite;
+
+};
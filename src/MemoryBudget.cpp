@@ -0,0 +1,36 @@
+#include "MemoryBudget.h"
+
+MemoryBudget::MemoryBudget(uint64_t limit)
+  : m_Limit(limit)
+  , m_Used(0)
+{
+}
+
+void MemoryBudget::acquire(uint64_t size) {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  m_Released.wait(lock, [&]() { return (m_Used == 0) || (m_Used + size <= m_Limit); });
+  m_Used += size;
+}
+
+void MemoryBudget::adjust(uint64_t acquired, uint64_t actual) {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Used = m_Used - acquired + actual;
+  }
+  if (actual < acquired) {
+    m_Released.notify_all();
+  }
+}
+
+void MemoryBudget::release(uint64_t size) {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Used -= size;
+  }
+  m_Released.notify_all();
+}
+
+uint64_t MemoryBudget::used() const {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Used;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+/**
+ * limits the amount of memory held at a time by blocking until enough of it was released.
+ * A request larger than the whole budget is granted once nothing else is held so it can't block forever.
+ */
+class MemoryBudget
+{
+public:
+
+  explicit MemoryBudget(uint64_t limit);
+
+  /// blocks until size bytes are available
+  void acquire(uint64_t size);
+
+  /// correct an earlier acquire once the actual size is known, never blocks
+  void adjust(uint64_t acquired, uint64_t actual);
+
+  void release(uint64_t size);
+
+  uint64_t used() const;
+
+private:
+
+  MemoryBudget(const MemoryBudget&);
+  MemoryBudget &operator=(const MemoryBudget&);
+
+private:
+
+  mutable std::mutex m_Mutex;
+  std::condition_variable m_Released;
+  uint64_t m_Limit;
+  uint64_t m_Used;
+
+};
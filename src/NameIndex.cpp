@@ -0,0 +1,53 @@
+#include "NameIndex.h"
+#include "ThreadPool.h"
+#include "Sharding.h"
+#include <functional>
+#include <cstdint>
+
+typedef Sharding<4> IndexShards;
+static const size_t MIN_HASH_RANGE = 8192;
+
+NameIndex::NameIndex()
+  : m_Shards(IndexShards::COUNT)
+{
+}
+
+void NameIndex::build(const std::vector<ZipUtil::CDRecordWithData> &headers) {
+  std::vector<std::string> names(headers.size());
+  std::vector<uint8_t> shards(headers.size());
+  std::vector<size_t> shardSizes(IndexShards::COUNT, 0);
+
+  ThreadPool::parallelFor(headers.size(), MIN_HASH_RANGE, [&](size_t begin, size_t end) {
+    std::hash<std::string> hash;
+    for (size_t i = begin; i < end; ++i) {
+      const ZipUtil::CDRecordWithData &header = headers[i];
+      names[i].assign(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength);
+      shards[i] = static_cast<uint8_t>(IndexShards::shardOf(hash(names[i])));
+    }
+  });
+
+  for (uint8_t shard : shards) {
+    ++shardSizes[shard];
+  }
+
+  // each shard is filled by a single thread, scanning the shard ids is cheap compared to the inserts
+  ThreadPool::parallelFor(IndexShards::COUNT, headers.size() >= MIN_HASH_RANGE ? 1 : IndexShards::COUNT, [&](size_t begin, size_t end) {
+    for (size_t shard = begin; shard < end; ++shard) {
+      std::unordered_map<std::string, size_t> &map = m_Shards[shard];
+      map.clear();
+      map.reserve(shardSizes[shard]);
+      for (size_t i = 0; i < names.size(); ++i) {
+        if (shards[i] == shard) {
+          // duplicate names map to the last entry
+          map[std::move(names[i])] = i;
+        }
+      }
+    }
+  });
+}
+
+const NameIndex::Item *NameIndex::find(const std::string &name) const {
+  const std::unordered_map<std::string, size_t> &map = m_Shards[IndexShards::shardOf(std::hash<std::string>()(name))];
+  auto iter = map.find(name);
+  return iter != map.end() ? &*iter : nullptr;
+}
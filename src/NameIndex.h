@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ZipUtil.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+
+/**
+ * lookup of entries by name.
+ * The names are split into shards (see Sharding.h) so the index of an archive with hundreds of thousands
+ * of entries can be built on all cores, each shard is filled by one thread.
+ * Immutable once built, lookups are thread safe.
+ */
+class NameIndex
+{
+public:
+
+  typedef std::pair<const std::string, size_t> Item;
+
+public:
+
+  NameIndex();
+
+  /// index the entries, mapping each name to its position in headers
+  void build(const std::vector<ZipUtil::CDRecordWithData> &headers);
+
+  /// null if there is no entry of that name, otherwise name and position of the entry
+  const Item *find(const std::string &name) const;
+
+private:
+
+  std::vector<std::unordered_map<std::string, size_t>> m_Shards;
+
+};
@@ -0,0 +1,203 @@
+#include "OutputFile.h"
+#include "errors.h"
+#include <new>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+static uint8_t *allocateAligned(size_t size) {
+#ifdef _WIN32
+  void *result = _aligned_malloc(size, OutputFile::ALIGNMENT);
+#else
+  void *result = nullptr;
+  if (posix_memalign(&result, OutputFile::ALIGNMENT, size) != 0) {
+    result = nullptr;
+  }
+#endif
+  if (result == nullptr) {
+    throw std::bad_alloc();
+  }
+  return reinterpret_cast<uint8_t*>(result);
+}
+
+static void freeAligned(uint8_t *buffer) {
+#ifdef _WIN32
+  _aligned_free(buffer);
+#else
+  free(buffer);
+#endif
+}
+
+OutputFile::OutputFile(const char *path, uint64_t expectedSize, bool directIO, size_t bufferSize)
+  : m_DirectIO(directIO)
+  , m_BufferSize(std::max<size_t>((bufferSize + ALIGNMENT - 1) & ~(ALIGNMENT - 1), ALIGNMENT))
+  , m_Buffer(allocateAligned(m_BufferSize))
+  , m_BufferUsed(0)
+  , m_Offset(0)
+{
+#ifdef _WIN32
+  DWORD flags = directIO ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : FILE_FLAG_SEQUENTIAL_SCAN;
+  m_Handle = CreateFileA(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | flags, nullptr);
+  if (m_Handle == INVALID_HANDLE_VALUE) {
+    m_Handle = nullptr;
+  }
+  bool isOpen = m_Handle != nullptr;
+#else
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+  if (directIO) {
+    flags |= O_DIRECT;
+  }
+#endif
+  m_FD = ::open(path, flags, 0644);
+  bool isOpen = m_FD != -1;
+#endif
+
+  if (!isOpen) {
+    freeAligned(m_Buffer);
+    throw ErrorCodeException(ERROR_WRITE_FAILED);
+  }
+
+  preallocate(expectedSize);
+}
+
+OutputFile::~OutputFile() {
+  try {
+    close();
+  }
+  catch (...) {
+    closeHandle();
+  }
+  freeAligned(m_Buffer);
+}
+
+void OutputFile::write(const void *data, size_t size) {
+  const uint8_t *pos = reinterpret_cast<const uint8_t*>(data);
+  while (size > 0) {
+    size_t chunk = std::min(size, m_BufferSize - m_BufferUsed);
+    memcpy(m_Buffer + m_BufferUsed, pos, chunk);
+    m_BufferUsed += chunk;
+    m_Offset += chunk;
+    pos += chunk;
+    size -= chunk;
+
+    if (m_BufferUsed == m_BufferSize) {
+      flush(m_BufferSize);
+    }
+  }
+}
+
+void OutputFile::close() {
+#ifdef _WIN32
+  if (m_Handle == nullptr) {
+    return;
+  }
+#else
+  if (m_FD == -1) {
+    return;
+  }
+#endif
+
+  if (m_BufferUsed > 0) {
+    size_t size = m_BufferUsed;
+    if (m_DirectIO) {
+      // unbuffered writes have to be a multiple of the sector size, the padding is cut off again below
+      size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+      memset(m_Buffer + m_BufferUsed, 0, size - m_BufferUsed);
+    }
+    flush(size);
+  }
+
+  // the preallocation may have been larger than what was actually written
+  truncate(m_Offset);
+
+  closeHandle();
+}
+
+void OutputFile::closeHandle() {
+#ifdef _WIN32
+  if (m_Handle != nullptr) {
+    CloseHandle(m_Handle);
+    m_Handle = nullptr;
+  }
+#else
+  if (m_FD != -1) {
+    ::close(m_FD);
+    m_FD = -1;
+  }
+#endif
+}
+
+std::streamsize OutputFile::xsputn(const char *data, std::streamsize size) {
+  write(data, static_cast<size_t>(size));
+  return size;
+}
+
+OutputFile::int_type OutputFile::overflow(int_type ch) {
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    char data = traits_type::to_char_type(ch);
+    write(&data, 1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+void OutputFile::flush(size_t size) {
+  const uint8_t *pos = m_Buffer;
+  while (size > 0) {
+#ifdef _WIN32
+    DWORD written = 0;
+    if (!WriteFile(m_Handle, pos, static_cast<DWORD>(size), &written, nullptr)) {
+      throw ErrorCodeException(ERROR_WRITE_FAILED);
+    }
+#else
+    ssize_t written = ::write(m_FD, pos, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw ErrorCodeException(ERROR_WRITE_FAILED);
+    }
+#endif
+    pos += written;
+    size -= written;
+  }
+  m_BufferUsed = 0;
+}
+
+void OutputFile::preallocate(uint64_t size) {
+  if (size == 0) {
+    return;
+  }
+  // failure to preallocate isn't an error, the file just grows as it's being written
+#ifdef _WIN32
+  FILE_ALLOCATION_INFO info;
+  info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+  SetFileInformationByHandle(m_Handle, FileAllocationInfo, &info, sizeof(FILE_ALLOCATION_INFO));
+#elif defined(__linux__)
+  fallocate(m_FD, 0, 0, static_cast<off_t>(size));
+#endif
+}
+
+void OutputFile::truncate(uint64_t size) {
+#ifdef _WIN32
+  FILE_END_OF_FILE_INFO info;
+  info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+  if (!SetFileInformationByHandle(m_Handle, FileEndOfFileInfo, &info, sizeof(FILE_END_OF_FILE_INFO))) {
+    throw ErrorCodeException(ERROR_WRITE_FAILED);
+  }
+#else
+  if (ftruncate(m_FD, static_cast<off_t>(size)) != 0) {
+    throw ErrorCodeException(ERROR_WRITE_FAILED);
+  }
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <streambuf>
+#include <cstdint>
+
+/**
+ * sequential writer for large output files.
+ * The expected size is preallocated up front so the file doesn't grow piecemeal, data is collected in a
+ * large aligned buffer and written out in big batches. Optionally the os page cache can be bypassed
+ * (O_DIRECT / FILE_FLAG_NO_BUFFERING).
+ * The current write offset is tracked arithmetically, there is no need to query the os for it.
+ * This is a streambuf so it can be used anywhere a std::ostream is expected.
+ * All i/o errors are reported as an ErrorCodeException with ERROR_WRITE_FAILED so they aren't mistaken for
+ * errors of whatever produced the data.
+ */
+class OutputFile : public std::streambuf
+{
+public:
+
+  static const size_t BUFFER_SIZE = 8 * 1024 * 1024;
+  static const size_t ALIGNMENT = 4096;
+
+public:
+
+  /**
+   * @param path output file, will be overwritten if it exists
+   * @param expectedSize size the file is expected to have at the end. This is only used for preallocation,
+   *                     the file is truncated to the amount of data actually written on close
+   * @param directIO if true, bypass the os file cache
+   * @param bufferSize size of the write buffer, rounded up to the alignment. Small files don't need the full size
+   */
+  OutputFile(const char *path, uint64_t expectedSize, bool directIO, size_t bufferSize = BUFFER_SIZE);
+  ~OutputFile();
+
+  void write(const void *data, size_t size);
+
+  /// offset in the file at which the next write will happen
+  uint64_t offset() const { return m_Offset; }
+
+  /// write remaining data and close the file. Throws on error, unlike the destructor
+  void close();
+
+protected:
+
+  virtual std::streamsize xsputn(const char *data, std::streamsize size) override;
+  virtual int_type overflow(int_type ch) override;
+
+private:
+
+  OutputFile(const OutputFile&);
+  OutputFile &operator=(const OutputFile&);
+
+  void flush(size_t size);
+  void preallocate(uint64_t size);
+  void truncate(uint64_t size);
+  void closeHandle();
+
+private:
+
+#ifdef _WIN32
+  void *m_Handle;
+#else
+  int m_FD;
+#endif
+
+  bool m_DirectIO;
+
+  size_t m_BufferSize;
+  uint8_t *m_Buffer;
+  size_t m_BufferUsed;
+
+  uint64_t m_Offset;
+
+};
@@ -0,0 +1,169 @@
+#include "RandomAccessFile.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+// individual read/write calls are limited so the size always fits into the platform api types
+static const size_t MAX_IO_SIZE = 1 << 30;
+
+RandomAccessFile::RandomAccessFile(const char *path, Mode mode) {
+#ifdef _WIN32
+  DWORD access = mode == READ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+  DWORD disposition = mode == CREATE ? CREATE_ALWAYS : OPEN_EXISTING;
+  m_Handle = CreateFileA(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, disposition,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+  if (m_Handle == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("failed to open file");
+  }
+#else
+  int flags = mode == READ ? O_RDONLY : O_RDWR;
+  if (mode == CREATE) {
+    flags |= O_CREAT | O_TRUNC;
+  }
+  m_FD = ::open(path, flags, 0644);
+  if (m_FD == -1) {
+    throw std::runtime_error("failed to open file");
+  }
+#endif
+}
+
+RandomAccessFile::~RandomAccessFile() {
+#ifdef _WIN32
+  CloseHandle(m_Handle);
+#else
+  ::close(m_FD);
+#endif
+}
+
+uint64_t RandomAccessFile::size() const {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(m_Handle, &size)) {
+    throw std::runtime_error("failed to determine file size");
+  }
+  return static_cast<uint64_t>(size.QuadPart);
+#else
+  struct stat info;
+  if (fstat(m_FD, &info) != 0) {
+    throw std::runtime_error("failed to determine file size");
+  }
+  return static_cast<uint64_t>(info.st_size);
+#endif
+}
+
+void RandomAccessFile::readAt(uint64_t offset, void *buffer, size_t size) const {
+  char *pos = reinterpret_cast<char*>(buffer);
+  while (size > 0) {
+    size_t chunk = size < MAX_IO_SIZE ? size : MAX_IO_SIZE;
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read = 0;
+    if (!ReadFile(m_Handle, pos, static_cast<DWORD>(chunk), &read, &overlapped) || (read == 0)) {
+      throw std::runtime_error("failed to read file");
+    }
+#else
+    ssize_t read = ::pread(m_FD, pos, chunk, static_cast<off_t>(offset));
+    if (read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read <= 0) {
+      throw std::runtime_error("failed to read file");
+    }
+#endif
+    pos += read;
+    offset += read;
+    size -= read;
+  }
+}
+
+void RandomAccessFile::writeAt(uint64_t offset, const void *buffer, size_t size) {
+  const char *pos = reinterpret_cast<const char*>(buffer);
+  while (size > 0) {
+    size_t chunk = size < MAX_IO_SIZE ? size : MAX_IO_SIZE;
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD written = 0;
+    if (!WriteFile(m_Handle, pos, static_cast<DWORD>(chunk), &written, &overlapped)) {
+      throw std::runtime_error("failed to write file");
+    }
+#else
+    ssize_t written = ::pwrite(m_FD, pos, chunk, static_cast<off_t>(offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      throw std::runtime_error("failed to write file");
+    }
+#endif
+    pos += written;
+    offset += written;
+    size -= written;
+  }
+}
+
+void RandomAccessFile::truncate(uint64_t size) {
+#ifdef _WIN32
+  FILE_END_OF_FILE_INFO info;
+  info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+  if (!SetFileInformationByHandle(m_Handle, FileEndOfFileInfo, &info, sizeof(FILE_END_OF_FILE_INFO))) {
+    throw std::runtime_error("failed to set file size");
+  }
+#else
+  if (ftruncate(m_FD, static_cast<off_t>(size)) != 0) {
+    throw std::runtime_error("failed to set file size");
+  }
+#endif
+}
+
+bool RandomAccessFile::willNeed(uint64_t offset, uint64_t size) const {
+#ifdef _WIN32
+  // there is no readahead hint for a range of a file handle
+  (void)offset;
+  (void)size;
+  return false;
+#elif defined(__APPLE__)
+  while (size > 0) {
+    int chunk = static_cast<int>(size < MAX_IO_SIZE ? size : MAX_IO_SIZE);
+    struct radvisory advice;
+    advice.ra_offset = static_cast<off_t>(offset);
+    advice.ra_count = chunk;
+    if (fcntl(m_FD, F_RDADVISE, &advice) != 0) {
+      return false;
+    }
+    offset += chunk;
+    size -= chunk;
+  }
+  return true;
+#else
+  return posix_fadvise(m_FD, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_WILLNEED) == 0;
+#endif
+}
+
+void RandomAccessFile::sync() {
+#ifdef _WIN32
+  if (!FlushFileBuffers(m_Handle)) {
+    throw std::runtime_error("failed to flush file");
+  }
+#elif defined(__APPLE__)
+  if (fsync(m_FD) != 0) {
+    throw std::runtime_error("failed to flush file");
+  }
+#else
+  if (fdatasync(m_FD) != 0) {
+    throw std::runtime_error("failed to flush file");
+  }
+#endif
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * file accessed through positional reads and writes (pread/pwrite, ReadFile/WriteFile with an offset).
+ * There is no shared file position so positional operations don't interfere with each other.
+ */
+class RandomAccessFile
+{
+public:
+
+  enum Mode {
+    READ,
+    READ_WRITE,
+    // create or truncate the file for reading and writing
+    CREATE
+  };
+
+public:
+
+  /// throws a std::runtime_error if the file can't be opened
+  RandomAccessFile(const char *path, Mode mode);
+  ~RandomAccessFile();
+
+  uint64_t size() const;
+
+  /// read exactly size bytes at offset, throws if that many bytes can't be read
+  void readAt(uint64_t offset, void *buffer, size_t size) const;
+  void writeAt(uint64_t offset, const void *buffer, size_t size);
+
+  void truncate(uint64_t size);
+
+  /// hint that the range is going to be read soon so the os can start loading it in the background.
+  /// Returns false if the platform has no such hint
+  bool willNeed(uint64_t offset, uint64_t size) const;
+
+  /// flush data written so far to the storage device
+  void sync();
+
+private:
+
+  RandomAccessFile(const RandomAccessFile&);
+  RandomAccessFile &operator=(const RandomAccessFile&);
+
+private:
+
+#ifdef _WIN32
+  void *m_Handle;
+#else
+  int m_FD;
+#endif
+
+};
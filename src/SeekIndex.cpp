@@ -0,0 +1,322 @@
+#include "SeekIndex.h"
+#include <zlib.h>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t INDEX_MAGIC = 0x58444953; // SIDX
+static const uint32_t INDEX_VERSION = 1;
+static const uint32_t MAX_NAME_LENGTH = 64 * 1024;
+static const size_t INPUT_CHUNK_SIZE = 64 * 1024;
+
+#pragma pack(push)
+#pragma pack(1)
+
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t entryCount;
+};
+
+// followed by the name and the access points
+struct EntryHeader {
+  uint32_t nameLength;
+  uint32_t crc;
+  uint64_t sizeCompressed;
+  uint64_t sizeUncompressed;
+  uint64_t pointCount;
+};
+
+// followed by the window
+struct PointHeader {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset;
+  uint32_t bits;
+  uint32_t windowSize;
+};
+
+#pragma pack(pop)
+
+namespace {
+
+struct Inflater {
+  Inflater() {
+    memset(&stream, 0, sizeof(z_stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      throw std::bad_alloc();
+    }
+  }
+  ~Inflater() { inflateEnd(&stream); }
+  z_stream stream;
+};
+
+}
+
+std::string SeekIndex::pathFor(const char *archivePath) {
+  return std::string(archivePath) + ".seekindex";
+}
+
+SeekIndex SeekIndex::load(const char *path) {
+  std::ifstream input(path, std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    throw std::runtime_error("failed to open seek index");
+  }
+
+  auto read = [&input](void *buffer, size_t size) {
+    input.read(reinterpret_cast<char*>(buffer), size);
+    if (!input) {
+      throw std::runtime_error("seek index truncated");
+    }
+  };
+
+  IndexHeader header;
+  read(&header, sizeof(IndexHeader));
+  if ((header.magic != INDEX_MAGIC) || (header.version != INDEX_VERSION)) {
+    throw std::runtime_error("not a seek index");
+  }
+
+  SeekIndex result;
+  for (uint64_t i = 0; i < header.entryCount; ++i) {
+    EntryHeader entryHeader;
+    read(&entryHeader, sizeof(EntryHeader));
+    if (entryHeader.nameLength > MAX_NAME_LENGTH) {
+      throw std::runtime_error("seek index corrupted");
+    }
+    std::string name(entryHeader.nameLength, '\0');
+    read(&name[0], name.size());
+
+    std::shared_ptr<Entry> entry(new Entry());
+    entry->crc = entryHeader.crc;
+    entry->sizeCompressed = entryHeader.sizeCompressed;
+    entry->sizeUncompressed = entryHeader.sizeUncompressed;
+    for (uint64_t point = 0; point < entryHeader.pointCount; ++point) {
+      PointHeader pointHeader;
+      read(&pointHeader, sizeof(PointHeader));
+      // extract relies on points being in order and on a partial byte being preceded by its bits
+      bool ordered = entry->points.empty()
+        || ((pointHeader.uncompressedOffset > entry->points.back().uncompressedOffset)
+            && (pointHeader.compressedOffset >= entry->points.back().compressedOffset));
+      if ((pointHeader.bits > 7) || (pointHeader.windowSize > WINDOW_SIZE)
+          || (pointHeader.compressedOffset > entry->sizeCompressed)
+          || (pointHeader.uncompressedOffset > entry->sizeUncompressed)
+          || ((pointHeader.bits > 0) && (pointHeader.compressedOffset == 0))
+          || (pointHeader.windowSize != std::min<uint64_t>(pointHeader.uncompressedOffset, WINDOW_SIZE))
+          || !ordered) {
+        throw std::runtime_error("seek index corrupted");
+      }
+      AccessPoint accessPoint;
+      accessPoint.uncompressedOffset = pointHeader.uncompressedOffset;
+      accessPoint.compressedOffset = pointHeader.compressedOffset;
+      accessPoint.bits = pointHeader.bits;
+      accessPoint.window.resize(pointHeader.windowSize);
+      read(accessPoint.window.data(), accessPoint.window.size());
+      entry->points.push_back(std::move(accessPoint));
+    }
+    result.m_Entries[name] = entry;
+  }
+
+  return result;
+}
+
+void SeekIndex::save(const char *path) const {
+  std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!output.is_open()) {
+    throw std::runtime_error("failed to create seek index");
+  }
+
+  IndexHeader header;
+  header.magic = INDEX_MAGIC;
+  header.version = INDEX_VERSION;
+  header.entryCount = m_Entries.size();
+  output.write(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+
+  for (const auto &iter : m_Entries) {
+    const Entry &entry = *iter.second;
+    EntryHeader entryHeader;
+    entryHeader.nameLength = static_cast<uint32_t>(iter.first.size());
+    entryHeader.crc = entry.crc;
+    entryHeader.sizeCompressed = entry.sizeCompressed;
+    entryHeader.sizeUncompressed = entry.sizeUncompressed;
+    entryHeader.pointCount = entry.points.size();
+    output.write(reinterpret_cast<const char*>(&entryHeader), sizeof(EntryHeader));
+    output.write(iter.first.data(), iter.first.size());
+
+    for (const AccessPoint &point : entry.points) {
+      PointHeader pointHeader;
+      pointHeader.uncompressedOffset = point.uncompressedOffset;
+      pointHeader.compressedOffset = point.compressedOffset;
+      pointHeader.bits = point.bits;
+      pointHeader.windowSize = static_cast<uint32_t>(point.window.size());
+      output.write(reinterpret_cast<const char*>(&pointHeader), sizeof(PointHeader));
+      output.write(reinterpret_cast<const char*>(point.window.data()), point.window.size());
+    }
+  }
+
+  output.close();
+  if (!output) {
+    throw std::runtime_error("failed to write seek index");
+  }
+}
+
+std::shared_ptr<const SeekIndex::Entry> SeekIndex::find(const std::string &name, uint32_t crc,
+                                                        uint64_t sizeCompressed, uint64_t sizeUncompressed) const {
+  auto iter = m_Entries.find(name);
+  if ((iter == m_Entries.end())
+      || (iter->second->crc != crc)
+      || (iter->second->sizeCompressed != sizeCompressed)
+      || (iter->second->sizeUncompressed != sizeUncompressed)) {
+    return std::shared_ptr<const Entry>();
+  }
+  return iter->second;
+}
+
+void SeekIndex::set(const std::string &name, const std::shared_ptr<const Entry> &entry) {
+  m_Entries[name] = entry;
+}
+
+SeekIndex::Entry SeekIndex::build(const Source &source, uint32_t crc, uint64_t sizeCompressed, uint64_t sizeUncompressed, uint64_t spacing) {
+  Entry result;
+  result.crc = crc;
+  result.sizeCompressed = sizeCompressed;
+  result.sizeUncompressed = sizeUncompressed;
+
+  Inflater inflater;
+  z_stream &stream = inflater.stream;
+
+  std::vector<uint8_t> input(INPUT_CHUNK_SIZE);
+  // output goes round robin through the window buffer so it always holds the most recent data
+  std::vector<uint8_t> window(WINDOW_SIZE);
+
+  uint64_t readOffset = 0;
+  uint64_t totalIn = 0;
+  uint64_t totalOut = 0;
+  uint64_t last = 0;
+  int res = Z_OK;
+
+  stream.avail_out = 0;
+  do {
+    if ((stream.avail_in == 0) && (readOffset < sizeCompressed)) {
+      size_t chunk = static_cast<size_t>(std::min<uint64_t>(input.size(), sizeCompressed - readOffset));
+      source(readOffset, input.data(), chunk);
+      readOffset += chunk;
+      stream.next_in = input.data();
+      stream.avail_in = static_cast<uInt>(chunk);
+    }
+    if (stream.avail_out == 0) {
+      stream.next_out = window.data();
+      stream.avail_out = WINDOW_SIZE;
+    }
+
+    totalIn += stream.avail_in;
+    totalOut += stream.avail_out;
+    // Z_BLOCK returns at every block boundary
+    res = inflate(&stream, Z_BLOCK);
+    totalIn -= stream.avail_in;
+    totalOut -= stream.avail_out;
+
+    if (res == Z_BUF_ERROR) {
+      // no progress possible, the input ended before the deflate stream did
+      throw std::runtime_error("deflate stream truncated");
+    }
+    if ((res != Z_OK) && (res != Z_STREAM_END)) {
+      throw std::runtime_error("failed to inflate");
+    }
+
+    // bit 7 of data_type is set right after the end of a block, bit 6 while in the last block
+    bool blockBoundary = ((stream.data_type & 128) != 0) && ((stream.data_type & 64) == 0);
+    if ((res != Z_STREAM_END) && blockBoundary && (totalOut - last >= spacing)) {
+      AccessPoint point;
+      point.uncompressedOffset = totalOut;
+      point.compressedOffset = totalIn;
+      point.bits = static_cast<uint32_t>(stream.data_type & 7);
+
+      // the last min(totalOut, WINDOW_SIZE) bytes of output, in order
+      size_t windowSize = static_cast<size_t>(std::min<uint64_t>(totalOut, WINDOW_SIZE));
+      size_t head = WINDOW_SIZE - stream.avail_out;
+      point.window.resize(windowSize);
+      size_t fromTail = windowSize > head ? windowSize - head : 0;
+      memcpy(point.window.data(), window.data() + WINDOW_SIZE - fromTail, fromTail);
+      memcpy(point.window.data() + fromTail, window.data() + head - (windowSize - fromTail), windowSize - fromTail);
+
+      result.points.push_back(std::move(point));
+      last = totalOut;
+    }
+  } while (res != Z_STREAM_END);
+
+  return result;
+}
+
+size_t SeekIndex::extract(const Entry *index, const Source &source, uint64_t sizeCompressed,
+                          uint64_t offset, uint8_t *buffer, size_t size) {
+  const AccessPoint *point = nullptr;
+  if (index != nullptr) {
+    auto iter = std::upper_bound(index->points.begin(), index->points.end(), offset,
+      [](uint64_t value, const AccessPoint &point) { return value < point.uncompressedOffset; });
+    if (iter != index->points.begin()) {
+      point = &*(iter - 1);
+    }
+  }
+
+  Inflater inflater;
+  z_stream &stream = inflater.stream;
+
+  uint64_t readOffset = 0;
+  uint64_t skip = offset;
+  if (point != nullptr) {
+    readOffset = point->compressedOffset;
+    if (point->bits > 0) {
+      // the block starts within the previous byte
+      uint8_t partial;
+      source(--readOffset, &partial, 1);
+      ++readOffset;
+      inflatePrime(&stream, static_cast<int>(point->bits), partial >> (8 - point->bits));
+    }
+    if (!point->window.empty()) {
+      inflateSetDictionary(&stream, point->window.data(), static_cast<uInt>(point->window.size()));
+    }
+    skip = offset - point->uncompressedOffset;
+  }
+
+  std::vector<uint8_t> input(INPUT_CHUNK_SIZE);
+  std::vector<uint8_t> discard(skip > 0 ? WINDOW_SIZE : 0);
+
+  size_t written = 0;
+  int res = Z_OK;
+  while ((written < size) && (res != Z_STREAM_END)) {
+    if ((stream.avail_in == 0) && (readOffset < sizeCompressed)) {
+      size_t chunk = static_cast<size_t>(std::min<uint64_t>(input.size(), sizeCompressed - readOffset));
+      source(readOffset, input.data(), chunk);
+      readOffset += chunk;
+      stream.next_in = input.data();
+      stream.avail_in = static_cast<uInt>(chunk);
+    }
+
+    uInt available;
+    if (skip > 0) {
+      available = static_cast<uInt>(std::min<uint64_t>(skip, discard.size()));
+      stream.next_out = discard.data();
+    } else {
+      available = static_cast<uInt>(std::min<size_t>(size - written, 1 << 30));
+      stream.next_out = buffer + written;
+    }
+    stream.avail_out = available;
+
+    res = inflate(&stream, Z_NO_FLUSH);
+    if (res == Z_BUF_ERROR) {
+      throw std::runtime_error("deflate stream truncated");
+    }
+    if ((res != Z_OK) && (res != Z_STREAM_END)) {
+      throw std::runtime_error("failed to inflate");
+    }
+
+    size_t produced = available - stream.avail_out;
+    if (skip > 0) {
+      skip -= produced;
+    } else {
+      written += produced;
+    }
+  }
+
+  return written;
+}
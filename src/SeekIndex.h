@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * access points into deflate compressed entries, for reading a range of the uncompressed data without
+ * inflating everything before it (the approach of zlib's zran example).
+ * Each access point records the position of a deflate block boundary in the compressed and uncompressed
+ * data together with the 32KB of uncompressed data preceding it, which is all inflate needs to resume.
+ * The compressed offset is also the offset into the keystream of the entry so decryption can resume
+ * there as well.
+ * Indices are built in a full pass over an entry and stored next to the archive. An index is only used
+ * if crc and sizes still match the entry.
+ * Not thread safe, built indices are immutable though.
+ */
+class SeekIndex
+{
+public:
+
+  static const uint64_t DEFAULT_SPACING = 4 * 1024 * 1024;
+  static const uint32_t WINDOW_SIZE = 32768;
+
+  struct AccessPoint {
+    uint64_t uncompressedOffset;
+    /// offset of the first byte inflate hasn't fully consumed yet
+    uint64_t compressedOffset;
+    /// number of bits of the byte before compressedOffset that belong to the next block, 0-7
+    uint32_t bits;
+    /// uncompressed data preceding the access point, up to WINDOW_SIZE bytes
+    std::vector<uint8_t> window;
+  };
+
+  struct Entry {
+    uint32_t crc;
+    uint64_t sizeCompressed;
+    uint64_t sizeUncompressed;
+    std::vector<AccessPoint> points;
+  };
+
+  /// reads size bytes of (decrypted) compressed data at offset into buffer. Offset + size never exceed
+  /// the compressed size
+  typedef std::function<void(uint64_t offset, uint8_t *buffer, size_t size)> Source;
+
+public:
+
+  /// path of the index belonging to an archive
+  static std::string pathFor(const char *archivePath);
+
+  /// throws a std::runtime_error if the file can't be read or isn't a valid index
+  static SeekIndex load(const char *path);
+
+  /// inflate the whole entry, creating an access point roughly every spacing bytes of uncompressed data.
+  /// Throws a std::runtime_error if the data doesn't inflate
+  static Entry build(const Source &source, uint32_t crc, uint64_t sizeCompressed, uint64_t sizeUncompressed, uint64_t spacing);
+
+  /// inflate up to size bytes starting at the uncompressed offset, starting from the nearest access point
+  /// of index (which may be null). Returns the number of bytes written to buffer, less than size only at
+  /// the end of the data. Throws a std::runtime_error if the data doesn't inflate
+  static size_t extract(const Entry *index, const Source &source, uint64_t sizeCompressed,
+                        uint64_t offset, uint8_t *buffer, size_t size);
+
+  /// throws a std::runtime_error if the file can't be written
+  void save(const char *path) const;
+
+  /// index of the named entry, null if there is none or it doesn't match crc and sizes
+  std::shared_ptr<const Entry> find(const std::string &name, uint32_t crc, uint64_t sizeCompressed, uint64_t sizeUncompressed) const;
+
+  void set(const std::string &name, const std::shared_ptr<const Entry> &entry);
+
+private:
+
+  std::unordered_map<std::string, std::shared_ptr<const Entry>> m_Entries;
+
+};
@@ -0,0 +1,213 @@
+#include "ShardPlan.h"
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+using namespace ZipUtil;
+
+static const uint32_t PLAN_MAGIC = 0x4e4c5053; // SPLN
+static const uint32_t PLAN_VERSION = 1;
+static const uint32_t FRAGMENT_MAGIC = 0x47524653; // SFRG
+
+#pragma pack(push)
+#pragma pack(1)
+
+// followed by the shards and the directory
+struct PlanHeader {
+  uint32_t magic;
+  uint32_t version;
+  ShardPlan::Identity identity;
+  uint64_t shardCount;
+  uint64_t cdrSize;
+};
+
+// last bytes of a fragment, preceded by the entry offsets
+struct FragmentFooter {
+  uint64_t dataSize;
+  uint64_t entryCount;
+  uint32_t shard;
+  uint32_t magic;
+};
+
+#pragma pack(pop)
+
+ShardPlan ShardPlan::create(const Identity &identity, std::vector<CDRecordWithData> headers, size_t numShards) {
+  std::sort(headers.begin(), headers.end(), [](const CDRecordWithData &lhs, const CDRecordWithData &rhs) {
+    return lhs.localHeaderOffset < rhs.localHeaderOffset;
+    });
+
+  // the local headers and data descriptors aren't known without decrypting, the CDR data is close enough
+  std::vector<uint64_t> sizes;
+  sizes.reserve(headers.size());
+  uint64_t total = 0;
+  for (const CDRecordWithData &header : headers) {
+    sizes.push_back(sizeof(LocalFileHeader) + header.data.size() + header.sizeCompressed);
+    total += sizes.back();
+  }
+
+  ShardPlan result;
+  result.m_Identity = identity;
+  numShards = std::max<size_t>(std::min<size_t>(numShards, headers.size()), 1);
+
+  // each shard aims for an equal share of what the shards before it left over, so a large entry early on
+  // doesn't leave the later shards empty. Every shard gets at least one entry and leaves at least one
+  // for each of the shards after it
+  uint64_t entry = 0;
+  uint64_t remaining = total;
+  for (size_t shard = 0; shard < numShards; ++shard) {
+    size_t shardsAfter = numShards - shard - 1;
+    uint64_t target = remaining / (shardsAfter + 1);
+
+    Shard current;
+    current.firstEntry = entry;
+    current.size = 0;
+    while (entry < headers.size()) {
+      uint64_t next = current.size + sizes[entry];
+      // stop before the entry if the shards after need it or ending here is closer to the target
+      if ((shardsAfter > 0) && (current.size > 0)
+          && ((headers.size() - entry <= shardsAfter) || (current.size >= target)
+              || ((next > target) && (next - target >= target - current.size)))) {
+        break;
+      }
+      current.size = next;
+      ++entry;
+    }
+    current.endEntry = entry;
+    remaining -= current.size;
+    result.m_Shards.push_back(current);
+  }
+
+  result.m_Headers = std::move(headers);
+  return result;
+}
+
+ShardPlan ShardPlan::load(const char *path) {
+  std::ifstream input(path, std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    throw std::runtime_error("failed to open shard plan");
+  }
+
+  auto read = [&input](void *buffer, size_t size) {
+    input.read(reinterpret_cast<char*>(buffer), size);
+    if (!input) {
+      throw std::runtime_error("shard plan truncated");
+    }
+  };
+
+  input.seekg(0, std::ios::end);
+  uint64_t fileSize = static_cast<uint64_t>(input.tellg());
+  input.seekg(0);
+
+  PlanHeader header;
+  read(&header, sizeof(PlanHeader));
+  if ((header.magic != PLAN_MAGIC) || (header.version != PLAN_VERSION)) {
+    throw std::runtime_error("not a shard plan");
+  }
+  if ((header.shardCount > fileSize / sizeof(Shard))
+      || (sizeof(PlanHeader) + header.shardCount * sizeof(Shard) + header.cdrSize != fileSize)) {
+    throw std::runtime_error("shard plan corrupted");
+  }
+
+  ShardPlan result;
+  result.m_Identity = header.identity;
+  result.m_Shards.resize(static_cast<size_t>(header.shardCount));
+  if (!result.m_Shards.empty()) {
+    read(result.m_Shards.data(), result.m_Shards.size() * sizeof(Shard));
+  }
+
+  std::vector<uint8_t> cdr(static_cast<size_t>(header.cdrSize));
+  if (!cdr.empty()) {
+    read(cdr.data(), cdr.size());
+  }
+  CDREnd cdrEnd;
+  memset(&cdrEnd, 0, sizeof(CDREnd));
+  cdrEnd.entries = header.identity.entryCount;
+  result.m_Headers = readCDRecords(cdr, cdrEnd);
+
+  uint64_t expected = 0;
+  for (const Shard &shard : result.m_Shards) {
+    if ((shard.firstEntry != expected) || (shard.endEntry < shard.firstEntry)) {
+      throw std::runtime_error("shard plan corrupted");
+    }
+    expected = shard.endEntry;
+  }
+  if (expected != result.m_Headers.size()) {
+    throw std::runtime_error("shard plan corrupted");
+  }
+
+  return result;
+}
+
+void ShardPlan::save(const char *path) const {
+  // the regular CDR format keeps the 64 bit values in ZIP64 extra fields
+  std::vector<uint8_t> cdr;
+  for (const CDRecordWithData &header : m_Headers) {
+    writeCDRecord(header, cdr);
+  }
+
+  std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!output.is_open()) {
+    throw std::runtime_error("failed to create shard plan");
+  }
+
+  PlanHeader header;
+  header.magic = PLAN_MAGIC;
+  header.version = PLAN_VERSION;
+  header.identity = m_Identity;
+  header.identity.entryCount = m_Headers.size();
+  header.shardCount = m_Shards.size();
+  header.cdrSize = cdr.size();
+  output.write(reinterpret_cast<const char*>(&header), sizeof(PlanHeader));
+  output.write(reinterpret_cast<const char*>(m_Shards.data()), m_Shards.size() * sizeof(Shard));
+  output.write(reinterpret_cast<const char*>(cdr.data()), cdr.size());
+
+  output.close();
+  if (!output) {
+    throw std::runtime_error("failed to write shard plan");
+  }
+}
+
+std::vector<uint8_t> ShardPlan::fragmentTrailer(uint32_t shard, uint64_t dataSize, const std::vector<uint64_t> &offsets) {
+  FragmentFooter footer;
+  footer.dataSize = dataSize;
+  footer.entryCount = offsets.size();
+  footer.shard = shard;
+  footer.magic = FRAGMENT_MAGIC;
+
+  std::vector<uint8_t> result(offsets.size() * sizeof(uint64_t) + sizeof(FragmentFooter));
+  if (!offsets.empty()) {
+    memcpy(result.data(), offsets.data(), offsets.size() * sizeof(uint64_t));
+  }
+  memcpy(result.data() + offsets.size() * sizeof(uint64_t), &footer, sizeof(FragmentFooter));
+  return result;
+}
+
+ShardPlan::Fragment ShardPlan::readFragment(const RandomAccessFile &file) {
+  uint64_t fileSize = file.size();
+  if (fileSize < sizeof(FragmentFooter)) {
+    throw std::runtime_error("not a fragment");
+  }
+
+  FragmentFooter footer;
+  file.readAt(fileSize - sizeof(FragmentFooter), &footer, sizeof(FragmentFooter));
+  if ((footer.magic != FRAGMENT_MAGIC)
+      || (footer.entryCount > (fileSize - sizeof(FragmentFooter)) / sizeof(uint64_t))
+      || (footer.dataSize + footer.entryCount * sizeof(uint64_t) + sizeof(FragmentFooter) != fileSize)) {
+    throw std::runtime_error("not a fragment");
+  }
+
+  Fragment result;
+  result.shard = footer.shard;
+  result.dataSize = footer.dataSize;
+  result.offsets.resize(static_cast<size_t>(footer.entryCount));
+  if (!result.offsets.empty()) {
+    file.readAt(footer.dataSize, result.offsets.data(), result.offsets.size() * sizeof(uint64_t));
+  }
+  for (uint64_t offset : result.offsets) {
+    if (offset >= footer.dataSize) {
+      throw std::runtime_error("fragment corrupted");
+    }
+  }
+  return result;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ZipUtil.h"
+#include "RandomAccessFile.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/**
+ * split of an archive into shards that are decrypted independently, by separate processes or machines
+ * sharing the same storage, and then merged into one archive.
+ * The plan holds the decrypted directory, sorted by position in the archive, and which consecutive range
+ * of it belongs to each shard. Shards are balanced by the number of bytes they cover.
+ * Each shard is decrypted into a fragment: the decrypted entries, with offsets relative to the fragment,
+ * followed by the offset of each entry and a footer. Merging concatenates the fragment data and writes
+ * the directory with the offsets adjusted.
+ */
+class ShardPlan
+{
+public:
+
+  /// identifies the archive a plan belongs to
+  struct Identity {
+    uint64_t fileSize;
+    uint64_t cdrOffset;
+    uint64_t cdrSize;
+    uint64_t entryCount;
+  };
+
+  struct Shard {
+    /// range of entries in headers()
+    uint64_t firstEntry;
+    uint64_t endEntry;
+    /// bytes of the archive covered by the shard
+    uint64_t size;
+  };
+
+  struct Fragment {
+    uint32_t shard;
+    /// size of the decrypted entries at the start of the fragment
+    uint64_t dataSize;
+    /// offset of each entry of the shard relative to the start of the fragment
+    std::vector<uint64_t> offsets;
+  };
+
+public:
+
+  /// split the entries into numShards non-empty shards of about equal size, fewer if there are fewer entries. Headers get sorted by offset
+  static ShardPlan create(const Identity &identity, std::vector<ZipUtil::CDRecordWithData> headers, size_t numShards);
+
+  /// throws a std::runtime_error if the file can't be read or isn't a valid plan
+  static ShardPlan load(const char *path);
+
+  /// trailer to append to the decrypted data of a shard to complete the fragment
+  static std::vector<uint8_t> fragmentTrailer(uint32_t shard, uint64_t dataSize, const std::vector<uint64_t> &offsets);
+
+  /// read the trailer of a fragment. Throws a std::runtime_error if it isn't a valid fragment
+  static Fragment readFragment(const RandomAccessFile &file);
+
+  /// throws a std::runtime_error if the file can't be written
+  void save(const char *path) const;
+
+  const Identity &identity() const { return m_Identity; }
+  const std::vector<Shard> &shards() const { return m_Shards; }
+  const std::vector<ZipUtil::CDRecordWithData> &headers() const { return m_Headers; }
+
+private:
+
+  Identity m_Identity;
+  std::vector<Shard> m_Shards;
+  std::vector<ZipUtil::CDRecordWithData> m_Headers;
+
+};
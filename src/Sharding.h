@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * selection of one of 1 << Bits shards by hash, for containers split up so threads don't contend on a
+ * single lock or can each fill a part of their own.
+ * Hash tables pick buckets from the low bits of the hash (on some implementations without any mixing) and
+ * related keys often only differ in those, so the shard is taken from the high bits of the hash multiplied
+ * with the golden ratio. That spreads related keys over the shards and keeps the keys of a shard from
+ * clustering in its buckets.
+ */
+template <int Bits>
+class Sharding
+{
+public:
+
+  static const size_t COUNT = static_cast<size_t>(1) << Bits;
+
+public:
+
+  static size_t shardOf(size_t hash) {
+    uint64_t mixed = static_cast<uint64_t>(hash) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(mixed >> (64 - Bits));
+  }
+
+  /// equal part of a budget for each shard
+  static uint64_t share(uint64_t budget) {
+    return budget / COUNT;
+  }
+
+};
+
+template <int Bits>
+const size_t Sharding<Bits>::COUNT;
@@ -0,0 +1,118 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <future>
+
+ThreadPool::ThreadPool(size_t numThreads)
+  : m_Running(0)
+  , m_Stop(false)
+{
+  if (numThreads == 0) {
+    numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  m_Threads.reserve(numThreads);
+  for (size_t i = 0; i < numThreads; ++i) {
+    m_Threads.push_back(std::thread(&ThreadPool::run, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Idle.wait(lock, [this]() { return m_Tasks.empty() && (m_Running == 0); });
+    m_Stop = true;
+  }
+  m_TaskAvailable.notify_all();
+  for (std::thread &thread : m_Threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::submit(const std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Tasks.push_back(task);
+  }
+  m_TaskAvailable.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  m_Idle.wait(lock, [this]() { return m_Tasks.empty() && (m_Running == 0); });
+  if (m_Error) {
+    std::exception_ptr error = m_Error;
+    m_Error = std::exception_ptr();
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::run() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  while (true) {
+    m_TaskAvailable.wait(lock, [this]() { return m_Stop || !m_Tasks.empty(); });
+    if (m_Tasks.empty()) {
+      // stopping
+      return;
+    }
+
+    std::function<void()> task = std::move(m_Tasks.front());
+    m_Tasks.pop_front();
+    ++m_Running;
+    lock.unlock();
+
+    try {
+      task();
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> errorLock(m_Mutex);
+      if (!m_Error) {
+        m_Error = std::current_exception();
+      }
+    }
+
+    lock.lock();
+    --m_Running;
+    if (m_Tasks.empty() && (m_Running == 0)) {
+      m_Idle.notify_all();
+    }
+  }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t minRange, const std::function<void(size_t begin, size_t end)> &func) {
+  size_t numRanges = std::min<size_t>(std::max<size_t>(std::thread::hardware_concurrency(), 1),
+                                      count / std::max<size_t>(minRange, 1));
+  if (numRanges <= 1) {
+    if (count > 0) {
+      func(0, count);
+    }
+    return;
+  }
+
+  size_t rangeSize = (count + numRanges - 1) / numRanges;
+  std::vector<std::future<void>> ranges;
+  for (size_t begin = rangeSize; begin < count; begin += rangeSize) {
+    size_t end = std::min(begin + rangeSize, count);
+    ranges.push_back(std::async(std::launch::async, [&func, begin, end]() { func(begin, end); }));
+  }
+
+  std::exception_ptr error;
+  try {
+    func(0, std::min(rangeSize, count));
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+  for (std::future<void> &range : ranges) {
+    try {
+      range.get();
+    }
+    catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
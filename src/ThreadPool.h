@@ -0,0 +1,55 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+/**
+ * fixed size pool of worker threads processing a shared task queue
+ */
+class ThreadPool
+{
+public:
+
+  /// numThreads == 0 creates one thread per hardware thread
+  explicit ThreadPool(size_t numThreads = 0);
+  /// waits for queued tasks to complete
+  ~ThreadPool();
+
+  size_t size() const { return m_Threads.size(); }
+
+  void submit(const std::function<void()> &task);
+
+  /// block until all submitted tasks are completed. If a task threw an exception, the first one
+  /// is rethrown here
+  void wait();
+
+  /// split [0, count) into ranges of at least minRange items, about one per hardware thread, and process
+  /// them in parallel on short-lived threads. The calling thread takes part. If a range threw an exception,
+  /// the first one is rethrown once all ranges are done
+  static void parallelFor(size_t count, size_t minRange, const std::function<void(size_t begin, size_t end)> &func);
+
+private:
+
+  ThreadPool(const ThreadPool&);
+  ThreadPool &operator=(const ThreadPool&);
+
+  void run();
+
+private:
+
+  std::vector<std::thread> m_Threads;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_TaskAvailable;
+  std::condition_variable m_Idle;
+  std::deque<std::function<void()>> m_Tasks;
+  size_t m_Running;
+  bool m_Stop;
+  std::exception_ptr m_Error;
+
+};
@@ -6,6 +6,8 @@
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <cstring>
+#include <mutex>
 
 
 static const int PUBLIC_KEY_SIZE = 140;
@@ -22,35 +24,76 @@ public:
 
   static int registerHash(const ltc_hash_descriptor &descriptor);
   static int registerCipher(const ltc_cipher_descriptor &descriptor);
-  static int registerPRNG(const ltc_prng_descriptor &descriptor);
 
 public:
 
   TomCryptionImpl();
+  ~TomCryptionImpl();
 
   void loadKeys(const unsigned char *key, short keySize);
   std::vector<uint8_t> decryptKey(const uint8_t *input, unsigned long size, int padding);
   void decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv) const;
-  void decryptFileSection(std::istream &input, std::ostream &output, unsigned long size, CipherKey key, InitialVector iv, bool isData) const;
+  void decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv, uint64_t streamOffset) const;
+
+  KeySchedule scheduleKeys(const CipherKey *keys, int numKeys) const;
+  void decryptBatch(const KeySchedule &schedule, const DecryptRequest *requests, size_t count) const;
 
   Hash startHashSHA256() const;
 
+  bool verifySignature(const uint8_t *signature, unsigned long signatureSize, const std::vector<uint8_t> &digest) const;
+
+private:
+
+  // indices of the algorithms in the tomcrypt descriptor tables. These tables and the math descriptor
+  // are process-global so they get set up exactly once, no matter how many instances are alive on how
+  // many threads
+  struct Algorithms {
+    int md5;
+    int sha1;
+    int sha256;
+    int twofish;
+  };
+
+  static const Algorithms &algorithms();
+
 private:
 
   int m_MD5;
   int m_SHA1;
   int m_SHA256;
   int m_Twofish;
-  int m_Yarrow;
-
-  prng_state m_RNGState;
 
   uint8_t m_PublicKeyData[PUBLIC_KEY_SIZE];
 
   rsa_key m_PublicKey;
+  bool m_KeyLoaded;
+
+};
 
+
+class KeyScheduleImpl {
+public:
+  std::vector<symmetric_key> keys;
+
+  ~KeyScheduleImpl() {
+    for (symmetric_key &key : keys) {
+      twofish_done(&key);
+    }
+  }
 };
 
+KeySchedule::KeySchedule()
+  : m_Impl(new KeyScheduleImpl())
+{
+}
+
+KeySchedule::KeySchedule(KeySchedule &&reference)
+  : m_Impl(std::move(reference.m_Impl))
+{
+}
+
+KeySchedule::~KeySchedule() {
+}
 
 TomCryption::TomCryption()
   : m_Impl(new TomCryptionImpl())
@@ -73,28 +116,57 @@ void TomCryption::decryptData(uint8_t *buffer, unsigned long bufferSize, CipherK
   m_Impl->decryptData(buffer, bufferSize, key, iv);
 }
 
-void TomCryption::decryptFileSection(std::istream &input, std::ostream &output, unsigned long size, CipherKey key, InitialVector iv, bool isData) const {
-  m_Impl->decryptFileSection(input, output, size, key, iv, isData);
+void TomCryption::decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv, uint64_t streamOffset) const {
+  m_Impl->decryptData(buffer, bufferSize, key, iv, streamOffset);
+}
+
+KeySchedule TomCryption::scheduleKeys(const CipherKey *keys, int numKeys) const {
+  return m_Impl->scheduleKeys(keys, numKeys);
+}
+
+void TomCryption::decryptBatch(const KeySchedule &schedule, const DecryptRequest *requests, size_t count) const {
+  m_Impl->decryptBatch(schedule, requests, count);
 }
 
 Hash TomCryption::startHashSHA256() const {
   return m_Impl->startHashSHA256();
 }
 
+bool TomCryption::verifySignature(const uint8_t *signature, unsigned long signatureSize, const std::vector<uint8_t> &digest) const {
+  return m_Impl->verifySignature(signature, signatureSize, digest);
+}
+
 TomCryptionImpl::TomCryptionImpl()
-  : m_MD5(registerHash(md5_desc))
-  , m_SHA1(registerHash(sha1_desc))
-  , m_SHA256(registerHash(sha256_desc))
-  , m_Twofish(registerCipher(twofish_desc))
-  , m_Yarrow(registerPRNG(yarrow_desc))
+  : m_MD5(algorithms().md5)
+  , m_SHA1(algorithms().sha1)
+  , m_SHA256(algorithms().sha256)
+  , m_Twofish(algorithms().twofish)
+  , m_KeyLoaded(false)
 {
-  ltc_mp = ltm_desc;
+  // no prng gets seeded here: reading an archive only requires public key operations and pulling
+  // system entropy on every open is expensive
+}
 
-  int make_prng_result = rng_make_prng(128, m_Yarrow, &m_RNGState, nullptr);
+TomCryptionImpl::~TomCryptionImpl() {
+  if (m_KeyLoaded) {
+    rsa_free(&m_PublicKey);
+  }
+}
+
+const TomCryptionImpl::Algorithms &TomCryptionImpl::algorithms() {
+  static Algorithms s_Algorithms;
+  static std::once_flag s_Registered;
+
+  std::call_once(s_Registered, []() {
+    ltc_mp = ltm_desc;
 
-  int md5 = find_hash("md5");
-  int sha256 = find_hash("sha256");
-  int prngIndex = find_prng("yarrow");
+    s_Algorithms.md5 = registerHash(md5_desc);
+    s_Algorithms.sha1 = registerHash(sha1_desc);
+    s_Algorithms.sha256 = registerHash(sha256_desc);
+    s_Algorithms.twofish = registerCipher(twofish_desc);
+  });
+
+  return s_Algorithms;
 }
 
 
@@ -114,17 +186,14 @@ int TomCryptionImpl::registerCipher(const ltc_cipher_descriptor &descriptor) {
   return res;
 }
 
-int TomCryptionImpl::registerPRNG(const ltc_prng_descriptor &descriptor) {
-  int res = register_prng(&descriptor);
-  if (res == -1) {
-    throw std::runtime_error("failed to register PRNG algorithm");
-  }
-  return res;
-}
-
 void TomCryptionImpl::loadKeys(const unsigned char *key, short keySize) {
+  if (m_KeyLoaded) {
+    rsa_free(&m_PublicKey);
+    m_KeyLoaded = false;
+  }
   memcpy(m_PublicKeyData, key, keySize);
   checked(rsa_import(m_PublicKeyData, keySize, &m_PublicKey), "Invalid public key (error: {1})");
+  m_KeyLoaded = true;
 }
 
 void TomCryptionImpl::decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv) const {
@@ -137,19 +206,152 @@ void TomCryptionImpl::decryptData(uint8_t *buffer, unsigned long bufferSize, Cip
   checked(ctr_done(&counter), "failed to finalize decoding");
 }
 
-void TomCryptionImpl::decryptFileSection(std::istream &input, std::ostream &output, unsigned long size, CipherKey key, InitialVector iv, bool isData) const {
-  std::vector<uint8_t> buffer(size);
+// the counter is a 128 bit little endian number that starts at the iv and is incremented for each
+// block, so the keystream at an arbitrary position can be produced by advancing it directly
+static void advanceCounter(const uint8_t *iv, uint64_t blocks, uint8_t *counter) {
+  uint64_t carry = blocks;
+  for (int i = 0; i < BLOCK_CIPHER_KEY_LENGTH; ++i) {
+    uint64_t sum = iv[i] + (carry & 0xFF);
+    counter[i] = static_cast<uint8_t>(sum & 0xFF);
+    carry = (carry >> 8) + (sum >> 8);
+  }
+}
+
+static void incrementCounter(uint8_t *counter) {
+  for (int i = 0; i < BLOCK_CIPHER_KEY_LENGTH; ++i) {
+    if (++counter[i] != 0) {
+      break;
+    }
+  }
+}
+
+void TomCryptionImpl::decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv, uint64_t streamOffset) const {
+  InitialVector counterStart;
+  advanceCounter(iv, streamOffset / BLOCK_CIPHER_KEY_LENGTH, counterStart);
+
+  symmetric_CTR counter;
+
+  checked(ctr_start(m_Twofish, counterStart, key, BLOCK_CIPHER_KEY_LENGTH, 0, CTR_COUNTER_LITTLE_ENDIAN, &counter),
+    "Failed to start decoding");
+
+  unsigned long skip = static_cast<unsigned long>(streamOffset % BLOCK_CIPHER_KEY_LENGTH);
+  if (skip > 0) {
+    uint8_t discard[BLOCK_CIPHER_KEY_LENGTH];
+    checked(ctr_decrypt(discard, discard, skip, &counter), "failed to decode");
+  }
+
+  checked(ctr_decrypt(buffer, buffer, bufferSize, &counter), "failed to decode");
+  checked(ctr_done(&counter), "failed to finalize decoding");
+}
 
-  input.read(reinterpret_cast<char*>(&buffer[0]), size);
-  decryptData(&buffer[0], size, key, iv);
+KeySchedule TomCryptionImpl::scheduleKeys(const CipherKey *keys, int numKeys) const {
+  KeySchedule result;
+  result.m_Impl->keys.reserve(numKeys);
+  for (int i = 0; i < numKeys; ++i) {
+    symmetric_key key;
+    checked(twofish_setup(keys[i], BLOCK_CIPHER_KEY_LENGTH, 0, &key), "failed to set up key");
+    result.m_Impl->keys.push_back(key);
+  }
+  return result;
+}
 
-  output.write(reinterpret_cast<char*>(&buffer[0]), buffer.size());
+void TomCryptionImpl::decryptBatch(const KeySchedule &schedule, const DecryptRequest *requests, size_t count) const {
+  // counter blocks of all requests using one key are collected in a buffer, encrypted in one pass and the
+  // resulting keystream applied to each request. A request may span several passes
+  static const size_t PASS_BLOCKS = 256;
+
+  struct Span {
+    uint8_t *target;
+    size_t size;
+    size_t keystreamOffset;
+  };
+
+  std::vector<symmetric_key> &keys = schedule.m_Impl->keys;
+
+  std::vector<size_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    if ((requests[i].keyIndex < 0) || (static_cast<size_t>(requests[i].keyIndex) >= keys.size())) {
+      throw std::runtime_error("invalid key index");
+    }
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return requests[lhs].keyIndex < requests[rhs].keyIndex;
+    });
+
+  uint8_t keystream[PASS_BLOCKS * BLOCK_CIPHER_KEY_LENGTH];
+  Span spans[PASS_BLOCKS];
+  size_t numBlocks = 0;
+  size_t numSpans = 0;
+
+  auto runPass = [&](symmetric_key &key) {
+    for (size_t block = 0; block < numBlocks; ++block) {
+      uint8_t *pos = keystream + block * BLOCK_CIPHER_KEY_LENGTH;
+      checked(twofish_ecb_encrypt(pos, pos, &key), "failed to decode");
+    }
+    for (size_t span = 0; span < numSpans; ++span) {
+      const uint8_t *source = keystream + spans[span].keystreamOffset;
+      for (size_t i = 0; i < spans[span].size; ++i) {
+        spans[span].target[i] ^= source[i];
+      }
+    }
+    numBlocks = 0;
+    numSpans = 0;
+  };
+
+  for (size_t idx = 0; idx < order.size(); ++idx) {
+    const DecryptRequest &request = requests[order[idx]];
+    symmetric_key &key = keys[request.keyIndex];
+
+    size_t skip = static_cast<size_t>(request.streamOffset % BLOCK_CIPHER_KEY_LENGTH);
+    uint8_t counter[BLOCK_CIPHER_KEY_LENGTH];
+    advanceCounter(request.iv, request.streamOffset / BLOCK_CIPHER_KEY_LENGTH, counter);
+
+    // request bytes [done, size) still need keystream, the next block starts at request byte done - skip
+    size_t done = 0;
+    while (done < request.size) {
+      if (numBlocks == PASS_BLOCKS) {
+        runPass(key);
+      }
+      size_t blocks = std::min<size_t>(PASS_BLOCKS - numBlocks, (skip + request.size - done + BLOCK_CIPHER_KEY_LENGTH - 1) / BLOCK_CIPHER_KEY_LENGTH);
+      size_t bytes = std::min<size_t>(blocks * BLOCK_CIPHER_KEY_LENGTH - skip, request.size - done);
+
+      spans[numSpans].target = request.buffer + done;
+      spans[numSpans].size = bytes;
+      spans[numSpans].keystreamOffset = numBlocks * BLOCK_CIPHER_KEY_LENGTH + skip;
+      ++numSpans;
+
+      for (size_t block = 0; block < blocks; ++block) {
+        memcpy(keystream + (numBlocks++) * BLOCK_CIPHER_KEY_LENGTH, counter, BLOCK_CIPHER_KEY_LENGTH);
+        incrementCounter(counter);
+      }
+
+      done += bytes;
+      skip = 0;
+    }
+
+    // a pass only ever uses one key
+    if ((idx + 1 == order.size()) || (requests[order[idx + 1]].keyIndex != request.keyIndex)) {
+      runPass(key);
+    }
+  }
 }
 
 Hash TomCryptionImpl::startHashSHA256() const {
   return Hash(m_SHA256);
 }
 
+bool TomCryptionImpl::verifySignature(const uint8_t *signature, unsigned long signatureSize, const std::vector<uint8_t> &digest) const {
+  if (!m_KeyLoaded) {
+    throw std::runtime_error("no key loaded");
+  }
+
+  int stat = 0;
+  int res = rsa_verify_hash_ex(signature, signatureSize, digest.data(), static_cast<unsigned long>(digest.size()),
+                               LTC_PKCS_1_PSS, m_SHA256, 0, &stat, &m_PublicKey);
+  return (res == CRYPT_OK) && (stat == 1);
+}
+
 std::vector<uint8_t> TomCryptionImpl::decryptKey(const uint8_t *input, unsigned long size, int padding) {
   if ((padding != LTC_PKCS_1_V1_5) && (padding != LTC_PKCS_1_OAEP)) {
     throw std::runtime_error("invalid padding");
@@ -200,7 +402,7 @@ public:
   }
 
   std::vector<uint8_t> digest() {
-    std::vector<uint8_t> result(32);
+    std::vector<uint8_t> result(hash_descriptor[m_HashId].hashsize);
     hash_descriptor[m_HashId].done(&m_State, &result[0]);
     return result;
   }
@@ -214,6 +416,14 @@ Hash::Hash(int hashId)
 {
 }
 
+Hash::Hash(Hash &&reference)
+  : m_Impl(std::move(reference.m_Impl))
+{
+}
+
+Hash::~Hash() {
+}
+
 Hash &Hash::process(const uint8_t * data, unsigned long dataSize) {
   m_Impl->process(data, dataSize);
   return *this;
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <cstdint>
 
 class TomCryptionImpl;
+class KeyScheduleImpl;
 class HashImpl;
 class FileDecoder;
 
@@ -21,6 +23,8 @@ typedef uint8_t InitialVector[BLOCK_CIPHER_KEY_LENGTH];
 class Hash {
 public:
   Hash(int hashId);
+  Hash(Hash &&reference);
+  ~Hash();
 
   Hash &process(const uint8_t *data, unsigned long dataSize);
 
@@ -28,7 +32,45 @@ public:
 
 private:
 
-  HashImpl *m_Impl;
+  Hash(const Hash&);
+  Hash &operator=(const Hash&);
+
+private:
+
+  std::unique_ptr<HashImpl> m_Impl;
+};
+
+/**
+ * prepared (expanded) twofish keys. Expanding a key costs far more than decrypting the few blocks of a
+ * small entry so when decrypting many pieces this should be set up once and reused
+ */
+class KeySchedule {
+public:
+  KeySchedule(KeySchedule &&reference);
+  ~KeySchedule();
+
+private:
+
+  friend class TomCryptionImpl;
+
+  KeySchedule();
+  KeySchedule(const KeySchedule&);
+  KeySchedule &operator=(const KeySchedule&);
+
+private:
+
+  std::unique_ptr<KeyScheduleImpl> m_Impl;
+};
+
+/// a piece of data for TomCryption::decryptBatch
+struct DecryptRequest {
+  uint8_t *buffer;
+  unsigned long size;
+  /// index into the keys the schedule was created from
+  int keyIndex;
+  const uint8_t *iv;
+  /// position of buffer relative to the start of the section
+  uint64_t streamOffset;
 };
 
 /**
@@ -45,10 +87,20 @@ public:
 
   std::vector<uint8_t> decryptKey(const uint8_t *input, unsigned long size, int padding);
   void decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv) const;
-  void decryptFileSection(std::istream &input, std::ostream &output, unsigned long size, CipherKey key, InitialVector iv, bool isData) const;
+  /// decrypt a part of a section, streamOffset being the position of buffer relative to the start of the section
+  void decryptData(uint8_t *buffer, unsigned long bufferSize, CipherKey key, InitialVector iv, uint64_t streamOffset) const;
+
+  KeySchedule scheduleKeys(const CipherKey *keys, int numKeys) const;
+
+  /// decrypt any number of pieces, each with its own key and iv, in one go. The keystream for all pieces
+  /// using the same key is generated together with the prepared keys, without any per-piece setup
+  void decryptBatch(const KeySchedule &schedule, const DecryptRequest *requests, size_t count) const;
 
   Hash startHashSHA256() const;
 
+  /// verify an RSA (PKCS #1 PSS) signature over a SHA256 digest with the loaded public key
+  bool verifySignature(const uint8_t *signature, unsigned long signatureSize, const std::vector<uint8_t> &digest) const;
+
 private:
   
   TomCryptionImpl *m_Impl;
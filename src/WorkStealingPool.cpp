@@ -0,0 +1,126 @@
+#include "WorkStealingPool.h"
+#include <algorithm>
+
+// pool and index of the worker running on the current thread, if any
+static thread_local const WorkStealingPool *s_CurrentPool = nullptr;
+static thread_local size_t s_CurrentWorker = 0;
+
+WorkStealingPool::WorkStealingPool(size_t numThreads)
+  : m_Pending(0)
+  , m_Queued(0)
+  , m_NextQueue(0)
+  , m_Stop(false)
+{
+  if (numThreads == 0) {
+    numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  m_Workers.reserve(numThreads);
+  for (size_t i = 0; i < numThreads; ++i) {
+    m_Workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  }
+  // the queues have to exist before any thread tries to steal from them
+  for (size_t i = 0; i < numThreads; ++i) {
+    m_Workers[i]->thread = std::thread(&WorkStealingPool::run, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Idle.wait(lock, [this]() { return m_Pending == 0; });
+    m_Stop = true;
+  }
+  m_TaskAvailable.notify_all();
+  for (const std::unique_ptr<Worker> &worker : m_Workers) {
+    worker->thread.join();
+  }
+}
+
+void WorkStealingPool::submit(const std::function<void()> &task) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  ++m_Pending;
+
+  size_t queue;
+  if (s_CurrentPool == this) {
+    queue = s_CurrentWorker;
+  } else {
+    queue = m_NextQueue;
+    m_NextQueue = (m_NextQueue + 1) % m_Workers.size();
+  }
+
+  {
+    std::lock_guard<std::mutex> queueLock(m_Workers[queue]->mutex);
+    m_Workers[queue]->tasks.push_back(task);
+  }
+  ++m_Queued;
+  m_TaskAvailable.notify_one();
+}
+
+void WorkStealingPool::wait() {
+  std::unique_lock<std::mutex> lock(m_Mutex);
+  m_Idle.wait(lock, [this]() { return m_Pending == 0; });
+  if (m_Error) {
+    std::exception_ptr error = m_Error;
+    m_Error = std::exception_ptr();
+    std::rethrow_exception(error);
+  }
+}
+
+bool WorkStealingPool::take(size_t index, std::function<void()> &task) {
+  {
+    Worker &own = *m_Workers[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      --m_Queued;
+      return true;
+    }
+  }
+
+  for (size_t offset = 1; offset < m_Workers.size(); ++offset) {
+    Worker &victim = *m_Workers[(index + offset) % m_Workers.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      --m_Queued;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void WorkStealingPool::run(size_t index) {
+  s_CurrentPool = this;
+  s_CurrentWorker = index;
+
+  while (true) {
+    std::function<void()> task;
+    if (!take(index, task)) {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_TaskAvailable.wait(lock, [this]() { return m_Stop || (m_Queued > 0); });
+      if (m_Stop && (m_Queued == 0)) {
+        return;
+      }
+      continue;
+    }
+
+    try {
+      task();
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> errorLock(m_Mutex);
+      if (!m_Error) {
+        m_Error = std::current_exception();
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (--m_Pending == 0) {
+      m_Idle.notify_all();
+    }
+  }
+}
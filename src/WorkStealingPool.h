@@ -0,0 +1,69 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <atomic>
+
+/**
+ * pool of worker threads, each with its own task queue.
+ * Tasks submitted from within a task go to the queue of the worker running it and are processed
+ * newest first, so a worker finishes the work it split up before starting on something new. Workers
+ * that run out of tasks steal the oldest ones from the other queues, which keeps all threads busy
+ * until everything is done, even if the work isn't evenly distributed.
+ */
+class WorkStealingPool
+{
+public:
+
+  /// numThreads == 0 creates one thread per hardware thread
+  explicit WorkStealingPool(size_t numThreads = 0);
+  /// waits for queued tasks to complete
+  ~WorkStealingPool();
+
+  size_t size() const { return m_Workers.size(); }
+
+  void submit(const std::function<void()> &task);
+
+  /// block until all submitted tasks, including those they submitted, are completed. If a task threw an
+  /// exception, the first one is rethrown here
+  void wait();
+
+private:
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+  };
+
+private:
+
+  WorkStealingPool(const WorkStealingPool&);
+  WorkStealingPool &operator=(const WorkStealingPool&);
+
+  void run(size_t index);
+  bool take(size_t index, std::function<void()> &task);
+
+private:
+
+  std::vector<std::unique_ptr<Worker>> m_Workers;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_TaskAvailable;
+  std::condition_variable m_Idle;
+  // submitted tasks that haven't completed yet
+  size_t m_Pending;
+  // tasks waiting in any of the queues. Only incremented while holding m_Mutex so idle workers can't
+  // miss a new task
+  std::atomic<size_t> m_Queued;
+  size_t m_NextQueue;
+  bool m_Stop;
+  std::exception_ptr m_Error;
+
+};
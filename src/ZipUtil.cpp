@@ -1,8 +1,24 @@
 #include "ZipUtil.h"
+#include "ThreadPool.h"
 #include <tomcrypt.h>
 #include <istream>
+#include <algorithm>
+#include <stdexcept>
 
 static const char CDR_SIGNATURE[] = { 0x50, 0x4b, 0x05, 0x06 };
+static const uint32_t CDR_END_SIGNATURE = 0x06054b50;
+static const uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+static const uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+static const uint16_t ZIP64_EXTRA_ID = 0x0001;
+// directories of large archives are decrypted and parsed on multiple threads in pieces of at least this size
+static const size_t CDR_MIN_DECRYPT_RANGE = 256 * 1024;
+static const size_t CDR_MIN_PARSE_RANGE = 8192;
+static const size_t CTR_BLOCK_SIZE = 16;
+// version needed to extract ZIP64 archives
+static const uint16_t ZIP64_VERSION = 45;
+static const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+// general purpose flag: crc and sizes are in a data descriptor after the data
+static const uint16_t DATA_DESCRIPTOR_FLAG = 0x08;
 
 namespace ZipUtil {
 
@@ -48,25 +64,57 @@ namespace ZipUtil {
     throw std::runtime_error("CDR end record not found");
   }
 
-  CDREndRecord CDREndRecord::from(std::istream &input) {
-    std::streamoff cdr = FindCDREndRecord(input);
-    input.seekg(cdr);
+  CDREnd CDREnd::from(std::istream &input) {
+    std::streamoff endRecordOffset = FindCDREndRecord(input);
+
+    CDREnd result;
+    input.seekg(endRecordOffset);
+    input.read(reinterpret_cast<char*>(&result.record), sizeof(CDREndRecord));
+    result.offset = result.record.offset;
+    result.size = result.record.size;
+    result.entries = result.record.entriesTotal;
+
+    // in ZIP64 archives the end record is preceded by a locator pointing to the ZIP64 end record
+    if (endRecordOffset >= static_cast<std::streamoff>(sizeof(Zip64EndLocator))) {
+      Zip64EndLocator locator;
+      input.seekg(endRecordOffset - static_cast<std::streamoff>(sizeof(Zip64EndLocator)));
+      input.read(reinterpret_cast<char*>(&locator), sizeof(Zip64EndLocator));
+      if (input && (locator.signature == ZIP64_LOCATOR_SIGNATURE)) {
+        Zip64EndRecord zip64Record;
+        input.seekg(locator.endRecordOffset);
+        input.read(reinterpret_cast<char*>(&zip64Record), sizeof(Zip64EndRecord));
+        if (!input || (zip64Record.signature != ZIP64_END_SIGNATURE)) {
+          throw std::runtime_error("ZIP64 end record not found");
+        }
+        result.offset = zip64Record.offset;
+        result.size = zip64Record.size;
+        result.entries = zip64Record.entriesTotal;
+      }
+    }
 
-    CDREndRecord result;
-    input.read(reinterpret_cast<char*>(&result), sizeof(CDREndRecord));
+    input.clear();
+    input.seekg(endRecordOffset + static_cast<std::streamoff>(sizeof(CDREndRecord)));
     return result;
   }
 
-  CryEngineDecryptionKeys CryEngineDecryptionKeys::readFrom(std::istream &input, TomCryption &crypto) {
-    CryEngineDecryptionKeys result;
-
+  CryEngineEncryptionHeader readEncryptionHeader(std::istream &input) {
     CryEngineEncryptionHeader encHeader;
     input.read(reinterpret_cast<char*>(&encHeader), sizeof(CryEngineEncryptionHeader));
 
-    if (encHeader.headerSize != sizeof(CryEngineEncryptionHeader)) {
+    if (!input || (encHeader.headerSize != sizeof(CryEngineEncryptionHeader))) {
       throw std::runtime_error("encryption header corrupted");
     }
 
+    return encHeader;
+  }
+
+  CryEngineDecryptionKeys CryEngineDecryptionKeys::readFrom(std::istream &input, TomCryption &crypto) {
+    return unwrap(readEncryptionHeader(input), crypto);
+  }
+
+  CryEngineDecryptionKeys CryEngineDecryptionKeys::unwrap(const CryEngineEncryptionHeader &encHeader, TomCryption &crypto) {
+    CryEngineDecryptionKeys result;
+
     for (int i = 0; i < BLOCK_CIPHER_NUM_KEYS; ++i) {
       std::vector<uint8_t> decryptBuffer = crypto.decryptKey(encHeader.keys[i], RSA_KEY_MESSAGE_LENGTH, LTC_PKCS_1_OAEP);
       memcpy(result.cipherKeyTable[i], decryptBuffer.data(), BLOCK_CIPHER_KEY_LENGTH);
@@ -83,70 +131,236 @@ namespace ZipUtil {
   uint16_t convertMethod(uint16_t input) {
     CompressionMethod result = static_cast<CompressionMethod>(input);
     switch (result) {
-    case CompressionMethod::DeflateandStreamcipherKeytable: result = CompressionMethod::Deflate;
-    case CompressionMethod::StoreAndStreamcipherKeytable: result = CompressionMethod::Store;
+    case CompressionMethod::DeflateandStreamcipherKeytable: result = CompressionMethod::Deflate; break;
+    case CompressionMethod::StoreAndStreamcipherKeytable: result = CompressionMethod::Store; break;
+    default: break;
     }
     return static_cast<uint16_t>(result);
   }
 
-  std::vector<uint8_t> decryptCDR(std::istream &input, const CDREndRecord &cdrEndRecord, const TomCryption &crypto,
+  std::vector<uint8_t> decryptCDR(std::istream &input, const CDREnd &cdrEnd, const TomCryption &crypto,
                                   CipherKey key, InitialVector iv) {
-    std::vector<uint8_t> cdrBuffer(cdrEndRecord.size);
-    input.seekg(cdrEndRecord.offset);
-    input.read(reinterpret_cast<char*>(&cdrBuffer[0]), cdrEndRecord.size);
-
-    crypto.decryptData(cdrBuffer.data(), cdrEndRecord.size, key, iv);
+    std::vector<uint8_t> cdrBuffer(static_cast<size_t>(cdrEnd.size));
+    input.seekg(cdrEnd.offset);
+    input.read(reinterpret_cast<char*>(&cdrBuffer[0]), cdrBuffer.size());
+
+    // ctr mode can start anywhere in the keystream so block aligned pieces decrypt independently
+    size_t numBlocks = (cdrBuffer.size() + CTR_BLOCK_SIZE - 1) / CTR_BLOCK_SIZE;
+    ThreadPool::parallelFor(numBlocks, CDR_MIN_DECRYPT_RANGE / CTR_BLOCK_SIZE, [&](size_t begin, size_t end) {
+      size_t offset = begin * CTR_BLOCK_SIZE;
+      size_t size = std::min(end * CTR_BLOCK_SIZE, cdrBuffer.size()) - offset;
+      crypto.decryptData(cdrBuffer.data() + offset, static_cast<unsigned long>(size), key, iv, offset);
+    });
     return cdrBuffer;
   }
 
-  void decryptFile(std::istream &input, std::ostream &output, const TomCryption &crypto,
-                   const LocalFileHeader &localHeader, long sizeCompressed,
-                   CipherKey key, InitialVector iv) {
-    long localHeaderLength = sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
-    crypto.decryptFileSection(input, output, localHeaderLength, key, iv, false);
-    if (sizeCompressed > 0) {
-      crypto.decryptFileSection(input, output, sizeCompressed, key, iv, true);
+  unsigned long getDataDescriptorSize(const uint8_t possibleSignature[4], bool zip64) {
+    // crc and both sizes, the sizes are 64 bit in ZIP64 entries
+    unsigned long result = zip64 ? sizeof(uint32_t) + 2 * sizeof(uint64_t) : sizeof(DataDescriptor);
+    if (memcmp(possibleSignature, CDR_SIGNATURE, 4)) {
+      result += sizeof(uint32_t);
     }
+    return result;
+  }
 
-    if ((localHeader.flags & 0x08) != 0) {
-      unsigned long extraSize = sizeof(DataDescriptor);
-      std::streampos inPos = input.tellg();
-
-      //Check for the extra optional signature of the extended section
-      uint8_t possibleSignature[4];
-      input.read(reinterpret_cast<char*>(&possibleSignature), 4);
+  // take the 64 bit values from the ZIP64 extra field. It only contains the values the record holds the marker for
+  static void readZip64Extra(CDRecordWithData &entry) {
+    const uint8_t *pos = entry.data.data() + entry.record.nameLength;
+    const uint8_t *end = pos + entry.record.extraFieldLength;
+    while (pos + 4 <= end) {
+      uint16_t id = *reinterpret_cast<const uint16_t*>(pos);
+      uint16_t size = *reinterpret_cast<const uint16_t*>(pos + 2);
+      pos += 4;
+      if (pos + size > end) {
+        throw std::runtime_error("invalid extra field");
+      }
+      if (id == ZIP64_EXTRA_ID) {
+        const uint8_t *value = pos;
+        auto next = [&](uint64_t &target) {
+          if (value + sizeof(uint64_t) > pos + size) {
+            throw std::runtime_error("invalid ZIP64 extra field");
+          }
+          memcpy(&target, value, sizeof(uint64_t));
+          value += sizeof(uint64_t);
+        };
+        if (entry.record.descriptor.sizeUncompressed == ZIP64_MARKER) {
+          next(entry.sizeUncompressed);
+        }
+        if (entry.record.descriptor.sizeCompressed == ZIP64_MARKER) {
+          next(entry.sizeCompressed);
+        }
+        if (entry.record.localHeaderOffset == ZIP64_MARKER) {
+          next(entry.localHeaderOffset);
+        }
+        entry.zip64 = true;
+      }
+      pos += size;
+    }
+  }
 
-      crypto.decryptData(possibleSignature, 4, key, iv);
+  std::vector<CDRecordWithData> readCDRecords(const std::vector<uint8_t> &cdrBuffer, const CDREnd &cdrEnd) {
+    // entries in the cdr are of dynamic size so finding them is sequential, but that only needs the lengths.
+    // The actual parsing and copying can then be split up
+    std::vector<size_t> offsets;
+    offsets.reserve(static_cast<size_t>(cdrEnd.entries));
 
-      if (memcmp(possibleSignature, CDR_SIGNATURE, 4)) {
-        extraSize += sizeof(uint32_t);
+    size_t offset = 0;
+    for (uint64_t i = 0; i < cdrEnd.entries; ++i) {
+      if (offset + sizeof(CDRecord) > cdrBuffer.size()) {
+        throw std::runtime_error("CDR truncated");
       }
+      const CDRecord *record = reinterpret_cast<const CDRecord*>(cdrBuffer.data() + offset);
+      size_t dynLength = record->nameLength + record->extraFieldLength + record->commentLength;
+      if (offset + sizeof(CDRecord) + dynLength > cdrBuffer.size()) {
+        throw std::runtime_error("CDR truncated");
+      }
+      offsets.push_back(offset);
+      offset += sizeof(CDRecord) + dynLength;
+    }
 
-      input.seekg(inPos);
+    std::vector<CDRecordWithData> result(offsets.size());
+    ThreadPool::parallelFor(offsets.size(), CDR_MIN_PARSE_RANGE, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        CDRecordWithData &entry = result[i];
+        const uint8_t *pos = cdrBuffer.data() + offsets[i];
+        entry.record = *reinterpret_cast<const CDRecord*>(pos);
+        entry.record.method = convertMethod(entry.record.method);
+        size_t dynLength = entry.record.nameLength + entry.record.extraFieldLength + entry.record.commentLength;
+        entry.data.assign(pos + sizeof(CDRecord), pos + sizeof(CDRecord) + dynLength);
+
+        entry.sizeCompressed = entry.record.descriptor.sizeCompressed;
+        entry.sizeUncompressed = entry.record.descriptor.sizeUncompressed;
+        entry.localHeaderOffset = entry.record.localHeaderOffset;
+        entry.zip64 = false;
+        readZip64Extra(entry);
+      }
+    });
 
-      crypto.decryptFileSection(input, output, extraSize, key, iv, false);
-    }
+    return result;
   }
 
-  std::vector<CDRecordWithData> readCDRecords(std::vector<uint8_t> &cdrBuffer, const CDREndRecord &cdrEndRecord) {
-    std::vector<CDRecordWithData> result;
-    result.reserve(cdrEndRecord.entriesTotal);
+  void writeCDRecord(const CDRecordWithData &entry, std::vector<uint8_t> &output) {
+    CDRecord record = entry.record;
+    const uint8_t *name = entry.data.data();
+    const uint8_t *extra = name + record.nameLength;
+    const uint8_t *comment = extra + record.extraFieldLength;
+
+    // values keep the marker if they had it before so unchanged records are written unchanged
+    std::vector<uint64_t> zip64Values;
+    auto store = [&](uint64_t value, uint32_t &field) {
+      if ((value >= ZIP64_MARKER) || (field == ZIP64_MARKER)) {
+        field = ZIP64_MARKER;
+        zip64Values.push_back(value);
+      } else {
+        field = static_cast<uint32_t>(value);
+      }
+    };
+    store(entry.sizeUncompressed, record.descriptor.sizeUncompressed);
+    store(entry.sizeCompressed, record.descriptor.sizeCompressed);
+    store(entry.localHeaderOffset, record.localHeaderOffset);
+
+    // copy the extra field, replacing the ZIP64 part
+    std::vector<uint8_t> extraField;
+    for (const uint8_t *pos = extra; pos + 4 <= comment; ) {
+      uint16_t id = *reinterpret_cast<const uint16_t*>(pos);
+      uint16_t size = *reinterpret_cast<const uint16_t*>(pos + 2);
+      const uint8_t *next = std::min(pos + 4 + size, comment);
+      if (id != ZIP64_EXTRA_ID) {
+        extraField.insert(extraField.end(), pos, next);
+      }
+      pos = next;
+    }
 
-    size_t offset = 0;
+    if (!zip64Values.empty()) {
+      uint16_t header[2] = { ZIP64_EXTRA_ID, static_cast<uint16_t>(zip64Values.size() * sizeof(uint64_t)) };
+      const uint8_t *headerData = reinterpret_cast<const uint8_t*>(header);
+      const uint8_t *values = reinterpret_cast<const uint8_t*>(zip64Values.data());
+      extraField.insert(extraField.end(), headerData, headerData + sizeof(header));
+      extraField.insert(extraField.end(), values, values + zip64Values.size() * sizeof(uint64_t));
+      record.versionRequired = std::max(record.versionRequired, ZIP64_VERSION);
+    }
+    record.extraFieldLength = static_cast<uint16_t>(extraField.size());
 
-    // note: entries in the cdr are of dynamic size so we have to read them sequentially
-    for (int i = 0; i < cdrEndRecord.entriesTotal; ++i) {
-      CDRecord *fileRecord = reinterpret_cast<CDRecord*>(cdrBuffer.data() + offset);
-      fileRecord->method = convertMethod(fileRecord->method);
-      size_t dynLength = fileRecord->nameLength + fileRecord->extraFieldLength + fileRecord->commentLength;
-      std::vector<uint8_t> dynData(dynLength);
-      memcpy(&dynData[0], cdrBuffer.data() + offset + sizeof(CDRecord), dynLength);
+    const uint8_t *recordData = reinterpret_cast<const uint8_t*>(&record);
+    output.insert(output.end(), recordData, recordData + sizeof(CDRecord));
+    output.insert(output.end(), name, extra);
+    output.insert(output.end(), extraField.begin(), extraField.end());
+    output.insert(output.end(), comment, name + entry.data.size());
+  }
 
-      result.push_back(std::make_pair(*fileRecord, dynData));
+  void writeLocalHeader(const CDRecordWithData &entry, std::vector<uint8_t> &output) {
+    bool zip64 = (entry.sizeUncompressed >= ZIP64_MARKER) || (entry.sizeCompressed >= ZIP64_MARKER);
+
+    LocalFileHeader header;
+    header.signature = LOCAL_HEADER_SIGNATURE;
+    header.versionRequired = zip64 ? std::max(entry.record.versionRequired, ZIP64_VERSION) : entry.record.versionRequired;
+    header.flags = static_cast<uint16_t>(entry.record.flags & ~DATA_DESCRIPTOR_FLAG);
+    header.method = entry.record.method;
+    header.modifiedTime = entry.record.modifiedTime;
+    header.modifiedDate = entry.record.modifiedDate;
+    header.descriptor.crc = entry.record.descriptor.crc;
+    header.descriptor.sizeCompressed = zip64 ? ZIP64_MARKER : static_cast<uint32_t>(entry.sizeCompressed);
+    header.descriptor.sizeUncompressed = zip64 ? ZIP64_MARKER : static_cast<uint32_t>(entry.sizeUncompressed);
+    header.nameLength = entry.record.nameLength;
+    header.extraFieldLength = static_cast<uint16_t>(zip64 ? 4 + 2 * sizeof(uint64_t) : 0);
+
+    const uint8_t *headerData = reinterpret_cast<const uint8_t*>(&header);
+    output.insert(output.end(), headerData, headerData + sizeof(LocalFileHeader));
+    output.insert(output.end(), entry.data.begin(), entry.data.begin() + entry.record.nameLength);
+
+    if (zip64) {
+      // unlike in the CDR, both sizes are required here
+      uint16_t extraHeader[2] = { ZIP64_EXTRA_ID, 2 * sizeof(uint64_t) };
+      uint64_t values[2] = { entry.sizeUncompressed, entry.sizeCompressed };
+      const uint8_t *extraHeaderData = reinterpret_cast<const uint8_t*>(extraHeader);
+      const uint8_t *valueData = reinterpret_cast<const uint8_t*>(values);
+      output.insert(output.end(), extraHeaderData, extraHeaderData + sizeof(extraHeader));
+      output.insert(output.end(), valueData, valueData + sizeof(values));
+    }
+  }
 
-      offset += sizeof(CDRecord) + fileRecord->nameLength + fileRecord->extraFieldLength + fileRecord->commentLength;
+  std::vector<uint8_t> writeCDREnd(uint64_t cdrOffset, uint64_t cdrSize, uint64_t entries) {
+    std::vector<uint8_t> result;
+
+    bool zip64 = (cdrOffset >= ZIP64_MARKER) || (cdrSize >= ZIP64_MARKER) || (entries >= ZIP64_MARKER_16);
+    if (zip64) {
+      Zip64EndRecord zip64Record;
+      zip64Record.signature = ZIP64_END_SIGNATURE;
+      zip64Record.recordSize = sizeof(Zip64EndRecord) - sizeof(uint32_t) - sizeof(uint64_t);
+      zip64Record.versionAuthor = ZIP64_VERSION;
+      zip64Record.versionRequired = ZIP64_VERSION;
+      zip64Record.disk = 0;
+      zip64Record.startDisk = 0;
+      zip64Record.entriesOnDisk = entries;
+      zip64Record.entriesTotal = entries;
+      zip64Record.size = cdrSize;
+      zip64Record.offset = cdrOffset;
+
+      Zip64EndLocator locator;
+      locator.signature = ZIP64_LOCATOR_SIGNATURE;
+      locator.startDisk = 0;
+      locator.endRecordOffset = cdrOffset + cdrSize;
+      locator.totalDisks = 1;
+
+      const uint8_t *recordData = reinterpret_cast<const uint8_t*>(&zip64Record);
+      const uint8_t *locatorData = reinterpret_cast<const uint8_t*>(&locator);
+      result.insert(result.end(), recordData, recordData + sizeof(Zip64EndRecord));
+      result.insert(result.end(), locatorData, locatorData + sizeof(Zip64EndLocator));
     }
 
+    CDREndRecord endRecord;
+    endRecord.signature = CDR_END_SIGNATURE;
+    endRecord.disk = 0;
+    endRecord.startDisk = 0;
+    endRecord.entriesOnDisk = static_cast<uint16_t>(std::min<uint64_t>(entries, ZIP64_MARKER_16));
+    endRecord.entriesTotal = endRecord.entriesOnDisk;
+    endRecord.size = static_cast<uint32_t>(std::min<uint64_t>(cdrSize, ZIP64_MARKER));
+    endRecord.offset = static_cast<uint32_t>(std::min<uint64_t>(cdrOffset, ZIP64_MARKER));
+    endRecord.commentLength = 0;
+
+    const uint8_t *endData = reinterpret_cast<const uint8_t*>(&endRecord);
+    result.insert(result.end(), endData, endData + sizeof(CDREndRecord));
+
     return result;
   }
 
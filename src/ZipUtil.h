@@ -16,6 +16,12 @@ namespace ZipUtil {
     StreamCipherKeytable = 3,
   };
 
+  enum class SignatureType : uint16_t
+  {
+    None = 0,
+    CDRSigned = 1,
+  };
+
   enum class CompressionMethod : uint16_t
   {
     Store,
@@ -45,8 +51,46 @@ namespace ZipUtil {
     uint32_t size;
     uint32_t offset;
     uint16_t commentLength;
+  };
+
+  /// values in the regular records that are too small to hold the actual value are set to this marker
+  static const uint32_t ZIP64_MARKER = 0xFFFFFFFF;
+  static const uint16_t ZIP64_MARKER_16 = 0xFFFF;
+
+  struct Zip64EndRecord
+  {
+    uint32_t signature;
+    // size of the remaining record
+    uint64_t recordSize;
+    uint16_t versionAuthor;
+    uint16_t versionRequired;
+    uint32_t disk;
+    uint32_t startDisk;
+    uint64_t entriesOnDisk;
+    uint64_t entriesTotal;
+    uint64_t size;
+    uint64_t offset;
+  };
 
-    static CDREndRecord from(std::istream &input);
+  struct Zip64EndLocator
+  {
+    uint32_t signature;
+    uint32_t startDisk;
+    uint64_t endRecordOffset;
+    uint32_t totalDisks;
+  };
+
+  /// the end of the CDR. Location, size and number of entries are taken from the ZIP64 end record
+  /// if the archive has one
+  struct CDREnd
+  {
+    CDREndRecord record;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t entries;
+
+    /// leaves the stream at the start of the comment
+    static CDREnd from(std::istream &input);
   };
 
   struct DataDescriptor
@@ -79,7 +123,18 @@ namespace ZipUtil {
     uint32_t localHeaderOffset;
   };
 
-  typedef std::pair<CDRecord, std::vector<uint8_t>> CDRecordWithData;
+  /// a record from the CDR with the data following it (name, extra field, comment).
+  /// Sizes and offset are taken from the ZIP64 extra field where the record only holds the marker
+  struct CDRecordWithData
+  {
+    CDRecord record;
+    std::vector<uint8_t> data;
+    uint64_t sizeCompressed;
+    uint64_t sizeUncompressed;
+    uint64_t localHeaderOffset;
+    // the record has a ZIP64 extra field, the data descriptor (if any) then uses 64 bit sizes as well
+    bool zip64;
+  };
 
   struct LocalFileHeader
   {
@@ -114,22 +169,38 @@ namespace ZipUtil {
     InitialVector cdrInitialVector;
 
     static CryEngineDecryptionKeys readFrom(std::istream &input, TomCryption &crypto);
+    /// unwrap all keys of an encryption header that was already read
+    static CryEngineDecryptionKeys unwrap(const CryEngineEncryptionHeader &header, TomCryption &crypto);
   };
 
+  /// read the encryption header without unwrapping any keys. Throws if it's corrupted
+  CryEngineEncryptionHeader readEncryptionHeader(std::istream &input);
+
   struct CryEngineSigningHeader
   {
     uint32_t headerSize;
     unsigned char signature[RSA_KEY_MESSAGE_LENGTH];
   };
 
-  std::vector<uint8_t> decryptCDR(std::istream &input, const CDREndRecord &cdrEndRecord, const TomCryption &crypto,
+  std::vector<uint8_t> decryptCDR(std::istream &input, const CDREnd &cdrEnd, const TomCryption &crypto,
                                   CipherKey key, InitialVector iv);
 
-  void decryptFile(std::istream &input, std::ostream &output, const TomCryption &crypto,
-    const LocalFileHeader &localHeader, long sizeCompressed,
-    CipherKey key, InitialVector iv);
+  /// size of the data descriptor following the file data, given its first 4 bytes (decrypted)
+  unsigned long getDataDescriptorSize(const uint8_t possibleSignature[4], bool zip64);
+
+  /// parse the (decrypted) CDR. The compression method of the records gets converted to the regular zip
+  /// methods, the buffer itself isn't modified
+  std::vector<CDRecordWithData> readCDRecords(const std::vector<uint8_t> &cdrBuffer, const CDREnd &cdrEnd);
+
+  /// append a record to a CDR. The ZIP64 extra field is (re-)generated for the values that need it
+  void writeCDRecord(const CDRecordWithData &entry, std::vector<uint8_t> &output);
+
+  /// append a local file header matching the record (crc and sizes in the header, no data descriptor).
+  /// Sizes that don't fit get a ZIP64 extra field
+  void writeLocalHeader(const CDRecordWithData &entry, std::vector<uint8_t> &output);
 
-  std::vector<CDRecordWithData> readCDRecords(std::vector<uint8_t> &cdrBuffer, const CDREndRecord &cdrEndRecord);
+  /// the end of a CDR without comment, preceded by the ZIP64 end record and locator if necessary
+  std::vector<uint8_t> writeCDREnd(uint64_t cdrOffset, uint64_t cdrSize, uint64_t entries);
 
   uint8_t getEncryptionKeyIndex(uint32_t crc);
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <exception>
+
 enum ErrorCode {
   ERROR_NONE,
   ERROR_UNKNOWN,
@@ -9,6 +11,26 @@ enum ErrorCode {
   ERROR_DECRYPTION_FAILED,
   ERROR_READ_KEY_FAILED,
   ERROR_NO_EXTENDED_HEADER,
-  ERROR_UNSUPPORTED_ENCRYPTION
+  ERROR_UNSUPPORTED_ENCRYPTION,
+  ERROR_WRITE_FAILED,
+  ERROR_JOURNAL_INVALID,
+  ERROR_VERIFY_FAILED,
+  ERROR_SIGNATURE_INVALID,
+  ERROR_CANCELLED,
+  ERROR_REQUEST_NOT_FOUND,
+  ERROR_INVALID_ENTRY_NAME,
+  ERROR_UNSUPPORTED_COMPRESSION,
+  ERROR_INVALID_FILTER,
+  ERROR_CONNECTION_FAILED,
+  ERROR_UNKNOWN_KEY,
+  ERROR_SHARD_PLAN_INVALID
 };
 
+class ErrorCodeException : public std::exception {
+public:
+  ErrorCodeException(ErrorCode code) : m_Code(code) { }
+  virtual const char *what() const throw() { return "An error occurred"; }
+  ErrorCode code() const throw() { return m_Code; }
+private:
+  ErrorCode m_Code;
+};
@@ -1,5 +1,23 @@
 #include "libpakdecrypt.h"
 #include "ZipUtil.h"
+#include "OutputFile.h"
+#include "RandomAccessFile.h"
+#include "DecryptJournal.h"
+#include "ThreadPool.h"
+#include "WorkStealingPool.h"
+#include "AsyncReader.h"
+#include "MemoryBudget.h"
+#include "Crc32.h"
+#include "EntryCache.h"
+#include "BlockCache.h"
+#include "DecryptPipeline.h"
+#include "FileSystem.h"
+#include "AccessTrace.h"
+#include "LocalSocket.h"
+#include "Keyring.h"
+#include "SeekIndex.h"
+#include "NameIndex.h"
+#include "ShardPlan.h"
 #include "errors.h"
 #include <fstream>
 #include <vector>
@@ -8,19 +26,23 @@
 #include <sstream>
 #include <functional>
 #include <stdexcept>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <cstdio>
+#include <zlib.h>
 
 using namespace ZipUtil;
 
 
-class ErrorCodeException : public std::exception {
-public:
-  ErrorCodeException(ErrorCode code) : m_Code(code) { }
-  virtual const char *what() const throw() { return "An error occurred"; }
-  ErrorCode code() const throw() { return m_Code; }
-private:
-  ErrorCode m_Code;
-};
-
 template <typename T> T checked(const std::function<T()> &func, ErrorCode code) {
   try {
     return func();
@@ -33,7 +55,9 @@ template <typename T> T checked(const std::function<T()> &func, ErrorCode code)
   }
 }
 
-CryEngineDecryptionKeys readKeys(std::istream &input, TomCryption &crypto) {
+// reads the headers in the archive comment up to and including the encryption header, no keys are unwrapped.
+// signingHeader, if set, receives the signing header. If the archive isn't signed, its headerSize is 0
+CryEngineEncryptionHeader readEncryptionHeaders(std::istream &input, CryEngineSigningHeader *signingHeader = nullptr) {
   CryEngineExtendedHeader extendedHeader;
   input.read(reinterpret_cast<char*>(&extendedHeader), sizeof(CryEngineExtendedHeader));
 
@@ -44,9 +68,41 @@ CryEngineDecryptionKeys readKeys(std::istream &input, TomCryption &crypto) {
     throw ErrorCodeException(ERROR_UNSUPPORTED_ENCRYPTION);
   }
 
-  // skip signing header, don't care about that
-  input.seekg(sizeof(CryEngineSigningHeader), std::ios::cur);
-  return CryEngineDecryptionKeys::readFrom(input, crypto);
+  CryEngineSigningHeader signing;
+  input.read(reinterpret_cast<char*>(&signing), sizeof(CryEngineSigningHeader));
+  if (signingHeader != nullptr) {
+    if (extendedHeader.signatureType != static_cast<uint16_t>(SignatureType::CDRSigned)) {
+      signing.headerSize = 0;
+    }
+    *signingHeader = signing;
+  }
+
+  return readEncryptionHeader(input);
+}
+
+CryEngineDecryptionKeys readKeys(std::istream &input, TomCryption &crypto, CryEngineSigningHeader *signingHeader = nullptr) {
+  return CryEngineDecryptionKeys::unwrap(readEncryptionHeaders(input, signingHeader), crypto);
+}
+
+// CryEngine signs the decrypted CDR together with the name of the archive (so a renamed archive fails to
+// load). File contents are covered through the crcs in the CDR.
+// The check runs in the background so the RSA work overlaps with decrypting the data.
+// crypto and cdrBuffer have to stay alive until the result was retrieved
+std::future<bool> verifySignature(const TomCryption &crypto, const CryEngineSigningHeader &signingHeader,
+                                  const std::vector<uint8_t> &cdrBuffer, const char *signedName) {
+  if (signingHeader.headerSize != sizeof(CryEngineSigningHeader)) {
+    throw ErrorCodeException(ERROR_SIGNATURE_INVALID);
+  }
+
+  std::string name(signedName);
+  CryEngineSigningHeader header = signingHeader;
+  return std::async(std::launch::async, [&crypto, &cdrBuffer, name, header]() {
+    std::vector<uint8_t> digest = crypto.startHashSHA256()
+      .process(cdrBuffer.data(), static_cast<unsigned long>(cdrBuffer.size()))
+      .process(reinterpret_cast<const uint8_t*>(name.c_str()), static_cast<unsigned long>(name.size()))
+      .digest();
+    return crypto.verifySignature(header.signature, RSA_KEY_MESSAGE_LENGTH, digest);
+  });
 }
 
 struct __Padding {
@@ -58,7 +114,276 @@ struct __Padding {
   char buffer[PADDING_BUFFER_SIZE];
 } s_Padding;
 
-void decryptImpl(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize) {
+static const size_t VERIFY_CHUNK_SIZE = 1024 * 1024;
+
+typedef std::function<void(const uint8_t *data, size_t size)> EntryConsumer;
+
+// decrypt the data of an entry in chunks and hand it to the consumer, inflated if requested.
+// Without inflating the stored data is passed on as is, regardless of the compression method
+PakVerifyStatus streamEntry(const RandomAccessFile &archive, const TomCryption &crypto, const KeySchedule &schedule,
+                            const CDRecordWithData &entry, bool inflateData,
+                            std::vector<uint8_t> &readBuffer, std::vector<uint8_t> &inflateBuffer, const EntryConsumer &consumer) {
+  unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+  getInitialVector(entry.record.descriptor, initialVector);
+  int encryptionKeyIndex = getEncryptionKeyIndex(entry.record.descriptor.crc);
+
+  // small entries are the common case, the prepared keys avoid a key setup for each piece
+  LocalFileHeader localHeader;
+  archive.readAt(entry.localHeaderOffset, &localHeader, sizeof(LocalFileHeader));
+  DecryptRequest headerRequest = { reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), encryptionKeyIndex, initialVector, 0 };
+  crypto.decryptBatch(schedule, &headerRequest, 1);
+  uint64_t dataOffset = entry.localHeaderOffset + sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
+
+  CompressionMethod method = static_cast<CompressionMethod>(entry.record.method);
+  if (inflateData && (method != CompressionMethod::Store) && (method != CompressionMethod::Deflate)) {
+    return PAK_VERIFY_UNSUPPORTED_METHOD;
+  }
+  bool deflated = inflateData && (method == CompressionMethod::Deflate);
+
+  struct Inflater {
+    Inflater() : initialized(false) { memset(&stream, 0, sizeof(z_stream)); }
+    ~Inflater() { if (initialized) inflateEnd(&stream); }
+    z_stream stream;
+    bool initialized;
+  } inflater;
+
+  if (deflated) {
+    if (inflateInit2(&inflater.stream, -MAX_WBITS) != Z_OK) {
+      throw std::bad_alloc();
+    }
+    inflater.initialized = true;
+  }
+
+  int inflateResult = Z_OK;
+
+  for (uint64_t pos = 0; pos < entry.sizeCompressed; ) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(readBuffer.size(), entry.sizeCompressed - pos));
+    archive.readAt(dataOffset + pos, readBuffer.data(), chunk);
+    DecryptRequest dataRequest = { readBuffer.data(), static_cast<unsigned long>(chunk), encryptionKeyIndex, initialVector, pos };
+    crypto.decryptBatch(schedule, &dataRequest, 1);
+    pos += chunk;
+
+    if (!deflated) {
+      consumer(readBuffer.data(), chunk);
+      continue;
+    }
+
+    z_stream &stream = inflater.stream;
+    stream.next_in = readBuffer.data();
+    stream.avail_in = static_cast<uInt>(chunk);
+    do {
+      stream.next_out = inflateBuffer.data();
+      stream.avail_out = static_cast<uInt>(inflateBuffer.size());
+      inflateResult = inflate(&stream, Z_NO_FLUSH);
+      if ((inflateResult != Z_OK) && (inflateResult != Z_STREAM_END) && (inflateResult != Z_BUF_ERROR)) {
+        return PAK_VERIFY_INFLATE_FAILED;
+      }
+      consumer(inflateBuffer.data(), inflateBuffer.size() - stream.avail_out);
+    } while ((stream.avail_out == 0) && (inflateResult != Z_STREAM_END));
+
+    if ((inflateResult == Z_STREAM_END) && (pos < entry.sizeCompressed)) {
+      // trailing data after the end of the deflate stream
+      return PAK_VERIFY_INFLATE_FAILED;
+    }
+  }
+
+  if (deflated && (entry.sizeCompressed > 0) && (inflateResult != Z_STREAM_END)) {
+    return PAK_VERIFY_INFLATE_FAILED;
+  }
+
+  return PAK_VERIFY_OK;
+}
+
+static const uint64_t TRANSCODE_BATCH_SIZE = 128 * 1024 * 1024;
+static const uint64_t TRANSCODE_STREAM_SIZE = 16 * 1024 * 1024;
+static const uint64_t TRANSCODE_ALWAYS_STORE_SIZE = 64 * 1024;
+
+// deflated entries get stored uncompressed, except for large ones that compress well where the disk space
+// outweighs the time saved on inflating. Everything else is copied as is
+bool transcodeToStore(const CDRecordWithData &entry) {
+  if (static_cast<CompressionMethod>(entry.record.method) != CompressionMethod::Deflate) {
+    return false;
+  }
+  return (entry.sizeUncompressed <= TRANSCODE_ALWAYS_STORE_SIZE) || (entry.sizeUncompressed <= 2 * entry.sizeCompressed);
+}
+
+uint64_t transcodedSize(const CDRecordWithData &entry) {
+  return transcodeToStore(entry) ? entry.sizeUncompressed : entry.sizeCompressed;
+}
+
+// large entries are written to the output as they are transcoded instead of being collected in memory first
+bool transcodeStreamed(const CDRecordWithData &entry) {
+  return transcodedSize(entry) > TRANSCODE_STREAM_SIZE;
+}
+
+// decrypt an entry and pass its new local header and data to the consumer. The record is updated to match
+void transcodeEntry(const RandomAccessFile &archive, const TomCryption &crypto, const KeySchedule &schedule,
+                    CDRecordWithData &entry, std::vector<uint8_t> &readBuffer, std::vector<uint8_t> &inflateBuffer,
+                    const EntryConsumer &consumer) {
+  bool store = transcodeToStore(entry);
+  CDRecordWithData original = entry;
+
+  // crc and sizes go into the local header so there is no data descriptor
+  if (store) {
+    entry.record.method = static_cast<uint16_t>(CompressionMethod::Store);
+    entry.sizeCompressed = entry.sizeUncompressed;
+  }
+  entry.record.flags = static_cast<uint16_t>(entry.record.flags & ~0x08);
+
+  std::vector<uint8_t> localHeader;
+  writeLocalHeader(entry, localHeader);
+  consumer(localHeader.data(), localHeader.size());
+
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  PakVerifyStatus status = streamEntry(archive, crypto, schedule, original, store, readBuffer, inflateBuffer,
+    [&](const uint8_t *data, size_t length) {
+      consumer(data, length);
+      size += length;
+      if (store) {
+        crc = Crc32::update(crc, data, length);
+      }
+    });
+
+  if ((status != PAK_VERIFY_OK)
+      || (size != entry.sizeCompressed)
+      || (store && (crc != entry.record.descriptor.crc))) {
+    throw ErrorCodeException(ERROR_VERIFY_FAILED);
+  }
+}
+
+// write all entries, in the order given, transcoded to output and update their records.
+// Small entries are transcoded in parallel in batches of at most TRANSCODE_BATCH_SIZE bytes, one batch gets written
+// while the next one is being transcoded. Entries larger than TRANSCODE_STREAM_SIZE form a batch of their own that
+// is transcoded straight to the output
+void transcodeEntries(const RandomAccessFile &archive, const TomCryption &crypto, CryEngineDecryptionKeys &decryptionKeys,
+                      std::vector<CDRecordWithData> &headers, OutputFile &output) {
+  KeySchedule schedule = crypto.scheduleKeys(decryptionKeys.cipherKeyTable, BLOCK_CIPHER_NUM_KEYS);
+  std::vector<std::vector<uint8_t>> results(headers.size());
+
+  auto batchEnd = [&](size_t begin) {
+    if ((begin < headers.size()) && transcodeStreamed(headers[begin])) {
+      return begin + 1;
+    }
+    size_t end = begin;
+    uint64_t total = 0;
+    while ((end < headers.size()) && !transcodeStreamed(headers[end])
+           && (total + transcodedSize(headers[end]) <= TRANSCODE_BATCH_SIZE)) {
+      total += transcodedSize(headers[end++]);
+    }
+    return end;
+  };
+
+  ThreadPool pool;
+  auto submitBatch = [&](size_t begin, size_t end) {
+    if ((begin == end) || transcodeStreamed(headers[begin])) {
+      return;
+    }
+    std::shared_ptr<std::atomic<size_t>> next(new std::atomic<size_t>(begin));
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool.submit([&, next, end]() {
+        std::vector<uint8_t> readBuffer(VERIFY_CHUNK_SIZE);
+        std::vector<uint8_t> inflateBuffer(VERIFY_CHUNK_SIZE);
+        for (size_t idx = (*next)++; idx < end; idx = (*next)++) {
+          std::vector<uint8_t> &result = results[idx];
+          result.reserve(static_cast<size_t>(transcodedSize(headers[idx])) + sizeof(LocalFileHeader) + headers[idx].data.size());
+          transcodeEntry(archive, crypto, schedule, headers[idx], readBuffer, inflateBuffer,
+            [&result](const uint8_t *data, size_t size) { result.insert(result.end(), data, data + size); });
+        }
+      });
+    }
+  };
+
+  std::vector<uint8_t> readBuffer(VERIFY_CHUNK_SIZE);
+  std::vector<uint8_t> inflateBuffer(VERIFY_CHUNK_SIZE);
+
+  size_t begin = 0;
+  size_t end = batchEnd(begin);
+  submitBatch(begin, end);
+  pool.wait();
+
+  while (begin < headers.size()) {
+    size_t nextEnd = batchEnd(end);
+    submitBatch(end, nextEnd);
+
+    if (transcodeStreamed(headers[begin])) {
+      // the record still refers to the input until the entry is transcoded
+      uint64_t localHeaderOffset = output.offset();
+      transcodeEntry(archive, crypto, schedule, headers[begin], readBuffer, inflateBuffer,
+        [&output](const uint8_t *data, size_t size) { output.write(data, size); });
+      headers[begin].localHeaderOffset = localHeaderOffset;
+    } else {
+      for (size_t idx = begin; idx < end; ++idx) {
+        headers[idx].localHeaderOffset = output.offset();
+        output.write(results[idx].data(), results[idx].size());
+        std::vector<uint8_t>().swap(results[idx]);
+      }
+    }
+
+    pool.wait();
+    begin = end;
+    end = nextEnd;
+  }
+}
+
+// '*' matches any run of characters except a directory separator, "**" also matches separators, '?' matches one
+// character that isn't a separator
+bool globMatch(const char *pattern, const char *name) {
+  while (*pattern != '\0') {
+    if (*pattern == '*') {
+      bool recursive = pattern[1] == '*';
+      const char *rest = pattern + (recursive ? 2 : 1);
+      for (const char *pos = name; ; ++pos) {
+        if (globMatch(rest, pos)) {
+          return true;
+        }
+        if ((*pos == '\0') || (!recursive && ((*pos == '/') || (*pos == '\\')))) {
+          return false;
+        }
+      }
+    }
+
+    if ((*name == '\0')
+        || ((*pattern == '?') ? ((*name == '/') || (*name == '\\')) : (*pattern != *name))) {
+      return false;
+    }
+    ++pattern;
+    ++name;
+  }
+  return *name == '\0';
+}
+
+// selects the entries for partial decryption by name, see PakFilterMode
+struct NameFilter {
+  PakFilterMode mode;
+  std::vector<std::string> patterns;
+  std::unordered_set<std::string> names;
+
+  NameFilter(PakFilterMode mode, const char **patterns, int numPatterns)
+    : mode(mode), patterns(patterns, patterns + numPatterns), names(patterns, patterns + numPatterns)
+  {
+    if ((mode != PAK_FILTER_NAMES) && (mode != PAK_FILTER_PREFIX) && (mode != PAK_FILTER_GLOB)) {
+      throw ErrorCodeException(ERROR_INVALID_FILTER);
+    }
+  }
+
+  bool matches(const std::string &name) const {
+    switch (mode) {
+    case PAK_FILTER_NAMES: return names.find(name) != names.end();
+    case PAK_FILTER_PREFIX: return std::any_of(patterns.begin(), patterns.end(), [&](const std::string &prefix) {
+        return name.compare(0, prefix.size(), prefix) == 0;
+      });
+    default: return std::any_of(patterns.begin(), patterns.end(), [&](const std::string &glob) {
+        return globMatch(glob.c_str(), name.c_str());
+      });
+    }
+  }
+};
+
+// filter, if set, limits the output to the matching entries. Only those are read and decrypted.
+// trace, if set, determines the order of entries in the output: traced ones first in order of access, the rest after
+void decryptImpl(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize, const char *signedName, int flags,
+                 const NameFilter *filter = nullptr, const AccessTrace *trace = nullptr) {
   // the process to decrypt cryengine pak files is as follows:
   // a) find the end record of the CDR.
   //    -> This record is not encrypted and is followed by a comment section that the cryengine uses to store
@@ -79,65 +404,140 @@ void decryptImpl(const char *encryptedPath, const char *outputPath, const unsign
   TomCryption crypto;
   checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
 
-  CDREndRecord cdrEndRecord = checked<CDREndRecord>([&]() { return CDREndRecord::from(input); }, ERROR_CDR_NOT_FOUND);
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
 
-  if (cdrEndRecord.commentLength < sizeof(CryEngineExtendedHeader)) {
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
     throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
   }
 
-  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+  CryEngineSigningHeader signingHeader;
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto, &signingHeader); }, ERROR_DECRYPTION_FAILED);
 
   // decrypt the CDR
-  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEndRecord, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
-  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEndRecord);
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+
+  std::future<bool> signatureValid;
+  if (signedName != nullptr) {
+    signatureValid = verifySignature(crypto, signingHeader, cdrBuffer, signedName);
+  }
+
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  if (filter != nullptr) {
+    headers.erase(std::remove_if(headers.begin(), headers.end(), [&](const CDRecordWithData &header) {
+      return !filter->matches(std::string(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength));
+      }), headers.end());
+  }
 
   // sort the records so that we don't have to seek back and forth in the archives
   std::sort(headers.begin(), headers.end(), [](const CDRecordWithData &lhs, const CDRecordWithData &rhs) {
-    return lhs.first.localHeaderOffset < rhs.first.localHeaderOffset;
+    return lhs.localHeaderOffset < rhs.localHeaderOffset;
     });
 
-  // everything in the input archive seems to be in order so now we can start decrypting actual data
-  std::ofstream output;
-  output.open(outputPath, std::ios::binary | std::ios::out);
+  if (trace != nullptr) {
+    // load order instead. This costs seeks on the input once so reading the output later doesn't.
+    // Entries that weren't accessed keep their relative order at the end
+    std::vector<size_t> ranks;
+    ranks.reserve(headers.size());
+    for (const CDRecordWithData &header : headers) {
+      ranks.push_back(trace->rank(std::string(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength)));
+    }
+    std::vector<size_t> order(headers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return ranks[lhs] < ranks[rhs]; });
 
-  for (CDRecordWithData &header : headers) {
-    unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
-    getInitialVector(header.first.descriptor, initialVector);
-    int encryptionKeyIndex = getEncryptionKeyIndex(header.first.descriptor.crc);
+    std::vector<CDRecordWithData> reordered;
+    reordered.reserve(headers.size());
+    for (size_t idx : order) {
+      reordered.push_back(std::move(headers[idx]));
+    }
+    headers.swap(reordered);
+  }
 
-    input.seekg(header.first.localHeaderOffset);
-    LocalFileHeader localHeader;
-    input.read(reinterpret_cast<char*>(&localHeader), sizeof(LocalFileHeader));
-    union {
-      char sig[4];
-      uint32_t sigStr;
-    };
-    sigStr = localHeader.signature;
-    crypto.decryptData(reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
-    input.seekg(header.first.localHeaderOffset);
+  // everything in the input archive seems to be in order so now we can start decrypting actual data.
+  // Decryption doesn't change the size of anything, only the comment gets dropped, so the size of
+  // the output is known up front
+  uint64_t expectedSize = cdrEnd.offset + cdrEnd.size + sizeof(Zip64EndRecord) + sizeof(Zip64EndLocator) + sizeof(CDREndRecord);
+  bool transcode = (flags & PAK_DECRYPT_TRANSCODE) != 0;
+  if ((filter != nullptr) || transcode) {
+    // only an estimate, local headers may carry different extra fields than the CDR records. The output
+    // gets truncated to the actual size anyway
+    expectedSize = sizeof(Zip64EndRecord) + sizeof(Zip64EndLocator) + sizeof(CDREndRecord);
+    for (const CDRecordWithData &header : headers) {
+      uint64_t localHeaderSize = sizeof(LocalFileHeader) + header.data.size();
+      uint64_t descriptorSize = 24;
+      uint64_t dataSize = transcode ? transcodedSize(header) : header.sizeCompressed;
+      expectedSize += localHeaderSize + dataSize + descriptorSize + sizeof(CDRecord) + header.data.size();
+    }
+  }
+  std::unique_ptr<OutputFile> outputFile = checked<std::unique_ptr<OutputFile>>([&]() {
+    return std::unique_ptr<OutputFile>(new OutputFile(outputPath, expectedSize, (flags & PAK_DECRYPT_DIRECT_IO) != 0));
+    }, ERROR_WRITE_FAILED);
 
-    header.first.localHeaderOffset = static_cast<uint32_t>(output.tellp());
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
 
-    decryptFile(input, output, crypto, localHeader, header.first.descriptor.sizeCompressed, decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
+  std::vector<const CDRecordWithData*> entries;
+  entries.reserve(headers.size());
+  for (const CDRecordWithData &header : headers) {
+    entries.push_back(&header);
   }
 
-  std::vector<uint8_t> digest = crypto.startHashSHA256()
-    .process(cdrBuffer.data(), cdrEndRecord.size)
-    .process(reinterpret_cast<const uint8_t*>(outputPath), static_cast<unsigned long>(strlen(outputPath)))
-    .digest();
+  // the local header offsets are updated as the entries get written
+  struct ArchiveSink : public DecryptPipeline::Sink {
+    std::vector<CDRecordWithData> &headers;
+    OutputFile &output;
+    ArchiveSink(std::vector<CDRecordWithData> &headers, OutputFile &output) : headers(headers), output(output) {}
+    virtual void beginEntry(size_t index) override {
+      headers[index].localHeaderOffset = output.offset();
+    }
+    virtual void write(size_t, const uint8_t *data, size_t size) override {
+      output.write(data, size);
+    }
+  } sink(headers, *outputFile);
+
+  checked<void>([&]() {
+    if (transcode) {
+      transcodeEntries(*archive, crypto, decryptionKeys, headers, *outputFile);
+    } else {
+      DecryptPipeline pipeline(*archive, crypto, decryptionKeys);
+      pipeline.run(entries, sink);
+    }
+    }, ERROR_DECRYPTION_FAILED);
+
+  // don't produce a usable archive if the signature doesn't match
+  if (signatureValid.valid() && !checked<bool>([&]() { return signatureValid.get(); }, ERROR_SIGNATURE_INVALID)) {
+    outputFile.reset();
+    remove(outputPath);
+    throw ErrorCodeException(ERROR_SIGNATURE_INVALID);
+  }
 
   // write out the cdr
-  size_t cdrOffset = output.tellp();
-  for (CDRecordWithData &header : headers) {
-    output.write(reinterpret_cast<const char*>(&header.first), sizeof(CDRecord));
-    output.write(reinterpret_cast<const char*>(header.second.data()), header.second.size());
+  uint64_t cdrOffset = outputFile->offset();
+  std::vector<uint8_t> cdr;
+  cdr.reserve(cdrBuffer.size());
+  for (const CDRecordWithData &header : headers) {
+    writeCDRecord(header, cdr);
   }
+  std::vector<uint8_t> cdrEndData = writeCDREnd(cdrOffset, cdr.size(), headers.size());
 
-  cdrEndRecord.commentLength = 0;
-  cdrEndRecord.offset = static_cast<uint32_t>(cdrOffset);
-  output.write(reinterpret_cast<const char*>(&cdrEndRecord), sizeof(CDREndRecord));
+  checked<void>([&]() {
+    outputFile->write(cdr.data(), cdr.size());
+    outputFile->write(cdrEndData.data(), cdrEndData.size());
+    outputFile->close();
+    }, ERROR_WRITE_FAILED);
 }
 
+// collects decrypted entries in memory
+struct MemorySink : public DecryptPipeline::Sink {
+  std::vector<std::vector<char>> entries;
+  explicit MemorySink(size_t count) : entries(count) {}
+  virtual void write(size_t index, const uint8_t *data, size_t size) override {
+    entries[index].insert(entries[index].end(), data, data + size);
+  }
+};
+
 void decryptFilesImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char **files, int numFiles, char ***buffers, int **bufferSizes) {
   std::ifstream input;
   input.open(encryptedPath, std::ios::binary | std::ios::in);
@@ -149,29 +549,40 @@ void decryptFilesImpl(const char *encryptedPath, const unsigned char *key, short
   TomCryption crypto;
   checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
 
-  CDREndRecord cdrEndRecord = checked<CDREndRecord>([&]() { return CDREndRecord::from(input); }, ERROR_CDR_NOT_FOUND);
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
 
-  if (cdrEndRecord.commentLength < sizeof(CryEngineExtendedHeader)) {
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
     throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
   }
 
   CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
 
   // decrypt the CDR
-  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEndRecord, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
-  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEndRecord);
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
 
   // sort the records so that we don't have to seek back and forth in the archives
   std::sort(headers.begin(), headers.end(), [](const CDRecordWithData &lhs, const CDRecordWithData &rhs) {
-    return lhs.first.localHeaderOffset < rhs.first.localHeaderOffset;
+    return lhs.localHeaderOffset < rhs.localHeaderOffset;
     });
 
-  *buffers = new char*[numFiles];
-  *bufferSizes = new int[numFiles];
+  // files not found in the archive are returned as null with size 0
+  *buffers = new char*[numFiles]();
+  *bufferSizes = new int[numFiles]();
 
-  // everything in the input archive seems to be in order so now we can start decrypting actual data
+  EntryCache &cache = EntryCache::instance();
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // everything in the input archive seems to be in order so now we can start decrypting actual data.
+  // Entries found in the cache are returned right away, the others are decrypted in one go
+  std::vector<const CDRecordWithData*> missing;
+  std::vector<size_t> missingIndices;
+  std::vector<EntryCache::Key> missingKeys;
   for (CDRecordWithData &header : headers) {
-    std::string iterName(reinterpret_cast<const char*>(&header.second[0]), header.first.nameLength);
+    std::string iterName(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength);
     const char **end = files + numFiles;
     auto namePtr = std::find_if(files, end, [&](const char *name) { return strcmp(iterName.c_str(), name) == 0;  });
     if (namePtr == end) {
@@ -179,35 +590,88 @@ void decryptFilesImpl(const char *encryptedPath, const unsigned char *key, short
       continue;
     }
 
-    unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
-    getInitialVector(header.first.descriptor, initialVector);
-    int encryptionKeyIndex = getEncryptionKeyIndex(header.first.descriptor.crc);
+    size_t idx = std::distance(files, namePtr);
 
-    input.seekg(header.first.localHeaderOffset);
-    LocalFileHeader localHeader;
-    input.read(reinterpret_cast<char*>(&localHeader), sizeof(LocalFileHeader));
-    union {
-      char sig[4];
-      uint32_t sigStr;
-    };
-    sigStr = localHeader.signature;
-    crypto.decryptData(reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
-    input.seekg(header.first.localHeaderOffset);
+    EntryCache::Key cacheKey(decryptionKeys, header);
+    EntryCache::Data data = cache.get(cacheKey);
+
+    if (!data) {
+      missing.push_back(&header);
+      missingIndices.push_back(idx);
+      missingKeys.push_back(cacheKey);
+      continue;
+    }
 
-    std::stringstream output;
-    decryptFile(input, output, crypto, localHeader, header.first.descriptor.sizeCompressed, decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
+    (*buffers)[idx] = new char[data->size()];
+    memcpy((*buffers)[idx], data->data(), data->size());
+    (*bufferSizes)[idx] = static_cast<int>(data->size());
+  }
 
-    size_t idx = std::distance(files, namePtr);
+  if (missing.empty()) {
+    return;
+  }
+
+  MemorySink sink(missing.size());
+  checked<void>([&]() {
+    DecryptPipeline pipeline(*archive, crypto, decryptionKeys);
+    pipeline.run(missing, sink);
+    }, ERROR_DECRYPTION_FAILED);
 
-    std::string temp = output.str();
-    (*buffers)[idx] = new char[temp.size()];
-    memcpy((*buffers)[idx], &temp[0], temp.size());
-    (*bufferSizes)[idx] = static_cast<int>(temp.size());
+  for (size_t i = 0; i < missing.size(); ++i) {
+    std::shared_ptr<std::vector<char>> entry(new std::vector<char>());
+    entry->swap(sink.entries[i]);
+    EntryCache::Data data(entry);
+    cache.put(missingKeys[i], data);
+
+    size_t idx = missingIndices[i];
+    (*buffers)[idx] = new char[data->size()];
+    memcpy((*buffers)[idx], data->data(), data->size());
+    (*bufferSizes)[idx] = static_cast<int>(data->size());
   }
 }
 
 
-void listFilesImpl(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames) {
+// buffers handed out by pak_decrypt_files_budgeted are preceded by this so pak_release_buffer knows
+// which budget to return the memory to. The budget may outlive the call that created it
+struct BudgetedBuffer {
+  std::shared_ptr<MemoryBudget> budget;
+  uint64_t size;
+};
+
+static const size_t BUDGETED_BUFFER_OFFSET = (sizeof(BudgetedBuffer) + 15) & ~static_cast<size_t>(15);
+
+// size has to be acquired from the budget already, it's returned to it when the buffer is released
+char *allocateBudgeted(const std::shared_ptr<MemoryBudget> &budget, size_t size) {
+  char *memory;
+  try {
+    memory = new char[BUDGETED_BUFFER_OFFSET + size];
+  }
+  catch (...) {
+    budget->release(size);
+    throw;
+  }
+  BudgetedBuffer *header = new (memory) BudgetedBuffer();
+  header->budget = budget;
+  header->size = size;
+  return memory + BUDGETED_BUFFER_OFFSET;
+}
+
+void releaseBudgeted(char *buffer) {
+  char *memory = buffer - BUDGETED_BUFFER_OFFSET;
+  BudgetedBuffer *header = reinterpret_cast<BudgetedBuffer*>(memory);
+  header->budget->release(header->size);
+  header->~BudgetedBuffer();
+  delete[] memory;
+}
+
+// upper bound of the size of an entry as returned by pak_decrypt_files, before its local header was read
+uint64_t estimateEntrySize(const CDRecordWithData &entry) {
+  return sizeof(LocalFileHeader) + entry.record.nameLength + entry.record.extraFieldLength
+    + entry.sizeCompressed + sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+}
+
+void decryptFilesBudgetedImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char **files, int numFiles,
+                              uint64_t maxInFlightBytes, PakEntryCallback callback, void *userData) {
   std::ifstream input;
   input.open(encryptedPath, std::ios::binary | std::ios::in);
 
@@ -218,73 +682,2745 @@ void listFilesImpl(const char *encryptedPath, const unsigned char *key, short ke
   TomCryption crypto;
   checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
 
-  CDREndRecord cdrEndRecord = checked<CDREndRecord>([&]() { return CDREndRecord::from(input); }, ERROR_CDR_NOT_FOUND);
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
 
-  if (cdrEndRecord.commentLength < sizeof(CryEngineExtendedHeader)) {
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
     throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
   }
 
   CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
 
   // decrypt the CDR
-  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEndRecord, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
-  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEndRecord);
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
 
-  auto lengthAccu = [](int total, const CDRecordWithData &file) {
-    return total + file.first.nameLength + 1;
-  };
+  input.close();
 
-  int totalLength = std::accumulate(headers.begin(), headers.end(), 1, lengthAccu);
+  // sort the records so that we don't have to seek back and forth in the archives
+  std::sort(headers.begin(), headers.end(), [](const CDRecordWithData &lhs, const CDRecordWithData &rhs) {
+    return lhs.localHeaderOffset < rhs.localHeaderOffset;
+    });
+
+  std::unordered_map<std::string, int> requested;
+  requested.reserve(numFiles);
+  for (int i = 0; i < numFiles; ++i) {
+    requested.insert(std::make_pair(std::string(files[i]), i));
+  }
 
-  *fileNames = new char[totalLength];
-  memset(*fileNames, '\0', totalLength);
-  char *target = *fileNames;
+  std::shared_ptr<MemoryBudget> budget(new MemoryBudget(maxInFlightBytes));
+  EntryCache &cache = EntryCache::instance();
 
-  for (const auto &header : headers) {
-    memcpy(target, &header.second[0], header.first.nameLength);
-    target[header.first.nameLength] = '\0';
-    target += header.first.nameLength + 1;
+  // cached entries are delivered right away, the others are decrypted in file order
+  std::vector<const CDRecordWithData*> missing;
+  std::vector<int> missingIndices;
+  for (const CDRecordWithData &header : headers) {
+    std::string name(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength);
+    auto iter = requested.find(name);
+    if (iter == requested.end()) {
+      continue;
+    }
+
+    EntryCache::Data data = cache.get(EntryCache::Key(decryptionKeys, header));
+    if (!data) {
+      missing.push_back(&header);
+      missingIndices.push_back(iter->second);
+      continue;
+    }
+
+    budget->acquire(data->size());
+    char *buffer = allocateBudgeted(budget, data->size());
+    memcpy(buffer, data->data(), data->size());
+    callback(iter->second, buffer, static_cast<int>(data->size()), userData);
   }
+
+  if (missing.empty()) {
+    return;
+  }
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // waiting for budget in beginEntry stalls the pipeline, which stops reading once its chunks are used up.
+  // Entries are decrypted straight into the buffer handed to the callback
+  struct BudgetedSink : public DecryptPipeline::Sink {
+    const std::vector<const CDRecordWithData*> &entries;
+    std::shared_ptr<MemoryBudget> budget;
+    std::function<void(size_t, char*, size_t)> deliver;
+    char *current;
+    size_t capacity;
+    size_t size;
+
+    BudgetedSink(const std::vector<const CDRecordWithData*> &entries, const std::shared_ptr<MemoryBudget> &budget)
+      : entries(entries), budget(budget), current(nullptr), capacity(0), size(0) {}
+    ~BudgetedSink() {
+      if (current != nullptr) {
+        releaseBudgeted(current);
+      }
+    }
+    virtual void beginEntry(size_t index) override {
+      capacity = static_cast<size_t>(estimateEntrySize(*entries[index]));
+      size = 0;
+      budget->acquire(capacity);
+      current = allocateBudgeted(budget, capacity);
+    }
+    virtual void write(size_t, const uint8_t *data, size_t length) override {
+      if (size + length > capacity) {
+        // the local header has a larger extra field than the record in the directory. Rare and small,
+        // so this doesn't wait for budget
+        size_t grownCapacity = size + length;
+        budget->adjust(0, grownCapacity);
+        char *grown = allocateBudgeted(budget, grownCapacity);
+        memcpy(grown, current, size);
+        releaseBudgeted(current);
+        current = grown;
+        capacity = grownCapacity;
+      }
+      memcpy(current + size, data, length);
+      size += length;
+    }
+    virtual void endEntry(size_t index) override {
+      char *buffer = current;
+      current = nullptr;
+      deliver(index, buffer, size);
+    }
+  } sink(missing, budget);
+
+  sink.deliver = [&](size_t index, char *buffer, size_t size) {
+    const CDRecordWithData &header = *missing[index];
+    if (cache.fits(size)) {
+      EntryCache::Key cacheKey(decryptionKeys, header);
+      cache.put(cacheKey, EntryCache::Data(new std::vector<char>(buffer, buffer + size)));
+    }
+    callback(missingIndices[index], buffer, static_cast<int>(size), userData);
+  };
+
+  checked<void>([&]() {
+    DecryptPipeline pipeline(*archive, crypto, decryptionKeys);
+    pipeline.run(missing, sink);
+    }, ERROR_DECRYPTION_FAILED);
 }
 
-DLLEXPORT int pak_decrypt(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize) {
-  try {
-    decryptImpl(encryptedPath, outputPath, key, keySize);
-    return ERROR_NONE;
+
+// a part of a section that falls into a journal window
+struct WindowPiece {
+  const DecryptJournal::Section *section;
+  uint64_t sectionOffset;
+  uint64_t fileOffset;
+  uint32_t length;
+};
+
+// determine the byte ranges of the archive that need decrypting, in file order
+std::vector<DecryptJournal::Section> planSections(const RandomAccessFile &archive, const TomCryption &crypto, CryEngineDecryptionKeys &decryptionKeys,
+                                                  const std::vector<CDRecordWithData> &headers, uint64_t cdrOffset) {
+  std::vector<uint32_t> order(headers.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+    return headers[lhs].localHeaderOffset < headers[rhs].localHeaderOffset;
+    });
+
+  std::vector<DecryptJournal::Section> result;
+  result.reserve(headers.size() * 2);
+
+  for (uint32_t idx : order) {
+    const CDRecordWithData &entry = headers[idx];
+    unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+    getInitialVector(entry.record.descriptor, initialVector);
+    int encryptionKeyIndex = getEncryptionKeyIndex(entry.record.descriptor.crc);
+
+    LocalFileHeader localHeader;
+    archive.readAt(entry.localHeaderOffset, &localHeader, sizeof(LocalFileHeader));
+    crypto.decryptData(reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
+
+    uint32_t headerLength = sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
+    DecryptJournal::Section header = { entry.localHeaderOffset, headerLength, idx };
+    result.push_back(header);
+
+    uint64_t dataOffset = entry.localHeaderOffset + headerLength;
+    if (entry.sizeCompressed > 0) {
+      DecryptJournal::Section data = { dataOffset, entry.sizeCompressed, idx };
+      result.push_back(data);
+    }
+
+    if ((localHeader.flags & 0x08) != 0) {
+      uint64_t descriptorOffset = dataOffset + entry.sizeCompressed;
+      uint8_t possibleSignature[4];
+      archive.readAt(descriptorOffset, possibleSignature, 4);
+      crypto.decryptData(possibleSignature, 4, decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
+      DecryptJournal::Section descriptor = { descriptorOffset, getDataDescriptorSize(possibleSignature, entry.zip64), idx };
+      result.push_back(descriptor);
+    }
   }
-  catch (const ErrorCodeException &e) {
-    return e.code();
+
+  // sections get decrypted independently, if they overlapped, parts would be decrypted twice
+  uint64_t end = 0;
+  for (const DecryptJournal::Section &section : result) {
+    if (section.offset < end) {
+      throw ErrorCodeException(ERROR_DECRYPTION_FAILED);
+    }
+    end = section.offset + section.length;
   }
-  catch (...) {
-    return ERROR_UNKNOWN;
+  if (end > cdrOffset) {
+    throw ErrorCodeException(ERROR_DECRYPTION_FAILED);
   }
+
+  return result;
 }
 
-DLLEXPORT int pak_list_files(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames) {
-  try {
-    listFilesImpl(encryptedPath, key, keySize, fileNames);
-    return ERROR_NONE;
+// collect the parts of the plan that fit into the window beginning at the cursor.
+// This has to be deterministic, recovery recreates a window from its start cursor
+DecryptJournal::Cursor collectWindow(const std::vector<DecryptJournal::Section> &plan, DecryptJournal::Cursor cursor,
+                                     std::vector<WindowPiece> &pieces, uint64_t &fileStart, uint64_t &fileEnd) {
+  pieces.clear();
+  fileStart = fileEnd = plan[static_cast<size_t>(cursor.section)].offset + cursor.sectionOffset;
+  uint64_t limit = fileStart + DecryptJournal::WINDOW_SIZE;
+
+  while (cursor.section < plan.size()) {
+    const DecryptJournal::Section &section = plan[static_cast<size_t>(cursor.section)];
+    uint64_t pieceStart = section.offset + cursor.sectionOffset;
+    if (pieceStart >= limit) {
+      break;
+    }
+
+    uint64_t remaining = section.length - cursor.sectionOffset;
+    uint32_t length = static_cast<uint32_t>(std::min(remaining, limit - pieceStart));
+    WindowPiece piece = { &section, cursor.sectionOffset, pieceStart, length };
+    pieces.push_back(piece);
+    fileEnd = pieceStart + length;
+
+    if (length < remaining) {
+      cursor.sectionOffset += length;
+      break;
+    }
+    ++cursor.section;
+    cursor.sectionOffset = 0;
   }
-  catch (const ErrorCodeException &e) {
-    return e.code();
+
+  return cursor;
+}
+
+void finalizeInPlace(RandomAccessFile &archive, const DecryptJournal::Finalization &finalization) {
+  archive.writeAt(finalization.offset, finalization.data.data(), finalization.data.size());
+  archive.truncate(finalization.newFileSize);
+  archive.sync();
+}
+
+void decryptInPlaceImpl(const char *encryptedPath, const unsigned char *key, short keySize) {
+  // decryption doesn't change the size of any section so the archive can be decrypted where it is.
+  // The sections are decrypted in windows, tracked by a journal so an interrupted run can be resumed
+  // (see DecryptJournal), and finally the CDR is replaced by its decrypted version and the comment
+  // holding the encryption headers is cut off
+  std::string journalPath = DecryptJournal::pathFor(encryptedPath);
+  std::unique_ptr<DecryptJournal> journal = checked<std::unique_ptr<DecryptJournal>>([&]() {
+    return DecryptJournal::open(journalPath);
+    }, ERROR_JOURNAL_INVALID);
+
+  if (journal && (journal->state() == DecryptJournal::STATE_FINALIZE)) {
+    // interrupted while replacing the CDR, the encryption headers may already be gone but the
+    // journal has everything needed to complete
+    std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+      return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ_WRITE));
+      }, ERROR_FILE_NOT_FOUND);
+    checked<void>([&]() { finalizeInPlace(*archive, journal->finalization()); }, ERROR_WRITE_FAILED);
+    journal->remove();
+    return;
   }
-  catch (...) {
-    return ERROR_UNKNOWN;
+
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
   }
-}
 
-DLLEXPORT int pak_decrypt_files(const char *encryptedPath, const unsigned char *key, short keySize, const char **files, int numFiles,
-                                char ***buffers, int **bufferSizes) {
-  try {
-    decryptFilesImpl(encryptedPath, key, keySize, files, numFiles, buffers, bufferSizes);
-    return ERROR_NONE;
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
   }
-  catch (const ErrorCodeException &e) {
-    return e.code();
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.seekg(0, std::ios::end);
+  DecryptJournal::Identity identity;
+  identity.fileSize = static_cast<uint64_t>(input.tellg());
+  identity.cdrOffset = cdrEnd.offset;
+  identity.cdrSize = cdrEnd.size;
+  identity.entryCount = cdrEnd.entries;
+
+  input.close();
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ_WRITE));
+    }, ERROR_FILE_NOT_FOUND);
+
+  if (journal) {
+    const DecryptJournal::Identity &journalIdentity = journal->identity();
+    if ((journalIdentity.fileSize != identity.fileSize)
+        || (journalIdentity.cdrOffset != identity.cdrOffset)
+        || (journalIdentity.cdrSize != identity.cdrSize)
+        || (journalIdentity.entryCount != identity.entryCount)) {
+      throw ErrorCodeException(ERROR_JOURNAL_INVALID);
+    }
+  } else {
+    std::vector<DecryptJournal::Section> plan = checked<std::vector<DecryptJournal::Section>>([&]() {
+      return planSections(*archive, crypto, decryptionKeys, headers, cdrEnd.offset);
+      }, ERROR_DECRYPTION_FAILED);
+    journal = checked<std::unique_ptr<DecryptJournal>>([&]() {
+      return DecryptJournal::create(journalPath, identity, plan);
+      }, ERROR_WRITE_FAILED);
   }
-  catch (...) {
-    return ERROR_UNKNOWN;
+
+  const std::vector<DecryptJournal::Section> &plan = journal->plan();
+  for (const DecryptJournal::Section &section : plan) {
+    if (section.entry >= headers.size()) {
+      throw ErrorCodeException(ERROR_JOURNAL_INVALID);
+    }
+  }
+
+  auto decryptPiece = [&](uint8_t *data, uint32_t length, const DecryptJournal::Section &section, uint64_t sectionOffset) {
+    const DataDescriptor &descriptor = headers[section.entry].record.descriptor;
+    unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+    getInitialVector(descriptor, initialVector);
+    int encryptionKeyIndex = getEncryptionKeyIndex(descriptor.crc);
+    crypto.decryptData(data, length, decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector, sectionOffset);
+  };
+
+  std::vector<uint8_t> buffer;
+  std::vector<WindowPiece> pieces;
+  uint64_t fileStart, fileEnd;
+  DecryptJournal::Cursor cursor = { 0, 0 };
+
+  if (journal->state() == DecryptJournal::STATE_WINDOW) {
+    // the last window may have been written partially. Pages that still have the checksum of the
+    // encrypted data weren't written yet, everything else was
+    const DecryptJournal::Window &window = journal->window();
+    if (window.start.section >= plan.size()) {
+      throw ErrorCodeException(ERROR_JOURNAL_INVALID);
+    }
+    DecryptJournal::Cursor end = collectWindow(plan, window.start, pieces, fileStart, fileEnd);
+    if ((end.section != window.end.section) || (end.sectionOffset != window.end.sectionOffset)
+        || (fileStart != window.fileStart) || (fileEnd != window.fileEnd)) {
+      throw ErrorCodeException(ERROR_JOURNAL_INVALID);
+    }
+
+    checked<void>([&]() {
+      buffer.resize(static_cast<size_t>(fileEnd - fileStart));
+      archive->readAt(fileStart, buffer.data(), buffer.size());
+      std::vector<uint64_t> current = DecryptJournal::pageChecksums(buffer.data(), fileStart, fileEnd);
+      if (current.size() != window.pageChecksums.size()) {
+        throw ErrorCodeException(ERROR_JOURNAL_INVALID);
+      }
+
+      uint64_t firstPage = fileStart / DecryptJournal::PAGE_SIZE;
+      for (const WindowPiece &piece : pieces) {
+        uint64_t pos = piece.fileOffset;
+        uint64_t pieceEnd = piece.fileOffset + piece.length;
+        while (pos < pieceEnd) {
+          uint64_t page = pos / DecryptJournal::PAGE_SIZE;
+          uint64_t pageEnd = std::min<uint64_t>((page + 1) * DecryptJournal::PAGE_SIZE, pieceEnd);
+          size_t pageIndex = static_cast<size_t>(page - firstPage);
+          if (current[pageIndex] == window.pageChecksums[pageIndex]) {
+            decryptPiece(buffer.data() + (pos - fileStart), static_cast<uint32_t>(pageEnd - pos),
+                         *piece.section, piece.sectionOffset + (pos - piece.fileOffset));
+          }
+          pos = pageEnd;
+        }
+      }
+
+      archive->writeAt(fileStart, buffer.data(), buffer.size());
+      archive->sync();
+      }, ERROR_WRITE_FAILED);
+
+    cursor = window.end;
   }
+
+  while (cursor.section < plan.size()) {
+    DecryptJournal::Cursor next = collectWindow(plan, cursor, pieces, fileStart, fileEnd);
+
+    checked<void>([&]() {
+      buffer.resize(static_cast<size_t>(fileEnd - fileStart));
+      archive->readAt(fileStart, buffer.data(), buffer.size());
+
+      journal->writeWindow(cursor, next, fileStart, fileEnd, DecryptJournal::pageChecksums(buffer.data(), fileStart, fileEnd));
+
+      for (const WindowPiece &piece : pieces) {
+        decryptPiece(buffer.data() + (piece.fileOffset - fileStart), piece.length, *piece.section, piece.sectionOffset);
+      }
+
+      archive->writeAt(fileStart, buffer.data(), buffer.size());
+      archive->sync();
+      }, ERROR_WRITE_FAILED);
+
+    cursor = next;
+  }
+
+  // all data is decrypted, now replace the CDR and cut off the comment
+  DecryptJournal::Finalization finalization;
+  finalization.offset = cdrEnd.offset;
+  finalization.data.reserve(static_cast<size_t>(cdrEnd.size) + sizeof(CDREndRecord));
+  for (const CDRecordWithData &header : headers) {
+    writeCDRecord(header, finalization.data);
+  }
+  std::vector<uint8_t> cdrEndData = writeCDREnd(cdrEnd.offset, finalization.data.size(), headers.size());
+  finalization.data.insert(finalization.data.end(), cdrEndData.begin(), cdrEndData.end());
+  finalization.newFileSize = finalization.offset + finalization.data.size();
+
+  checked<void>([&]() {
+    journal->writeFinalization(finalization);
+    finalizeInPlace(*archive, finalization);
+    }, ERROR_WRITE_FAILED);
+
+  journal->remove();
+}
+
+// decrypt the requested files into a single allocation: the table of PakArenaEntry records followed by the data
+PakArenaEntry *decryptFilesArenaImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char **files, int numFiles) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.close();
+
+  std::unordered_map<std::string, int> requested;
+  requested.reserve(numFiles);
+  for (int i = 0; i < numFiles; ++i) {
+    requested.insert(std::make_pair(std::string(files[i]), i));
+  }
+
+  EntryCache &cache = EntryCache::instance();
+
+  // requested entries, split into those that are cached and those that need decrypting
+  std::vector<CDRecordWithData> selected;
+  std::vector<int> selectedIndices;
+  std::vector<std::pair<int, EntryCache::Data>> cached;
+  for (CDRecordWithData &header : headers) {
+    std::string name(reinterpret_cast<const char*>(header.data.data()), header.record.nameLength);
+    auto iter = requested.find(name);
+    if (iter == requested.end()) {
+      continue;
+    }
+
+    EntryCache::Data data = cache.get(EntryCache::Key(decryptionKeys, header));
+    if (data) {
+      cached.push_back(std::make_pair(iter->second, data));
+    } else {
+      selected.push_back(std::move(header));
+      selectedIndices.push_back(iter->second);
+    }
+  }
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // reading the local headers gives the exact size of every entry, so the arena can be allocated up front and
+  // each section decrypted right where it belongs
+  std::vector<DecryptJournal::Section> plan = checked<std::vector<DecryptJournal::Section>>([&]() {
+    return planSections(*archive, crypto, decryptionKeys, selected, cdrEnd.offset);
+    }, ERROR_DECRYPTION_FAILED);
+
+  std::vector<uint64_t> entrySizes(selected.size(), 0);
+  for (const DecryptJournal::Section &section : plan) {
+    entrySizes[section.entry] += section.length;
+  }
+
+  uint64_t tableSize = static_cast<uint64_t>(numFiles) * sizeof(PakArenaEntry);
+  uint64_t arenaSize = tableSize;
+  for (uint64_t size : entrySizes) {
+    arenaSize += size;
+  }
+  for (const auto &entry : cached) {
+    arenaSize += entry.second->size();
+  }
+
+  std::unique_ptr<char[]> arena(new char[static_cast<size_t>(arenaSize)]);
+  PakArenaEntry *table = reinterpret_cast<PakArenaEntry*>(arena.get());
+  for (int i = 0; i < numFiles; ++i) {
+    table[i].offset = 0;
+    table[i].size = 0;
+    table[i].found = 0;
+  }
+
+  // entries in file order so the section offsets below follow from the plan order
+  uint64_t offset = tableSize;
+  std::vector<uint64_t> sectionOffsets(plan.size());
+  for (size_t i = 0; i < plan.size(); ++i) {
+    const DecryptJournal::Section &section = plan[i];
+    PakArenaEntry &entry = table[selectedIndices[section.entry]];
+    if (!entry.found) {
+      entry.offset = offset;
+      entry.size = entrySizes[section.entry];
+      entry.found = 1;
+    }
+    sectionOffsets[i] = offset;
+    offset += section.length;
+  }
+
+  for (const auto &entry : cached) {
+    PakArenaEntry &target = table[entry.first];
+    target.offset = offset;
+    target.size = entry.second->size();
+    target.found = 1;
+    memcpy(arena.get() + offset, entry.second->data(), entry.second->size());
+    offset += entry.second->size();
+  }
+
+  std::atomic<size_t> nextSection(0);
+  ThreadPool pool;
+  for (size_t i = 0; i < pool.size(); ++i) {
+    pool.submit([&]() {
+      for (size_t idx = nextSection++; idx < plan.size(); idx = nextSection++) {
+        const DecryptJournal::Section &section = plan[idx];
+        const DataDescriptor &descriptor = selected[section.entry].record.descriptor;
+        unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+        getInitialVector(descriptor, initialVector);
+        int encryptionKeyIndex = getEncryptionKeyIndex(descriptor.crc);
+
+        uint8_t *target = reinterpret_cast<uint8_t*>(arena.get() + sectionOffsets[idx]);
+        archive->readAt(section.offset, target, static_cast<size_t>(section.length));
+        crypto.decryptData(target, static_cast<unsigned long>(section.length), decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector);
+      }
+    });
+  }
+  checked<void>([&]() { pool.wait(); }, ERROR_DECRYPTION_FAILED);
+
+  if (cache.enabled()) {
+    for (size_t i = 0; i < selected.size(); ++i) {
+      const PakArenaEntry &entry = table[selectedIndices[i]];
+      if (!cache.fits(entry.size)) {
+        continue;
+      }
+      const char *data = arena.get() + entry.offset;
+      EntryCache::Key cacheKey(decryptionKeys, selected[i]);
+      cache.put(cacheKey, EntryCache::Data(new std::vector<char>(data, data + entry.size)));
+    }
+  }
+
+  return reinterpret_cast<PakArenaEntry*>(arena.release());
+}
+
+// an archive being decrypted as part of a batch
+struct BatchArchive {
+  const char *encryptedPath;
+  const char *outputPath;
+  TomCryption crypto;
+  CryEngineDecryptionKeys decryptionKeys;
+  std::vector<CDRecordWithData> headers;
+  std::vector<DecryptJournal::Section> plan;
+  // offset in the output of each section of the plan
+  std::vector<uint64_t> outputOffsets;
+  uint64_t cdrOffset;
+  std::unique_ptr<RandomAccessFile> input;
+  std::unique_ptr<RandomAccessFile> output;
+  // tasks of this archive that haven't completed yet. Whichever completes last writes the CDR
+  std::atomic<size_t> remaining;
+  std::atomic<int> result;
+
+  BatchArchive() : cdrOffset(0), remaining(0), result(ERROR_NONE) {}
+
+  void fail(int code) {
+    int expected = ERROR_NONE;
+    result.compare_exchange_strong(expected, code);
+  }
+};
+
+void finishBatchArchive(BatchArchive &archive) {
+  if (archive.result == ERROR_NONE) {
+    try {
+      checked<void>([&]() {
+        std::vector<uint8_t> cdr;
+        for (const CDRecordWithData &header : archive.headers) {
+          writeCDRecord(header, cdr);
+        }
+        std::vector<uint8_t> cdrEndData = writeCDREnd(archive.cdrOffset, cdr.size(), archive.headers.size());
+        cdr.insert(cdr.end(), cdrEndData.begin(), cdrEndData.end());
+        archive.output->writeAt(archive.cdrOffset, cdr.data(), cdr.size());
+        archive.output->truncate(archive.cdrOffset + cdr.size());
+        }, ERROR_WRITE_FAILED);
+    }
+    catch (const ErrorCodeException &e) {
+      archive.fail(e.code());
+    }
+  }
+
+  archive.input.reset();
+  bool created = archive.output.get() != nullptr;
+  archive.output.reset();
+  if ((archive.result != ERROR_NONE) && created) {
+    remove(archive.outputPath);
+  }
+
+  // release the memory early, other archives of the batch may still be running for a while
+  std::vector<CDRecordWithData>().swap(archive.headers);
+  std::vector<DecryptJournal::Section>().swap(archive.plan);
+  std::vector<uint64_t>().swap(archive.outputOffsets);
+}
+
+void completeBatchTask(BatchArchive &archive) {
+  if (--archive.remaining == 0) {
+    finishBatchArchive(archive);
+  }
+}
+
+// decrypt one window of an archive, written to the output with positional writes so any number of these
+// can run at the same time
+void decryptBatchWindow(BatchArchive &archive, DecryptJournal::Cursor cursor) {
+  if (archive.result != ERROR_NONE) {
+    return;
+  }
+
+  try {
+    std::vector<WindowPiece> pieces;
+    uint64_t fileStart, fileEnd;
+    collectWindow(archive.plan, cursor, pieces, fileStart, fileEnd);
+
+    std::vector<uint8_t> buffer(static_cast<size_t>(fileEnd - fileStart));
+    checked<void>([&]() { archive.input->readAt(fileStart, buffer.data(), buffer.size()); }, ERROR_DECRYPTION_FAILED);
+
+    for (const WindowPiece &piece : pieces) {
+      const DataDescriptor &descriptor = archive.headers[piece.section->entry].record.descriptor;
+      unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+      getInitialVector(descriptor, initialVector);
+      int encryptionKeyIndex = getEncryptionKeyIndex(descriptor.crc);
+      archive.crypto.decryptData(buffer.data() + (piece.fileOffset - fileStart), piece.length,
+                                 archive.decryptionKeys.cipherKeyTable[encryptionKeyIndex], initialVector, piece.sectionOffset);
+    }
+
+    // pieces that are adjacent in the output are written together
+    checked<void>([&]() {
+      size_t runStart = 0;
+      for (size_t i = 1; i <= pieces.size(); ++i) {
+        if (i < pieces.size()) {
+          const WindowPiece &previous = pieces[i - 1];
+          uint64_t previousEnd = archive.outputOffsets[previous.section - archive.plan.data()] + previous.sectionOffset + previous.length;
+          uint64_t currentStart = archive.outputOffsets[pieces[i].section - archive.plan.data()] + pieces[i].sectionOffset;
+          if ((previousEnd == currentStart) && (previous.fileOffset + previous.length == pieces[i].fileOffset)) {
+            continue;
+          }
+        }
+        const WindowPiece &first = pieces[runStart];
+        const WindowPiece &last = pieces[i - 1];
+        uint64_t outputOffset = archive.outputOffsets[first.section - archive.plan.data()] + first.sectionOffset;
+        archive.output->writeAt(outputOffset, buffer.data() + (first.fileOffset - fileStart),
+                                static_cast<size_t>(last.fileOffset + last.length - first.fileOffset));
+        runStart = i;
+      }
+      }, ERROR_WRITE_FAILED);
+  }
+  catch (const ErrorCodeException &e) {
+    archive.fail(e.code());
+  }
+  catch (...) {
+    archive.fail(ERROR_UNKNOWN);
+  }
+}
+
+// read the CDR of an archive, lay out the output and split the work into tasks
+void prepareBatchArchive(WorkStealingPool &pool, BatchArchive &archive, const unsigned char *key, short keySize) {
+  std::ifstream input;
+  input.open(archive.encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  checked<void>([&]() { archive.crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  archive.decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, archive.crypto); }, ERROR_DECRYPTION_FAILED);
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, archive.crypto, archive.decryptionKeys.cipherKeyTable[0], archive.decryptionKeys.cdrInitialVector);
+  archive.headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.close();
+
+  archive.input = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(archive.encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  archive.plan = checked<std::vector<DecryptJournal::Section>>([&]() {
+    return planSections(*archive.input, archive.crypto, archive.decryptionKeys, archive.headers, cdrEnd.offset);
+    }, ERROR_DECRYPTION_FAILED);
+
+  // the entries are written back to back in file order, like pak_decrypt does. Since decryption doesn't
+  // change sizes, the position of everything in the output is known up front
+  archive.outputOffsets.resize(archive.plan.size());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < archive.plan.size(); ++i) {
+    const DecryptJournal::Section &section = archive.plan[i];
+    if ((i == 0) || (archive.plan[i - 1].entry != section.entry)) {
+      archive.headers[section.entry].localHeaderOffset = offset;
+    }
+    archive.outputOffsets[i] = offset;
+    offset += section.length;
+  }
+  archive.cdrOffset = offset;
+
+  archive.output = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    std::unique_ptr<RandomAccessFile> output(new RandomAccessFile(archive.outputPath, RandomAccessFile::CREATE));
+    output->truncate(archive.cdrOffset + cdrEnd.size);
+    return output;
+    }, ERROR_WRITE_FAILED);
+
+  std::vector<DecryptJournal::Cursor> windows;
+  DecryptJournal::Cursor cursor = { 0, 0 };
+  std::vector<WindowPiece> pieces;
+  uint64_t fileStart, fileEnd;
+  while (cursor.section < archive.plan.size()) {
+    windows.push_back(cursor);
+    cursor = collectWindow(archive.plan, cursor, pieces, fileStart, fileEnd);
+  }
+
+  // the extra count is for this task, so the archive can't be finished before all windows are queued
+  archive.remaining = windows.size() + 1;
+  BatchArchive *archivePtr = &archive;
+  for (const DecryptJournal::Cursor &window : windows) {
+    pool.submit([archivePtr, window]() {
+      decryptBatchWindow(*archivePtr, window);
+      completeBatchTask(*archivePtr);
+    });
+  }
+}
+
+// returns ERROR_NONE if all archives were decrypted, otherwise the error of the first one that failed
+int decryptBatchImpl(const char **encryptedPaths, const char **outputPaths, int numArchives,
+                     const unsigned char *key, short keySize, int **results) {
+  std::vector<std::unique_ptr<BatchArchive>> archives;
+  archives.reserve(numArchives);
+  for (int i = 0; i < numArchives; ++i) {
+    archives.push_back(std::unique_ptr<BatchArchive>(new BatchArchive()));
+    archives.back()->encryptedPath = encryptedPaths[i];
+    archives.back()->outputPath = outputPaths[i];
+  }
+
+  // every archive is split into windows of entries (large entries into multiple windows), all windows of all
+  // archives go to the same pool, so nothing waits for the largest archive to be processed by a single thread
+  WorkStealingPool pool;
+  for (std::unique_ptr<BatchArchive> &archive : archives) {
+    BatchArchive *archivePtr = archive.get();
+    pool.submit([&pool, archivePtr, key, keySize]() {
+      archivePtr->remaining = 1;
+      try {
+        prepareBatchArchive(pool, *archivePtr, key, keySize);
+      }
+      catch (const ErrorCodeException &e) {
+        archivePtr->fail(e.code());
+      }
+      catch (...) {
+        archivePtr->fail(ERROR_UNKNOWN);
+      }
+      completeBatchTask(*archivePtr);
+    });
+  }
+  pool.wait();
+
+  *results = new int[numArchives];
+  int result = ERROR_NONE;
+  for (int i = 0; i < numArchives; ++i) {
+    (*results)[i] = archives[i]->result;
+    if ((result == ERROR_NONE) && ((*results)[i] != ERROR_NONE)) {
+      result = (*results)[i];
+    }
+  }
+  return result;
+}
+
+void planShardsImpl(const char *encryptedPath, const unsigned char *key, short keySize, int numShards, const char *planPath, int *numPlanned) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.seekg(0, std::ios::end);
+  ShardPlan::Identity identity;
+  identity.fileSize = static_cast<uint64_t>(input.tellg());
+  identity.cdrOffset = cdrEnd.offset;
+  identity.cdrSize = cdrEnd.size;
+  identity.entryCount = cdrEnd.entries;
+
+  input.close();
+
+  ShardPlan plan = ShardPlan::create(identity, std::move(headers), static_cast<size_t>(std::max(numShards, 1)));
+  checked<void>([&]() { plan.save(planPath); }, ERROR_WRITE_FAILED);
+
+  if (numPlanned != nullptr) {
+    *numPlanned = static_cast<int>(plan.shards().size());
+  }
+}
+
+void decryptShardImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char *planPath, int shardIndex,
+                      const char *fragmentPath) {
+  ShardPlan plan = checked<ShardPlan>([&]() { return ShardPlan::load(planPath); }, ERROR_SHARD_PLAN_INVALID);
+  if ((shardIndex < 0) || (static_cast<size_t>(shardIndex) >= plan.shards().size())) {
+    throw ErrorCodeException(ERROR_SHARD_PLAN_INVALID);
+  }
+
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  // the directory comes from the plan, only the keys are needed
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  input.seekg(0, std::ios::end);
+  const ShardPlan::Identity &identity = plan.identity();
+  if ((identity.fileSize != static_cast<uint64_t>(input.tellg()))
+      || (identity.cdrOffset != cdrEnd.offset)
+      || (identity.cdrSize != cdrEnd.size)
+      || (identity.entryCount != cdrEnd.entries)) {
+    throw ErrorCodeException(ERROR_SHARD_PLAN_INVALID);
+  }
+
+  input.close();
+
+  const ShardPlan::Shard &shard = plan.shards()[shardIndex];
+  std::vector<const CDRecordWithData*> entries;
+  for (uint64_t i = shard.firstEntry; i < shard.endEntry; ++i) {
+    entries.push_back(&plan.headers()[static_cast<size_t>(i)]);
+  }
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // the data descriptors aren't included in the planned size, the file gets truncated to the actual size anyway
+  uint64_t expectedSize = shard.size + entries.size() * (24 + sizeof(uint64_t));
+  std::unique_ptr<OutputFile> outputFile = checked<std::unique_ptr<OutputFile>>([&]() {
+    return std::unique_ptr<OutputFile>(new OutputFile(fragmentPath, expectedSize, false,
+              static_cast<size_t>(std::min<uint64_t>(expectedSize, OutputFile::BUFFER_SIZE))));
+    }, ERROR_WRITE_FAILED);
+
+  // offsets relative to the fragment, the merge moves them to their final position
+  struct FragmentSink : public DecryptPipeline::Sink {
+    std::vector<uint64_t> offsets;
+    OutputFile &output;
+    FragmentSink(size_t count, OutputFile &output) : offsets(count), output(output) {}
+    virtual void beginEntry(size_t index) override {
+      offsets[index] = output.offset();
+    }
+    virtual void write(size_t, const uint8_t *data, size_t size) override {
+      output.write(data, size);
+    }
+  } sink(entries.size(), *outputFile);
+
+  checked<void>([&]() {
+    DecryptPipeline pipeline(*archive, crypto, decryptionKeys);
+    pipeline.run(entries, sink);
+    }, ERROR_DECRYPTION_FAILED);
+
+  checked<void>([&]() {
+    std::vector<uint8_t> trailer = ShardPlan::fragmentTrailer(static_cast<uint32_t>(shardIndex), outputFile->offset(), sink.offsets);
+    outputFile->write(trailer.data(), trailer.size());
+    outputFile->close();
+    }, ERROR_WRITE_FAILED);
+}
+
+// fragments are copied in pieces of this size, spread over the available threads
+static const uint64_t MERGE_PIECE_SIZE = 8 * 1024 * 1024;
+
+void mergeShardsImpl(const char *planPath, const char **fragmentPaths, int numFragments, const char *outputPath) {
+  ShardPlan plan = checked<ShardPlan>([&]() { return ShardPlan::load(planPath); }, ERROR_SHARD_PLAN_INVALID);
+  if ((numFragments < 0) || (static_cast<size_t>(numFragments) != plan.shards().size())) {
+    throw ErrorCodeException(ERROR_SHARD_PLAN_INVALID);
+  }
+
+  // check all fragments before writing anything
+  std::vector<std::unique_ptr<RandomAccessFile>> files;
+  std::vector<ShardPlan::Fragment> fragments;
+  for (int i = 0; i < numFragments; ++i) {
+    files.push_back(checked<std::unique_ptr<RandomAccessFile>>([&]() {
+      return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(fragmentPaths[i], RandomAccessFile::READ));
+      }, ERROR_FILE_NOT_FOUND));
+    fragments.push_back(checked<ShardPlan::Fragment>([&]() { return ShardPlan::readFragment(*files.back()); }, ERROR_SHARD_PLAN_INVALID));
+
+    const ShardPlan::Shard &shard = plan.shards()[i];
+    if ((fragments.back().shard != static_cast<uint32_t>(i))
+        || (fragments.back().offsets.size() != shard.endEntry - shard.firstEntry)) {
+      throw ErrorCodeException(ERROR_SHARD_PLAN_INVALID);
+    }
+  }
+
+  std::vector<CDRecordWithData> headers = plan.headers();
+
+  // every fragment goes to the offset following the ones before it, which is known up front, so all
+  // fragments are copied in parallel with positional writes
+  uint64_t cdrOffset = 0;
+  std::vector<uint64_t> bases;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    const ShardPlan::Fragment &fragment = fragments[i];
+    uint64_t firstEntry = plan.shards()[i].firstEntry;
+    for (size_t entry = 0; entry < fragment.offsets.size(); ++entry) {
+      headers[static_cast<size_t>(firstEntry + entry)].localHeaderOffset = cdrOffset + fragment.offsets[entry];
+    }
+    bases.push_back(cdrOffset);
+    cdrOffset += fragment.dataSize;
+  }
+
+  struct MergePiece {
+    size_t fragment;
+    uint64_t offset;
+    size_t size;
+  };
+
+  std::vector<MergePiece> pieces;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    for (uint64_t pos = 0; pos < fragments[i].dataSize; pos += MERGE_PIECE_SIZE) {
+      MergePiece piece;
+      piece.fragment = i;
+      piece.offset = pos;
+      piece.size = static_cast<size_t>(std::min<uint64_t>(MERGE_PIECE_SIZE, fragments[i].dataSize - pos));
+      pieces.push_back(piece);
+    }
+  }
+
+  std::vector<uint8_t> cdr;
+  for (const CDRecordWithData &header : headers) {
+    writeCDRecord(header, cdr);
+  }
+  std::vector<uint8_t> cdrEndData = writeCDREnd(cdrOffset, cdr.size(), headers.size());
+  // the end of directory record has to end the file, readers look for it there
+  uint64_t outputSize = cdrOffset + cdr.size() + cdrEndData.size();
+
+  std::unique_ptr<RandomAccessFile> outputFile = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(outputPath, RandomAccessFile::CREATE));
+    }, ERROR_WRITE_FAILED);
+
+  try {
+    checked<void>([&]() {
+      outputFile->truncate(outputSize);
+      ThreadPool::parallelFor(pieces.size(), 1, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> buffer(MERGE_PIECE_SIZE);
+        for (size_t i = begin; i < end; ++i) {
+          const MergePiece &piece = pieces[i];
+          files[piece.fragment]->readAt(piece.offset, buffer.data(), piece.size);
+          outputFile->writeAt(bases[piece.fragment] + piece.offset, buffer.data(), piece.size);
+        }
+      });
+
+      outputFile->writeAt(cdrOffset, cdr.data(), cdr.size());
+      outputFile->writeAt(cdrOffset + cdr.size(), cdrEndData.data(), cdrEndData.size());
+      }, ERROR_WRITE_FAILED);
+  }
+  catch (const ErrorCodeException&) {
+    // don't leave a partial file behind that looks like an archive
+    outputFile.reset();
+    remove(outputPath);
+    throw;
+  }
+}
+
+static const size_t READ_CHUNK_SIZE = 1024 * 1024;
+
+struct PakArchive {
+  // shared with the keyring or server the archive was opened through
+  std::shared_ptr<TomCryption> crypto;
+  CryEngineDecryptionKeys decryptionKeys;
+  std::unique_ptr<KeySchedule> schedule;
+  std::vector<CDRecordWithData> headers;
+  NameIndex index;
+  std::unique_ptr<RandomAccessFile> file;
+
+  // created on the first asynchronous read
+  std::mutex readerMutex;
+  std::unique_ptr<AsyncReader> reader;
+
+  // set while an access trace is being recorded. tracing allows reads to skip the lock while there is no trace
+  std::mutex traceMutex;
+  std::unique_ptr<AccessTrace> trace;
+  std::atomic<bool> tracing;
+
+  // access points for range reads of deflated entries, loaded on open if the archive has an index and
+  // saved on close if entries were indexed in the meantime
+  std::string seekIndexPath;
+  std::mutex seekIndexMutex;
+  SeekIndex seekIndex;
+  bool seekIndexModified;
+
+  // identifies the archive in the block cache. Unlike the address it's never reused
+  uint64_t id;
+  // offsets of the data of entries behind their local headers, 0 until first needed
+  std::unique_ptr<std::atomic<uint64_t>[]> dataOffsets;
+
+  PakArchive() : tracing(false), seekIndexModified(false), id(nextId()) {}
+  ~PakArchive() { BlockCache::instance().removeArchive(id); }
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> s_NextId(0);
+    return ++s_NextId;
+  }
+};
+
+std::shared_ptr<TomCryption> importKey(const unsigned char *key, short keySize) {
+  std::shared_ptr<TomCryption> result(new TomCryption());
+  checked<void>([&]() { result->loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+  return result;
+}
+
+// crypto holds the imported key, decryptionKeys, if set, are the already unwrapped keys of the archive,
+// see keyringOpenImpl
+PakArchive *openImpl(const char *encryptedPath, const std::shared_ptr<TomCryption> &crypto,
+                     const CryEngineDecryptionKeys *decryptionKeys = nullptr) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  std::unique_ptr<PakArchive> archive(new PakArchive());
+  archive->crypto = crypto;
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  if (decryptionKeys != nullptr) {
+    archive->decryptionKeys = *decryptionKeys;
+  } else {
+    archive->decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, *archive->crypto); }, ERROR_DECRYPTION_FAILED);
+  }
+  archive->schedule.reset(new KeySchedule(checked<KeySchedule>([&]() {
+    return archive->crypto->scheduleKeys(archive->decryptionKeys.cipherKeyTable, BLOCK_CIPHER_NUM_KEYS);
+    }, ERROR_DECRYPTION_FAILED)));
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, *archive->crypto, archive->decryptionKeys.cipherKeyTable[0], archive->decryptionKeys.cdrInitialVector);
+  archive->headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.close();
+
+  archive->index.build(archive->headers);
+  archive->dataOffsets.reset(new std::atomic<uint64_t>[archive->headers.size()]);
+  for (size_t i = 0; i < archive->headers.size(); ++i) {
+    archive->dataOffsets[i] = 0;
+  }
+
+  archive->file = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  archive->seekIndexPath = SeekIndex::pathFor(encryptedPath);
+  try {
+    archive->seekIndex = SeekIndex::load(archive->seekIndexPath.c_str());
+  }
+  catch (const std::runtime_error&) {
+    // no usable index, range reads inflate from the start of entries
+  }
+
+  return archive.release();
+}
+
+struct PakKeyring {
+  Keyring keyring;
+};
+
+// find the key of the archive, returns false if it's not in the keyring
+bool keyringIdentifyImpl(PakKeyring &keyring, const char *encryptedPath, Keyring::Match &match) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineEncryptionHeader header = checked<CryEngineEncryptionHeader>([&]() { return readEncryptionHeaders(input); }, ERROR_DECRYPTION_FAILED);
+
+  return checked<bool>([&]() { return keyring.keyring.identify(header, match); }, ERROR_DECRYPTION_FAILED);
+}
+
+PakArchive *keyringOpenImpl(PakKeyring &keyring, const char *encryptedPath, int *keyIndex) {
+  Keyring::Match match;
+  if (!keyringIdentifyImpl(keyring, encryptedPath, match)) {
+    throw ErrorCodeException(ERROR_UNKNOWN_KEY);
+  }
+
+  PakArchive *result = openImpl(encryptedPath, match.crypto, &match.decryptionKeys);
+  if (keyIndex != nullptr) {
+    *keyIndex = static_cast<int>(match.keyIndex);
+  }
+  return result;
+}
+
+// returns a buffer of the requested size for readEntryImpl to decrypt into
+typedef std::function<char*(size_t size)> EntryAllocator;
+
+// decrypt an entry of an open archive (local header, data and data descriptor) into a buffer from allocate,
+// stops early if cancelled gets set
+int readEntryImpl(PakArchive &archive, size_t entryIndex, const EntryAllocator &allocate, const std::atomic<bool> &cancelled) {
+  const CDRecordWithData &entry = archive.headers[entryIndex];
+
+  EntryCache &cache = EntryCache::instance();
+  EntryCache::Key cacheKey(archive.decryptionKeys, entry);
+  EntryCache::Data cached = cache.get(cacheKey);
+  if (cached) {
+    memcpy(allocate(cached->size()), cached->data(), cached->size());
+    return ERROR_NONE;
+  }
+
+  char *data = nullptr;
+  size_t dataSize = 0;
+
+  unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+  getInitialVector(entry.record.descriptor, initialVector);
+  int encryptionKeyIndex = getEncryptionKeyIndex(entry.record.descriptor.crc);
+  auto decrypt = [&](uint8_t *buffer, size_t size, uint64_t streamOffset) {
+    DecryptRequest request = { buffer, static_cast<unsigned long>(size), encryptionKeyIndex, initialVector, streamOffset };
+    archive.crypto->decryptBatch(*archive.schedule, &request, 1);
+  };
+
+  try {
+    LocalFileHeader localHeader;
+    archive.file->readAt(entry.localHeaderOffset, &localHeader, sizeof(LocalFileHeader));
+    decrypt(reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), 0);
+
+    uint64_t sections[3][2];
+    size_t numSections = 0;
+    uint64_t headerLength = sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
+    sections[numSections][0] = entry.localHeaderOffset;
+    sections[numSections++][1] = headerLength;
+    uint64_t offset = entry.localHeaderOffset + headerLength;
+    if (entry.sizeCompressed > 0) {
+      sections[numSections][0] = offset;
+      sections[numSections++][1] = entry.sizeCompressed;
+      offset += entry.sizeCompressed;
+    }
+    if ((localHeader.flags & 0x08) != 0) {
+      uint8_t possibleSignature[4];
+      archive.file->readAt(offset, possibleSignature, 4);
+      decrypt(possibleSignature, 4, 0);
+      sections[numSections][0] = offset;
+      sections[numSections++][1] = getDataDescriptorSize(possibleSignature, entry.zip64);
+    }
+
+    uint64_t total = 0;
+    for (size_t section = 0; section < numSections; ++section) {
+      total += sections[section][1];
+    }
+    dataSize = static_cast<size_t>(total);
+    data = allocate(dataSize);
+
+    uint8_t *target = reinterpret_cast<uint8_t*>(data);
+    for (size_t section = 0; section < numSections; ++section) {
+      for (uint64_t pos = 0; pos < sections[section][1]; pos += READ_CHUNK_SIZE) {
+        if (cancelled) {
+          return ERROR_CANCELLED;
+        }
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(READ_CHUNK_SIZE, sections[section][1] - pos));
+        archive.file->readAt(sections[section][0] + pos, target, chunk);
+        decrypt(target, chunk, pos);
+        target += chunk;
+      }
+    }
+  }
+  catch (const std::bad_alloc&) {
+    throw;
+  }
+  catch (const ErrorCodeException&) {
+    // from allocate
+    throw;
+  }
+  catch (...) {
+    return ERROR_DECRYPTION_FAILED;
+  }
+
+  if (cache.fits(dataSize)) {
+    cache.put(cacheKey, EntryCache::Data(new std::vector<char>(data, data + dataSize)));
+  }
+  return ERROR_NONE;
+}
+
+int readEntryImpl(PakArchive &archive, size_t entryIndex, std::vector<char> &data, const std::atomic<bool> &cancelled) {
+  return readEntryImpl(archive, entryIndex, [&data](size_t size) {
+    data.resize(size);
+    return data.data();
+    }, cancelled);
+}
+
+AsyncReader &asyncReader(PakArchive &archive) {
+  std::lock_guard<std::mutex> lock(archive.readerMutex);
+  if (!archive.reader) {
+    PakArchive *archivePtr = &archive;
+    archive.reader.reset(new AsyncReader([archivePtr](size_t entry, std::vector<char> &data, const std::atomic<bool> &cancelled) {
+      return readEntryImpl(*archivePtr, entry, data, cancelled);
+    }));
+  }
+  return *archive.reader;
+}
+
+// hand a completion to the caller, the buffer has to be freed with pak_free
+PakCompletion exportCompletion(AsyncReader::Completion &completion) {
+  PakCompletion result;
+  result.ticket = completion.ticket;
+  result.result = completion.result;
+  result.buffer = nullptr;
+  result.size = 0;
+  if (completion.result == ERROR_NONE) {
+    result.buffer = new char[completion.data.size()];
+    memcpy(result.buffer, completion.data.data(), completion.data.size());
+    result.size = static_cast<int>(completion.data.size());
+  }
+  return result;
+}
+
+// the trace records the order in which entries are requested, not when the reads complete
+void recordAccess(PakArchive &archive, const std::string &name) {
+  if (archive.tracing) {
+    std::lock_guard<std::mutex> lock(archive.traceMutex);
+    if (archive.trace) {
+      archive.trace->record(name);
+    }
+  }
+}
+
+// everything a read needs from the archive is immutable after opening and the file is read positionally,
+// so any number of threads can read concurrently
+int readImpl(PakArchive &archive, const char *name, char **buffer, int *size) {
+  auto iter = archive.index.find(name);
+  if (iter == nullptr) {
+    return ERROR_FILE_NOT_FOUND;
+  }
+
+  recordAccess(archive, iter->first);
+
+  std::vector<char> data;
+  std::atomic<bool> cancelled(false);
+  int result = readEntryImpl(archive, iter->second, data, cancelled);
+  if (result == ERROR_NONE) {
+    *buffer = new char[data.size()];
+    memcpy(*buffer, data.data(), data.size());
+    *size = static_cast<int>(data.size());
+  }
+  return result;
+}
+
+// ranges closer than this are prefetched as one, reading the gap costs less than another request
+static const uint64_t PREFETCH_MAX_GAP = 256 * 1024;
+// crc and two 64 bit sizes, preceded by the optional signature
+static const uint64_t MAX_DATA_DESCRIPTOR_SIZE = 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+void prefetchImpl(PakArchive &archive, const char **names, int numNames, int flags) {
+  std::vector<size_t> entries;
+  for (int i = 0; i < numNames; ++i) {
+    auto iter = archive.index.find(names[i]);
+    if (iter != nullptr) {
+      entries.push_back(iter->second);
+    }
+  }
+
+  bool decrypt = (flags & PAK_PREFETCH_DECRYPT) != 0;
+
+  if (!decrypt) {
+    // the local header may have a different extra field than the CDR, this is only a hint so
+    // being a few bytes off doesn't matter
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(entries.size());
+    for (size_t index : entries) {
+      const CDRecordWithData &entry = archive.headers[index];
+      uint64_t end = entry.localHeaderOffset + sizeof(LocalFileHeader) + entry.record.nameLength
+                   + entry.record.extraFieldLength + entry.sizeCompressed + MAX_DATA_DESCRIPTOR_SIZE;
+      ranges.push_back(std::make_pair(entry.localHeaderOffset, end));
+    }
+    std::sort(ranges.begin(), ranges.end());
+
+    for (size_t i = 0; i < ranges.size(); ) {
+      uint64_t start = ranges[i].first;
+      uint64_t end = ranges[i].second;
+      for (++i; (i < ranges.size()) && (ranges[i].first <= end + PREFETCH_MAX_GAP); ++i) {
+        end = std::max(end, ranges[i].second);
+      }
+      if (!archive.file->willNeed(start, end - start)) {
+        decrypt = true;
+        break;
+      }
+    }
+  }
+
+  if (decrypt) {
+    // reading the entries warms the os cache as well, and the entry cache if it has room
+    AsyncReader &reader = asyncReader(archive);
+    AsyncReader::Callback discard = [](AsyncReader::Completion&) {};
+    for (size_t index : entries) {
+      reader.submit(index, std::numeric_limits<int>::min(), discard);
+    }
+  }
+}
+
+// reads decrypted stored data of an entry of an open archive, offsets are relative to the start of the data.
+// Goes through the block cache if it's enabled
+struct EntryDataReader {
+  EntryDataReader(const PakArchive &archive, size_t entryIndex)
+    : archive(archive)
+    , entryIndex(entryIndex)
+  {
+    const CDRecordWithData &entry = archive.headers[entryIndex];
+    getInitialVector(entry.record.descriptor, initialVector);
+    encryptionKeyIndex = getEncryptionKeyIndex(entry.record.descriptor.crc);
+    dataSize = entry.sizeCompressed;
+
+    dataOffset = archive.dataOffsets[entryIndex];
+    if (dataOffset == 0) {
+      // the data always comes after the header so 0 can't be a valid offset
+      LocalFileHeader localHeader;
+      archive.file->readAt(entry.localHeaderOffset, &localHeader, sizeof(LocalFileHeader));
+      DecryptRequest request = { reinterpret_cast<uint8_t*>(&localHeader), sizeof(LocalFileHeader), encryptionKeyIndex, initialVector, 0 };
+      archive.crypto->decryptBatch(*archive.schedule, &request, 1);
+      dataOffset = entry.localHeaderOffset + sizeof(LocalFileHeader) + localHeader.nameLength + localHeader.extraFieldLength;
+      archive.dataOffsets[entryIndex] = dataOffset;
+    }
+  }
+
+  void operator()(uint64_t offset, uint8_t *buffer, size_t size) const {
+    BlockCache &cache = BlockCache::instance();
+    if (!cache.enabled()) {
+      read(offset, buffer, size);
+      return;
+    }
+
+    BlockCache::Key key = { archive.id, entryIndex, offset / BlockCache::BLOCK_SIZE };
+    for (size_t pos = 0; pos < size; ++key.block) {
+      uint64_t blockStart = key.block * BlockCache::BLOCK_SIZE;
+      BlockCache::Data block = cache.get(key);
+      if (!block) {
+        std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>(
+          static_cast<size_t>(std::min<uint64_t>(BlockCache::BLOCK_SIZE, dataSize - blockStart))));
+        read(blockStart, data->data(), data->size());
+        cache.put(key, data);
+        block = data;
+      }
+
+      size_t blockOffset = static_cast<size_t>(offset + pos - blockStart);
+      size_t chunk = std::min(block->size() - blockOffset, size - pos);
+      memcpy(buffer + pos, block->data() + blockOffset, chunk);
+      pos += chunk;
+    }
+  }
+
+  void read(uint64_t offset, uint8_t *buffer, size_t size) const {
+    for (size_t pos = 0; pos < size; pos += READ_CHUNK_SIZE) {
+      size_t chunk = std::min(READ_CHUNK_SIZE, size - pos);
+      archive.file->readAt(dataOffset + offset + pos, buffer + pos, chunk);
+      DecryptRequest request = { buffer + pos, static_cast<unsigned long>(chunk), encryptionKeyIndex, initialVector, offset + pos };
+      archive.crypto->decryptBatch(*archive.schedule, &request, 1);
+    }
+  }
+
+  const PakArchive &archive;
+  size_t entryIndex;
+  uint64_t dataOffset;
+  uint64_t dataSize;
+  int encryptionKeyIndex;
+  unsigned char initialVector[BLOCK_CIPHER_KEY_LENGTH];
+};
+
+void indexEntryImpl(PakArchive &archive, const char *name, uint64_t spacing) {
+  auto iter = archive.index.find(name);
+  if (iter == nullptr) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+  const CDRecordWithData &entry = archive.headers[iter->second];
+
+  CompressionMethod method = static_cast<CompressionMethod>(entry.record.method);
+  if (method == CompressionMethod::Store) {
+    // stored entries are read at any offset directly
+    return;
+  }
+  if (method != CompressionMethod::Deflate) {
+    throw ErrorCodeException(ERROR_UNSUPPORTED_COMPRESSION);
+  }
+
+  std::shared_ptr<const SeekIndex::Entry> index;
+  if (entry.sizeCompressed > 0) {
+    EntryDataReader reader = checked<EntryDataReader>([&]() { return EntryDataReader(archive, iter->second); }, ERROR_DECRYPTION_FAILED);
+    // a full pass would only push everything else out of the block cache
+    SeekIndex::Source source = [&reader](uint64_t offset, uint8_t *buffer, size_t size) { reader.read(offset, buffer, size); };
+    index.reset(new SeekIndex::Entry(checked<SeekIndex::Entry>([&]() {
+      return SeekIndex::build(source, entry.record.descriptor.crc, entry.sizeCompressed, entry.sizeUncompressed,
+                              spacing > 0 ? spacing : SeekIndex::DEFAULT_SPACING);
+      }, ERROR_VERIFY_FAILED)));
+  } else {
+    index.reset(new SeekIndex::Entry());
+  }
+
+  std::lock_guard<std::mutex> lock(archive.seekIndexMutex);
+  archive.seekIndex.set(iter->first, index);
+  archive.seekIndexModified = true;
+}
+
+// write the seek index if entries were indexed since the archive was opened
+void saveSeekIndexImpl(PakArchive &archive) {
+  std::lock_guard<std::mutex> lock(archive.seekIndexMutex);
+  if (archive.seekIndexModified) {
+    checked<void>([&]() { archive.seekIndex.save(archive.seekIndexPath.c_str()); }, ERROR_WRITE_FAILED);
+    archive.seekIndexModified = false;
+  }
+}
+
+uint64_t readRangeImpl(PakArchive &archive, const char *name, uint64_t offset, uint64_t size, char *buffer) {
+  auto iter = archive.index.find(name);
+  if (iter == nullptr) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+  const CDRecordWithData &entry = archive.headers[iter->second];
+
+  recordAccess(archive, iter->first);
+
+  if (offset >= entry.sizeUncompressed) {
+    return 0;
+  }
+  size = std::min(size, entry.sizeUncompressed - offset);
+
+  CompressionMethod method = static_cast<CompressionMethod>(entry.record.method);
+  if ((method != CompressionMethod::Store) && (method != CompressionMethod::Deflate)) {
+    throw ErrorCodeException(ERROR_UNSUPPORTED_COMPRESSION);
+  }
+
+  EntryDataReader reader = checked<EntryDataReader>([&]() { return EntryDataReader(archive, iter->second); }, ERROR_DECRYPTION_FAILED);
+  uint8_t *target = reinterpret_cast<uint8_t*>(buffer);
+
+  if (method == CompressionMethod::Store) {
+    size = std::min(size, entry.sizeCompressed - std::min(offset, entry.sizeCompressed));
+    checked<void>([&]() { reader(offset, target, static_cast<size_t>(size)); }, ERROR_DECRYPTION_FAILED);
+    return size;
+  }
+
+  std::shared_ptr<const SeekIndex::Entry> index;
+  {
+    std::lock_guard<std::mutex> lock(archive.seekIndexMutex);
+    index = archive.seekIndex.find(iter->first, entry.record.descriptor.crc, entry.sizeCompressed, entry.sizeUncompressed);
+  }
+
+  return checked<size_t>([&]() {
+    return SeekIndex::extract(index.get(), reader, entry.sizeCompressed, offset, target, static_cast<size_t>(size));
+    }, ERROR_VERIFY_FAILED);
+}
+
+PakTicket readAsyncImpl(PakArchive &archive, const char *name, int priority, PakReadCallback callback, void *userData) {
+  auto iter = archive.index.find(name);
+  if (iter == nullptr) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  recordAccess(archive, iter->first);
+
+  AsyncReader::Callback readerCallback;
+  if (callback != nullptr) {
+    readerCallback = [callback, userData](AsyncReader::Completion &completion) {
+      PakCompletion result = exportCompletion(completion);
+      callback(&result, userData);
+    };
+  }
+
+  return asyncReader(archive).submit(iter->second, priority, readerCallback);
+}
+
+// protocol between pak_serve and the pak_client functions. Every request is answered with a response, followed by
+// the payload either inline or, if it's larger than SERVER_INLINE_LIMIT, in shared memory passed along with the
+// response. Extracted entries are decrypted straight into the shared memory and the client hands the mapping to
+// the caller, so large entries aren't copied at all
+static const uint32_t SERVER_MAGIC = 0x5350414b;
+static const uint32_t SERVER_MAX_STRING_LENGTH = 64 * 1024;
+static const uint64_t SERVER_INLINE_LIMIT = 64 * 1024;
+
+enum ServerRequestType {
+  SERVER_LIST = 1,
+  SERVER_STAT,
+  SERVER_EXTRACT,
+  SERVER_SHUTDOWN
+};
+
+#pragma pack(push)
+#pragma pack(1)
+
+// followed by the archive path and the entry name
+struct ServerRequest {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t pathLength;
+  uint32_t nameLength;
+};
+
+struct ServerResponse {
+  uint32_t magic;
+  int32_t result;
+  uint64_t size;
+  uint32_t shared;
+};
+
+#pragma pack(pop)
+
+struct ServerConnection {
+  std::unique_ptr<LocalSocket> socket;
+  std::thread thread;
+  std::atomic<bool> finished;
+};
+
+struct PakServer {
+  // imported once, shared by all archives
+  std::shared_ptr<TomCryption> crypto;
+  std::unique_ptr<LocalServerSocket> socket;
+
+  // archives stay open, with their index, until the server stops
+  std::mutex archivesMutex;
+  std::unordered_map<std::string, std::unique_ptr<PakArchive>> archives;
+
+  std::list<std::unique_ptr<ServerConnection>> connections;
+};
+
+PakArchive &serverArchive(PakServer &server, const std::string &path) {
+  {
+    std::lock_guard<std::mutex> lock(server.archivesMutex);
+    auto iter = server.archives.find(path);
+    if (iter != server.archives.end()) {
+      return *iter->second;
+    }
+  }
+
+  // open without holding the lock so requests for other archives aren't held up. If two connections
+  // open the same archive at the same time, the first one to finish wins
+  std::unique_ptr<PakArchive> archive(openImpl(path.c_str(), server.crypto));
+
+  std::lock_guard<std::mutex> lock(server.archivesMutex);
+  auto iter = server.archives.insert(std::make_pair(path, std::move(archive))).first;
+  return *iter->second;
+}
+
+// the payload goes to either payload or, for large extracted entries, shared
+int handleServerRequest(PakServer &server, uint32_t type, const std::string &path, const std::string &name,
+                        std::vector<char> &payload, std::unique_ptr<SharedMemory> &shared) {
+  try {
+    PakArchive &archive = serverArchive(server, path);
+
+    if (type == SERVER_LIST) {
+      // same format as pak_list_files
+      for (const CDRecordWithData &header : archive.headers) {
+        payload.insert(payload.end(), header.data.begin(), header.data.begin() + header.record.nameLength);
+        payload.push_back('\0');
+      }
+      payload.push_back('\0');
+      return ERROR_NONE;
+    }
+
+    auto iter = archive.index.find(name);
+    if (iter == nullptr) {
+      return ERROR_FILE_NOT_FOUND;
+    }
+
+    if (type == SERVER_STAT) {
+      const CDRecordWithData &header = archive.headers[iter->second];
+      PakEntryInfo info;
+      info.sizeCompressed = header.sizeCompressed;
+      info.sizeUncompressed = header.sizeUncompressed;
+      info.crc = header.record.descriptor.crc;
+      info.method = header.record.method;
+      payload.assign(reinterpret_cast<const char*>(&info), reinterpret_cast<const char*>(&info) + sizeof(PakEntryInfo));
+      return ERROR_NONE;
+    }
+
+    if (type == SERVER_EXTRACT) {
+      std::atomic<bool> cancelled(false);
+      return readEntryImpl(archive, iter->second, [&](size_t size) -> char* {
+        if (size > SERVER_INLINE_LIMIT) {
+          shared.reset(checked<SharedMemory*>([&]() { return new SharedMemory(size); }, ERROR_CONNECTION_FAILED));
+          return shared->data();
+        }
+        payload.resize(size);
+        return payload.data();
+        }, cancelled);
+    }
+
+    return ERROR_UNKNOWN;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+void serveConnection(PakServer &server, ServerConnection &connection) {
+  LocalSocket &socket = *connection.socket;
+  try {
+    // the server decrypts with its key whatever it's asked to, only its own user may ask
+    if (!socket.peerIsSameUser()) {
+      connection.finished = true;
+      return;
+    }
+
+    ServerRequest request;
+    while (socket.receive(&request, sizeof(ServerRequest))) {
+      if ((request.magic != SERVER_MAGIC)
+          || (request.pathLength > SERVER_MAX_STRING_LENGTH)
+          || (request.nameLength > SERVER_MAX_STRING_LENGTH)) {
+        break;
+      }
+
+      std::string path(request.pathLength, '\0');
+      std::string name(request.nameLength, '\0');
+      if ((!path.empty() && !socket.receive(&path[0], path.size()))
+          || (!name.empty() && !socket.receive(&name[0], name.size()))) {
+        break;
+      }
+
+      ServerResponse response;
+      response.magic = SERVER_MAGIC;
+      std::vector<char> payload;
+      std::unique_ptr<SharedMemory> shared;
+      response.result = (request.type == SERVER_SHUTDOWN) ? ERROR_NONE : handleServerRequest(server, request.type, path, name, payload, shared);
+      if (response.result != ERROR_NONE) {
+        payload.clear();
+        shared.reset();
+      }
+      if (!shared && (payload.size() > SERVER_INLINE_LIMIT)) {
+        // e.g. the list of a large archive
+        shared.reset(new SharedMemory(payload.size()));
+        memcpy(shared->data(), payload.data(), payload.size());
+      }
+      response.size = shared ? shared->size() : payload.size();
+      response.shared = shared ? 1 : 0;
+
+      if (shared) {
+        socket.send(&response, sizeof(ServerResponse), shared->fd());
+      } else {
+        payload.insert(payload.begin(), reinterpret_cast<const char*>(&response), reinterpret_cast<const char*>(&response) + sizeof(ServerResponse));
+        socket.send(payload.data(), payload.size());
+      }
+
+      if (request.type == SERVER_SHUTDOWN) {
+        server.socket->close();
+      }
+    }
+  }
+  catch (...) {
+    // the client went away, nothing to report to
+  }
+  connection.finished = true;
+}
+
+void serveImpl(const char *socketPath, const unsigned char *key, short keySize) {
+  PakServer server;
+  // fails right away with an unusable key, not on the first request
+  server.crypto = importKey(key, keySize);
+  server.socket = checked<std::unique_ptr<LocalServerSocket>>([&]() {
+    return std::unique_ptr<LocalServerSocket>(new LocalServerSocket(socketPath));
+    }, ERROR_CONNECTION_FAILED);
+
+  auto stopConnections = [&]() {
+    for (auto &connection : server.connections) {
+      connection->socket->shutdown();
+    }
+    for (auto &connection : server.connections) {
+      if (connection->thread.joinable()) {
+        connection->thread.join();
+      }
+    }
+    server.connections.clear();
+  };
+
+  try {
+    while (true) {
+      std::unique_ptr<LocalSocket> socket = server.socket->accept();
+      if (!socket) {
+        break;
+      }
+
+      // threads of connections that ended get cleaned up here so they don't pile up
+      for (auto iter = server.connections.begin(); iter != server.connections.end(); ) {
+        if ((*iter)->finished) {
+          (*iter)->thread.join();
+          iter = server.connections.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+
+      std::unique_ptr<ServerConnection> connection(new ServerConnection());
+      connection->socket = std::move(socket);
+      connection->finished = false;
+      ServerConnection *connectionPtr = connection.get();
+      server.connections.push_back(std::move(connection));
+      connectionPtr->thread = std::thread([&server, connectionPtr]() { serveConnection(server, *connectionPtr); });
+    }
+  }
+  catch (...) {
+    stopConnections();
+    throw ErrorCodeException(ERROR_CONNECTION_FAILED);
+  }
+
+  stopConnections();
+}
+
+struct PakClient {
+  std::mutex mutex;
+  std::unique_ptr<LocalSocket> socket;
+};
+
+// send a request and receive the response. payload, if set, receives the payload if the request succeeded, null
+// otherwise. If mapShared is set, payloads larger than SERVER_INLINE_LIMIT are returned as the mapping of the shared
+// memory (to be freed with releasePayload), otherwise the payload is always to be freed with pak_free
+int clientRequest(PakClient &client, ServerRequestType type, const char *path, const char *name, char **payload, uint64_t *payloadSize,
+                  bool mapShared = false) {
+  std::lock_guard<std::mutex> lock(client.mutex);
+
+  if (payload != nullptr) {
+    *payload = nullptr;
+  }
+  if (payloadSize != nullptr) {
+    *payloadSize = 0;
+  }
+
+  ServerRequest request;
+  request.magic = SERVER_MAGIC;
+  request.type = type;
+  request.pathLength = static_cast<uint32_t>(path != nullptr ? strlen(path) : 0);
+  request.nameLength = static_cast<uint32_t>(name != nullptr ? strlen(name) : 0);
+  if ((request.pathLength > SERVER_MAX_STRING_LENGTH) || (request.nameLength > SERVER_MAX_STRING_LENGTH)) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  std::vector<char> message(reinterpret_cast<const char*>(&request), reinterpret_cast<const char*>(&request) + sizeof(ServerRequest));
+  message.insert(message.end(), path, path + request.pathLength);
+  message.insert(message.end(), name, name + request.nameLength);
+
+  ServerResponse response;
+  std::unique_ptr<char[]> data;
+  std::unique_ptr<SharedMemory> shared;
+  checked<void>([&]() {
+    client.socket->send(message.data(), message.size());
+
+    int fd = -1;
+    if (!client.socket->receive(&response, sizeof(ServerResponse), &fd) || (response.magic != SERVER_MAGIC)
+        || ((response.shared != 0) != (response.size > SERVER_INLINE_LIMIT))
+        || ((response.shared != 0) != (fd != -1))) {
+      if (fd != -1) {
+        // takes care of closing the descriptor
+        SharedMemory unused(fd, 0);
+      }
+      throw std::runtime_error("invalid response");
+    }
+
+    if (response.shared != 0) {
+      shared.reset(new SharedMemory(fd, static_cast<size_t>(response.size)));
+    } else {
+      data.reset(new char[static_cast<size_t>(response.size)]);
+      if ((response.size > 0) && !client.socket->receive(data.get(), static_cast<size_t>(response.size))) {
+        throw std::runtime_error("connection closed");
+      }
+    }
+    }, ERROR_CONNECTION_FAILED);
+
+  if (response.result != ERROR_NONE) {
+    return response.result;
+  }
+
+  if (payload != nullptr) {
+    if (shared && mapShared) {
+      *payload = shared->release();
+    } else if (shared) {
+      *payload = new char[shared->size()];
+      memcpy(*payload, shared->data(), shared->size());
+    } else {
+      *payload = data.release();
+    }
+  }
+  if (payloadSize != nullptr) {
+    *payloadSize = response.size;
+  }
+  return response.result;
+}
+
+// free a payload returned by clientRequest with mapShared set. Whether it's shared memory follows from its size
+void releasePayload(char *payload, uint64_t size) {
+  if (size > SERVER_INLINE_LIMIT) {
+    SharedMemory::unmap(payload, static_cast<size_t>(size));
+  } else {
+    delete[] payload;
+  }
+}
+
+// all file names, each zero terminated, with a second \0 at the very end
+char *buildNameList(const std::vector<CDRecordWithData> &headers) {
+  auto lengthAccu = [](int total, const CDRecordWithData &file) {
+    return total + file.record.nameLength + 1;
+  };
+
+  int totalLength = std::accumulate(headers.begin(), headers.end(), 1, lengthAccu);
+
+  char *result = new char[totalLength];
+  memset(result, '\0', totalLength);
+  char *target = result;
+
+  for (const auto &header : headers) {
+    memcpy(target, header.data.data(), header.record.nameLength);
+    target[header.record.nameLength] = '\0';
+    target += header.record.nameLength + 1;
+  }
+
+  return result;
+}
+
+// decrypt an entry, inflate it if necessary and compare size and crc against the CDR
+PakVerifyStatus verifyEntry(const RandomAccessFile &archive, const TomCryption &crypto, const KeySchedule &schedule,
+                            const CDRecordWithData &entry, std::vector<uint8_t> &readBuffer, std::vector<uint8_t> &inflateBuffer) {
+  uint32_t crc = 0;
+  uint64_t sizeUncompressed = 0;
+
+  PakVerifyStatus status = streamEntry(archive, crypto, schedule, entry, true, readBuffer, inflateBuffer,
+    [&](const uint8_t *data, size_t size) {
+      crc = Crc32::update(crc, data, size);
+      sizeUncompressed += size;
+    });
+
+  if (status != PAK_VERIFY_OK) {
+    return status;
+  }
+
+  if (sizeUncompressed != entry.sizeUncompressed) {
+    return PAK_VERIFY_SIZE_MISMATCH;
+  }
+
+  if (crc != entry.record.descriptor.crc) {
+    return PAK_VERIFY_CRC_MISMATCH;
+  }
+
+  return PAK_VERIFY_OK;
+}
+
+// returns true if all entries are intact
+bool verifyImpl(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames, int **results, int *numEntries) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.close();
+
+  // positional reads so all workers can share the file
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // workers pick up entries in file order so reads stay mostly sequential
+  std::vector<size_t> order(headers.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return headers[lhs].localHeaderOffset < headers[rhs].localHeaderOffset;
+    });
+
+  std::vector<int> status(headers.size(), PAK_VERIFY_READ_FAILED);
+  std::atomic<size_t> nextEntry(0);
+  KeySchedule schedule = crypto.scheduleKeys(decryptionKeys.cipherKeyTable, BLOCK_CIPHER_NUM_KEYS);
+
+  ThreadPool pool;
+  for (size_t i = 0; i < pool.size(); ++i) {
+    pool.submit([&]() {
+      std::vector<uint8_t> readBuffer(VERIFY_CHUNK_SIZE);
+      std::vector<uint8_t> inflateBuffer(VERIFY_CHUNK_SIZE);
+      for (size_t idx = nextEntry++; idx < order.size(); idx = nextEntry++) {
+        try {
+          status[order[idx]] = verifyEntry(*archive, crypto, schedule, headers[order[idx]], readBuffer, inflateBuffer);
+        }
+        catch (const std::bad_alloc&) {
+          throw;
+        }
+        catch (...) {
+          status[order[idx]] = PAK_VERIFY_READ_FAILED;
+        }
+      }
+    });
+  }
+  pool.wait();
+
+  *fileNames = buildNameList(headers);
+  *results = new int[headers.size()];
+  std::copy(status.begin(), status.end(), *results);
+  *numEntries = static_cast<int>(headers.size());
+
+  return std::all_of(status.begin(), status.end(), [](int entryStatus) { return entryStatus == PAK_VERIFY_OK; });
+}
+
+struct ExtractTarget {
+  size_t entry;
+  std::string path;
+};
+
+void extractToDirectoryImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char *outputDirectory, int flags) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  input.close();
+
+  std::unique_ptr<RandomAccessFile> archive = checked<std::unique_ptr<RandomAccessFile>>([&]() {
+    return std::unique_ptr<RandomAccessFile>(new RandomAccessFile(encryptedPath, RandomAccessFile::READ));
+    }, ERROR_FILE_NOT_FOUND);
+
+  // validate all names before anything gets written. If a name occurs more than once the last entry wins,
+  // like with regular unzip tools, and two workers never write the same file
+  std::string root(outputDirectory);
+  if (!root.empty() && (root.back() != '/') && (root.back() != '\\')) {
+    root += '/';
+  }
+
+  std::set<std::string> directories;
+  std::unordered_map<std::string, size_t> targetIndex;
+  std::vector<ExtractTarget> targets;
+  for (size_t i = 0; i < headers.size(); ++i) {
+    std::string name(reinterpret_cast<const char*>(headers[i].data.data()), headers[i].record.nameLength);
+    std::string relative;
+    if (!FileSystem::sanitizeEntryPath(name, relative)) {
+      throw ErrorCodeException(ERROR_INVALID_ENTRY_NAME);
+    }
+
+    if ((name.back() == '/') || (name.back() == '\\')) {
+      directories.insert(root + relative);
+      continue;
+    }
+
+    size_t separator = relative.find_last_of('/');
+    if (separator != std::string::npos) {
+      directories.insert(root + relative.substr(0, separator));
+    }
+
+    auto existing = targetIndex.find(relative);
+    if (existing != targetIndex.end()) {
+      targets[existing->second].entry = i;
+    } else {
+      targetIndex[relative] = targets.size();
+      targets.push_back({ i, root + relative });
+    }
+  }
+
+  // the tree is created up front, once per directory, so workers only ever create files
+  if (!FileSystem::createDirectories(outputDirectory)) {
+    throw ErrorCodeException(ERROR_WRITE_FAILED);
+  }
+  for (const std::string &directory : directories) {
+    if (!FileSystem::createDirectories(directory)) {
+      throw ErrorCodeException(ERROR_WRITE_FAILED);
+    }
+  }
+
+  // workers pick up entries in file order so reads stay mostly sequential
+  std::sort(targets.begin(), targets.end(), [&](const ExtractTarget &lhs, const ExtractTarget &rhs) {
+    return headers[lhs.entry].localHeaderOffset < headers[rhs.entry].localHeaderOffset;
+    });
+
+  bool inflateData = (flags & PAK_EXTRACT_INFLATE) != 0;
+  std::atomic<size_t> nextTarget(0);
+  KeySchedule schedule = crypto.scheduleKeys(decryptionKeys.cipherKeyTable, BLOCK_CIPHER_NUM_KEYS);
+  std::atomic<bool> failed(false);
+
+  ThreadPool pool;
+  for (size_t i = 0; i < pool.size(); ++i) {
+    pool.submit([&]() {
+      std::vector<uint8_t> readBuffer(VERIFY_CHUNK_SIZE);
+      std::vector<uint8_t> inflateBuffer(inflateData ? VERIFY_CHUNK_SIZE : 0);
+      for (size_t idx = nextTarget++; (idx < targets.size()) && !failed; idx = nextTarget++) {
+        try {
+          const CDRecordWithData &entry = headers[targets[idx].entry];
+          uint64_t expectedSize = inflateData ? entry.sizeUncompressed : entry.sizeCompressed;
+
+          // most entries are small, there is no point in an 8MB write buffer for each
+          std::unique_ptr<OutputFile> output = checked<std::unique_ptr<OutputFile>>([&]() {
+            return std::unique_ptr<OutputFile>(new OutputFile(targets[idx].path.c_str(), expectedSize, false,
+              static_cast<size_t>(std::min<uint64_t>(expectedSize, OutputFile::BUFFER_SIZE))));
+            }, ERROR_WRITE_FAILED);
+
+          // write errors pass through as ERROR_WRITE_FAILED, everything else is a read or decryption error
+          PakVerifyStatus status = checked<PakVerifyStatus>([&]() {
+            return streamEntry(*archive, crypto, schedule, entry, inflateData, readBuffer, inflateBuffer,
+              [&](const uint8_t *data, size_t size) {
+                checked<void>([&]() { output->write(data, size); }, ERROR_WRITE_FAILED);
+              });
+            }, ERROR_DECRYPTION_FAILED);
+
+          if (status == PAK_VERIFY_UNSUPPORTED_METHOD) {
+            throw ErrorCodeException(ERROR_UNSUPPORTED_COMPRESSION);
+          } else if (status != PAK_VERIFY_OK) {
+            throw ErrorCodeException(ERROR_VERIFY_FAILED);
+          }
+
+          checked<void>([&]() { output->close(); }, ERROR_WRITE_FAILED);
+        }
+        catch (...) {
+          // other workers stop at their next entry, the first error is reported
+          failed = true;
+          throw;
+        }
+      }
+    });
+  }
+  pool.wait();
+}
+
+bool verifySignatureImpl(const char *encryptedPath, const unsigned char *key, short keySize, const char *signedName) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineSigningHeader signingHeader;
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto, &signingHeader); }, ERROR_DECRYPTION_FAILED);
+
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+
+  std::future<bool> signatureValid = verifySignature(crypto, signingHeader, cdrBuffer, signedName);
+  return checked<bool>([&]() { return signatureValid.get(); }, ERROR_SIGNATURE_INVALID);
+}
+
+void listFilesImpl(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames) {
+  std::ifstream input;
+  input.open(encryptedPath, std::ios::binary | std::ios::in);
+
+  if (!input.is_open()) {
+    throw ErrorCodeException(ERROR_FILE_NOT_FOUND);
+  }
+
+  TomCryption crypto;
+  checked<void>([&]() { crypto.loadKeys(key, keySize); }, ERROR_READ_KEY_FAILED);
+
+  CDREnd cdrEnd = checked<CDREnd>([&]() { return CDREnd::from(input); }, ERROR_CDR_NOT_FOUND);
+
+  if (cdrEnd.record.commentLength < sizeof(CryEngineExtendedHeader)) {
+    throw ErrorCodeException(ERROR_NO_EXTENDED_HEADER);
+  }
+
+  CryEngineDecryptionKeys decryptionKeys = checked<CryEngineDecryptionKeys>([&]() { return readKeys(input, crypto); }, ERROR_DECRYPTION_FAILED);
+
+  // decrypt the CDR
+  std::vector<uint8_t> cdrBuffer = decryptCDR(input, cdrEnd, crypto, decryptionKeys.cipherKeyTable[0], decryptionKeys.cdrInitialVector);
+  std::vector<CDRecordWithData> headers = readCDRecords(cdrBuffer, cdrEnd);
+
+  *fileNames = buildNameList(headers);
+}
+
+DLLEXPORT int pak_decrypt(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize) {
+  return pak_decrypt_ex(encryptedPath, outputPath, key, keySize, PAK_DECRYPT_DEFAULT);
+}
+
+DLLEXPORT int pak_decrypt_ex(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize, int flags) {
+  try {
+    decryptImpl(encryptedPath, outputPath, key, keySize, nullptr, flags);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_verified(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                   const char *signedName, int flags) {
+  try {
+    decryptImpl(encryptedPath, outputPath, key, keySize, signedName, flags);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_filtered(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                   const char **patterns, int numPatterns, int filterMode, int flags) {
+  try {
+    NameFilter filter(static_cast<PakFilterMode>(filterMode), patterns, numPatterns);
+    decryptImpl(encryptedPath, outputPath, key, keySize, nullptr, flags, &filter);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_ordered(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                  const char *tracePath, int flags) {
+  try {
+    AccessTrace trace = checked<AccessTrace>([&]() { return AccessTrace::load(tracePath); }, ERROR_FILE_NOT_FOUND);
+    decryptImpl(encryptedPath, outputPath, key, keySize, nullptr, flags, nullptr, &trace);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_batch(const char **encryptedPaths, const char **outputPaths, int numArchives,
+                              const unsigned char *key, short keySize, int **results) {
+  try {
+    return decryptBatchImpl(encryptedPaths, outputPaths, numArchives, key, keySize, results);
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_plan_shards(const char *encryptedPath, const unsigned char *key, short keySize, int numShards,
+                              const char *planPath, int *numPlanned) {
+  try {
+    planShardsImpl(encryptedPath, key, keySize, numShards, planPath, numPlanned);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_shard(const char *encryptedPath, const unsigned char *key, short keySize, const char *planPath,
+                                int shard, const char *fragmentPath) {
+  try {
+    decryptShardImpl(encryptedPath, key, keySize, planPath, shard, fragmentPath);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_merge_shards(const char *planPath, const char **fragmentPaths, int numFragments, const char *outputPath) {
+  try {
+    mergeShardsImpl(planPath, fragmentPaths, numFragments, outputPath);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_in_place(const char *encryptedPath, const unsigned char *key, short keySize) {
+  try {
+    decryptInPlaceImpl(encryptedPath, key, keySize);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_verify_signature(const char *encryptedPath, const unsigned char *key, short keySize, const char *signedName) {
+  try {
+    return verifySignatureImpl(encryptedPath, key, keySize, signedName) ? ERROR_NONE : ERROR_SIGNATURE_INVALID;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_list_files(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames) {
+  try {
+    listFilesImpl(encryptedPath, key, keySize, fileNames);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_verify(const char *encryptedPath, const unsigned char *key, short keySize,
+                         char **fileNames, int **results, int *numEntries) {
+  try {
+    return verifyImpl(encryptedPath, key, keySize, fileNames, results, numEntries) ? ERROR_NONE : ERROR_VERIFY_FAILED;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_extract_to_directory(const char *encryptedPath, const unsigned char *key, short keySize,
+                                       const char *outputDirectory, int flags) {
+  try {
+    extractToDirectoryImpl(encryptedPath, key, keySize, outputDirectory, flags);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_files(const char *encryptedPath, const unsigned char *key, short keySize, const char **files, int numFiles,
+                                char ***buffers, int **bufferSizes) {
+  try {
+    decryptFilesImpl(encryptedPath, key, keySize, files, numFiles, buffers, bufferSizes);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_files_arena(const char *encryptedPath, const unsigned char *key, short keySize,
+                                      const char **files, int numFiles, PakArenaEntry **entries) {
+  try {
+    *entries = decryptFilesArenaImpl(encryptedPath, key, keySize, files, numFiles);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_decrypt_files_budgeted(const char *encryptedPath, const unsigned char *key, short keySize,
+                                         const char **files, int numFiles, unsigned long long maxInFlightBytes,
+                                         PakEntryCallback callback, void *userData) {
+  try {
+    decryptFilesBudgetedImpl(encryptedPath, key, keySize, files, numFiles, maxInFlightBytes, callback, userData);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_release_buffer(char *buffer) {
+  if (buffer != nullptr) {
+    releaseBudgeted(buffer);
+  }
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_open(const char *encryptedPath, const unsigned char *key, short keySize, PakArchive **archive) {
+  try {
+    *archive = openImpl(encryptedPath, importKey(key, keySize));
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_close(PakArchive *archive) {
+  std::unique_ptr<PakArchive> closing(archive);
+  try {
+    saveSeekIndexImpl(*closing);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_keyring_create(PakKeyring **keyring) {
+  try {
+    *keyring = new PakKeyring();
+    return ERROR_NONE;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_keyring_add(PakKeyring *keyring, const unsigned char *key, short keySize, int *keyIndex) {
+  try {
+    size_t index = checked<size_t>([&]() { return keyring->keyring.add(key, keySize); }, ERROR_READ_KEY_FAILED);
+    if (keyIndex != nullptr) {
+      *keyIndex = static_cast<int>(index);
+    }
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_keyring_identify(PakKeyring *keyring, const char *encryptedPath, int *keyIndex) {
+  try {
+    Keyring::Match match;
+    if (!keyringIdentifyImpl(*keyring, encryptedPath, match)) {
+      return ERROR_UNKNOWN_KEY;
+    }
+    *keyIndex = static_cast<int>(match.keyIndex);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_keyring_open(PakKeyring *keyring, const char *encryptedPath, PakArchive **archive, int *keyIndex) {
+  try {
+    *archive = keyringOpenImpl(*keyring, encryptedPath, keyIndex);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_keyring_free(PakKeyring *keyring) {
+  delete keyring;
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_read(PakArchive *archive, const char *name, char **buffer, int *size) {
+  try {
+    return readImpl(*archive, name, buffer, size);
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_index_entry(PakArchive *archive, const char *name, unsigned long long spacing) {
+  try {
+    indexEntryImpl(*archive, name, spacing);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_read_range(PakArchive *archive, const char *name, unsigned long long offset, unsigned long long size,
+                             char *buffer, unsigned long long *bytesRead) {
+  try {
+    *bytesRead = readRangeImpl(*archive, name, offset, size, buffer);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_prefetch(PakArchive *archive, const char **names, int numNames, int flags) {
+  try {
+    prefetchImpl(*archive, names, numNames, flags);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_read_async(PakArchive *archive, const char *name, int priority,
+                             PakReadCallback callback, void *userData, PakTicket *ticket) {
+  try {
+    *ticket = readAsyncImpl(*archive, name, priority, callback, userData);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_set_priority(PakArchive *archive, PakTicket ticket, int priority) {
+  try {
+    return asyncReader(*archive).setPriority(ticket, priority) ? ERROR_NONE : ERROR_REQUEST_NOT_FOUND;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_cancel(PakArchive *archive, PakTicket ticket) {
+  try {
+    return asyncReader(*archive).cancel(ticket) ? ERROR_NONE : ERROR_REQUEST_NOT_FOUND;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_poll_completions(PakArchive *archive, PakCompletion *completions, int maxCompletions, int *numCompletions) {
+  try {
+    std::vector<AsyncReader::Completion> completed = asyncReader(*archive).poll(static_cast<size_t>(std::max(maxCompletions, 0)));
+    for (size_t i = 0; i < completed.size(); ++i) {
+      completions[i] = exportCompletion(completed[i]);
+    }
+    *numCompletions = static_cast<int>(completed.size());
+    return ERROR_NONE;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_completion_handle(PakArchive *archive, intptr_t *handle) {
+  try {
+    *handle = asyncReader(*archive).completionHandle();
+    return ERROR_NONE;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_trace_start(PakArchive *archive) {
+  try {
+    std::lock_guard<std::mutex> lock(archive->traceMutex);
+    archive->trace.reset(new AccessTrace());
+    archive->tracing = true;
+    return ERROR_NONE;
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_trace_stop(PakArchive *archive, const char *tracePath) {
+  try {
+    std::unique_ptr<AccessTrace> trace;
+    {
+      std::lock_guard<std::mutex> lock(archive->traceMutex);
+      trace.swap(archive->trace);
+      archive->tracing = false;
+    }
+    if (tracePath != nullptr) {
+      AccessTrace empty;
+      const AccessTrace &result = trace ? *trace : empty;
+      checked<void>([&]() { result.save(tracePath); }, ERROR_WRITE_FAILED);
+    }
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_serve(const char *socketPath, const unsigned char *key, short keySize) {
+  try {
+    serveImpl(socketPath, key, keySize);
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_client_connect(const char *socketPath, PakClient **client) {
+  try {
+    std::unique_ptr<PakClient> result(new PakClient());
+    result->socket = checked<std::unique_ptr<LocalSocket>>([&]() { return LocalSocket::connect(socketPath); }, ERROR_CONNECTION_FAILED);
+    *client = result.release();
+    return ERROR_NONE;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_client_close(PakClient *client) {
+  delete client;
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_client_list(PakClient *client, const char *archivePath, char **fileNames) {
+  try {
+    return clientRequest(*client, SERVER_LIST, archivePath, nullptr, fileNames, nullptr);
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_client_stat(PakClient *client, const char *archivePath, const char *name, PakEntryInfo *info) {
+  try {
+    char *payload = nullptr;
+    uint64_t size = 0;
+    int result = clientRequest(*client, SERVER_STAT, archivePath, name, &payload, &size);
+    std::unique_ptr<char[]> data(payload);
+    if ((result == ERROR_NONE) && (size == sizeof(PakEntryInfo))) {
+      memcpy(info, data.get(), sizeof(PakEntryInfo));
+    } else if (result == ERROR_NONE) {
+      return ERROR_CONNECTION_FAILED;
+    }
+    return result;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_client_extract(PakClient *client, const char *archivePath, const char *name, char **buffer, int *size) {
+  try {
+    uint64_t payloadSize = 0;
+    int result = clientRequest(*client, SERVER_EXTRACT, archivePath, name, buffer, &payloadSize, true);
+    *size = static_cast<int>(payloadSize);
+    return result;
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_client_release(char *buffer, int size) {
+  if (buffer != nullptr) {
+    releasePayload(buffer, static_cast<uint64_t>(size));
+  }
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_client_shutdown(PakClient *client) {
+  try {
+    return clientRequest(*client, SERVER_SHUTDOWN, nullptr, nullptr, nullptr, nullptr);
+  }
+  catch (const ErrorCodeException &e) {
+    return e.code();
+  }
+  catch (...) {
+    return ERROR_UNKNOWN;
+  }
+}
+
+DLLEXPORT int pak_cache_set_budget(unsigned long long bytes) {
+  EntryCache::instance().setBudget(bytes);
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_cache_statistics(unsigned long long *hits, unsigned long long *misses, unsigned long long *bytes, unsigned long long *entries) {
+  EntryCache::Statistics statistics = EntryCache::instance().statistics();
+  if (hits != nullptr) {
+    *hits = statistics.hits;
+  }
+  if (misses != nullptr) {
+    *misses = statistics.misses;
+  }
+  if (bytes != nullptr) {
+    *bytes = statistics.bytes;
+  }
+  if (entries != nullptr) {
+    *entries = statistics.entries;
+  }
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_cache_clear() {
+  EntryCache::instance().clear();
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_block_cache_set_budget(unsigned long long bytes) {
+  BlockCache::instance().setBudget(bytes);
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_block_cache_statistics(unsigned long long *hits, unsigned long long *misses, unsigned long long *bytes, unsigned long long *blocks) {
+  BlockCache::Statistics statistics = BlockCache::instance().statistics();
+  if (hits != nullptr) {
+    *hits = statistics.hits;
+  }
+  if (misses != nullptr) {
+    *misses = statistics.misses;
+  }
+  if (bytes != nullptr) {
+    *bytes = statistics.bytes;
+  }
+  if (blocks != nullptr) {
+    *blocks = statistics.blocks;
+  }
+  return ERROR_NONE;
+}
+
+DLLEXPORT int pak_block_cache_clear() {
+  BlockCache::instance().clear();
+  return ERROR_NONE;
 }
 
 DLLEXPORT int pak_free_array(void **buffer, int length) {
@@ -313,6 +3449,18 @@ DLLEXPORT const char *pak_error_to_string(int code) {
   case ERROR_CDR_NOT_FOUND: return "CDR not found";
   case ERROR_DECRYPTION_FAILED: return "Decryption failed";
   case ERROR_READ_KEY_FAILED: return "Invalid key";
+  case ERROR_WRITE_FAILED: return "Failed to write output";
+  case ERROR_JOURNAL_INVALID: return "Journal doesn't match the archive";
+  case ERROR_VERIFY_FAILED: return "Archive is corrupted";
+  case ERROR_SIGNATURE_INVALID: return "Archive signature is missing or invalid";
+  case ERROR_CANCELLED: return "Request was cancelled";
+  case ERROR_REQUEST_NOT_FOUND: return "Request not found or already completed";
+  case ERROR_INVALID_ENTRY_NAME: return "Archive contains a file name that isn't a safe relative path";
+  case ERROR_UNSUPPORTED_COMPRESSION: return "Unsupported compression method";
+  case ERROR_INVALID_FILTER: return "Invalid filter mode";
+  case ERROR_CONNECTION_FAILED: return "Failed to communicate with the server";
+  case ERROR_UNKNOWN_KEY: return "None of the keys matches the archive";
+  case ERROR_SHARD_PLAN_INVALID: return "Shard plan or fragment doesn't match";
   default: return "Unknown error";
   }
 }
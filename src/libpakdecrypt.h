@@ -1,24 +1,360 @@
 #pragma once
 
 #include "dll.h"
+#include <cstdint>
 
 extern "C" {
+  /// flags for pak_decrypt_ex
+  enum PakDecryptFlags {
+    PAK_DECRYPT_DEFAULT = 0x00,
+    /// bypass the os file cache when writing the output (O_DIRECT / FILE_FLAG_NO_BUFFERING)
+    PAK_DECRYPT_DIRECT_IO = 0x01,
+    /// inflate deflated entries and store them uncompressed so they are faster to load. Large entries that
+    /// compress well (to less than half) stay deflated. The output is larger than the archive
+    PAK_DECRYPT_TRANSCODE = 0x02,
+  };
+
+  /// how pak_decrypt_filtered interprets its patterns. Matching is case sensitive
+  enum PakFilterMode {
+    /// patterns are complete file names
+    PAK_FILTER_NAMES = 0,
+    /// patterns are name prefixes, e.g. "Levels/"
+    PAK_FILTER_PREFIX,
+    /// patterns are globs. '*' and '?' don't match directory separators, "**" matches across directories
+    PAK_FILTER_GLOB,
+  };
+
+  /// flags for pak_extract_to_directory
+  enum PakExtractFlags {
+    PAK_EXTRACT_DEFAULT = 0x00,
+    /// inflate deflated entries. Otherwise files contain the data as stored in the archive
+    PAK_EXTRACT_INFLATE = 0x01,
+  };
+
+  /// flags for pak_prefetch
+  enum PakPrefetchFlags {
+    PAK_PREFETCH_DEFAULT = 0x00,
+    /// decrypt the entries in the background so they land in the entry cache (see pak_cache_set_budget).
+    /// Otherwise only the os is asked to load the data into its file cache
+    PAK_PREFETCH_DECRYPT = 0x01,
+  };
+
+  /// result of verifying a single entry with pak_verify
+  enum PakVerifyStatus {
+    PAK_VERIFY_OK = 0,
+    PAK_VERIFY_CRC_MISMATCH,
+    PAK_VERIFY_SIZE_MISMATCH,
+    PAK_VERIFY_INFLATE_FAILED,
+    PAK_VERIFY_UNSUPPORTED_METHOD,
+    PAK_VERIFY_READ_FAILED,
+  };
+
+  /// an archive opened with pak_open
+  typedef struct PakArchive PakArchive;
+
+  /// identifies a request made with pak_read_async
+  typedef unsigned long long PakTicket;
+
+  /// result of an asynchronous read
+  struct PakCompletion {
+    PakTicket ticket;
+    /// ERROR_NONE, ERROR_CANCELLED or the error that occurred
+    int result;
+    /// the entry in the same format as pak_decrypt_files returns it, null if the read didn't succeed.
+    /// Has to be freed with pak_free
+    char *buffer;
+    int size;
+  };
+
+  typedef void (*PakReadCallback)(const PakCompletion *completion, void *userData);
+
+  /// location of an entry in the buffer returned by pak_decrypt_files_arena
+  struct PakArenaEntry {
+    /// offset relative to the start of the buffer
+    unsigned long long offset;
+    unsigned long long size;
+    /// 0 if the file isn't in the archive, offset and size are 0 then
+    int found;
+  };
+
+  /// set of keys to open archives with, see pak_keyring_create
+  typedef struct PakKeyring PakKeyring;
+
+  /// connection to a server started with pak_serve
+  typedef struct PakClient PakClient;
+
+  /// metadata of an entry, see pak_client_stat
+  struct PakEntryInfo {
+    unsigned long long sizeCompressed;
+    unsigned long long sizeUncompressed;
+    unsigned int crc;
+    /// zip compression method, 0 = stored, 8 = deflated
+    int method;
+  };
+
+  /// receives an entry from pak_decrypt_files_budgeted. fileIndex is the position of the name in the files list,
+  /// buffer holds the entry in the same format as pak_decrypt_files returns it. The buffer has to be released
+  /// with pak_release_buffer, either inside the callback or later from any thread
+  typedef void (*PakEntryCallback)(int fileIndex, char *buffer, int size, void *userData);
+
   /// decrypt the entire archive and write to an unencrypted file
   DLLEXPORT int pak_decrypt(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize);
 
+  /// decrypt the entire archive and write to an unencrypted file.
+  /// flags is a combination of PakDecryptFlags
+  DLLEXPORT int pak_decrypt_ex(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize, int flags);
+
+  /// like pak_decrypt_ex but also checks the archive signature while decrypting.
+  /// signedName is the name of the archive as the game refers to it, it is part of the signed data.
+  /// Returns ERROR_SIGNATURE_INVALID, without leaving an output file, if the archive isn't signed or was
+  /// tampered with
+  DLLEXPORT int pak_decrypt_verified(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                     const char *signedName, int flags);
+
+  /// check only the archive signature (see pak_decrypt_verified). Returns ERROR_NONE if it's valid
+  DLLEXPORT int pak_verify_signature(const char *encryptedPath, const unsigned char *key, short keySize, const char *signedName);
+
+  /// like pak_decrypt_ex but the output only contains the files matching at least one of the patterns.
+  /// filterMode is a PakFilterMode. Only the selected files are read and decrypted, the output is a regular
+  /// zip with its own directory
+  DLLEXPORT int pak_decrypt_filtered(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                     const char **patterns, int numPatterns, int filterMode, int flags);
+
+  /// like pak_decrypt_ex but the entries in the output are laid out in the order of an access trace
+  /// (see pak_trace_start) so that loading reads the archive front to back. Entries not in the trace follow
+  /// in their original order. The trace may also be a plain text file with one name per line
+  DLLEXPORT int pak_decrypt_ordered(const char *encryptedPath, const char *outputPath, const unsigned char *key, short keySize,
+                                    const char *tracePath, int flags);
+
+  /// decrypt several archives (encrypted with the same key), equivalent to calling pak_decrypt for each pair of
+  /// encryptedPaths[i] and outputPaths[i].
+  /// All archives are processed by one shared thread pool, split up into chunks of entries, so all cores are kept
+  /// busy until the last archive is done, even if archive sizes vary widely.
+  /// results receives the error code for each archive and has to be freed with pak_free.
+  /// Returns ERROR_NONE if all archives were decrypted, otherwise the error of the first one (in list order) that failed
+  DLLEXPORT int pak_decrypt_batch(const char **encryptedPaths, const char **outputPaths, int numArchives,
+                                  const unsigned char *key, short keySize, int **results);
+
+  /// prepare decrypting one archive with several processes or machines sharing the same storage.
+  /// The entries are split into up to numShards shards of about equal size, the plan (including the
+  /// decrypted directory) is written to planPath. numPlanned (may be null) receives the number of shards,
+  /// it's lower than requested if there are fewer entries. No shard is empty.
+  /// Each shard is then decrypted with pak_decrypt_shard, independently, and the results combined
+  /// with pak_merge_shards
+  DLLEXPORT int pak_plan_shards(const char *encryptedPath, const unsigned char *key, short keySize, int numShards,
+                                const char *planPath, int *numPlanned);
+
+  /// decrypt the entries of one shard of a plan into a fragment file.
+  /// Returns ERROR_SHARD_PLAN_INVALID if the plan wasn't made for this archive
+  DLLEXPORT int pak_decrypt_shard(const char *encryptedPath, const unsigned char *key, short keySize, const char *planPath,
+                                  int shard, const char *fragmentPath);
+
+  /// combine the fragments of all shards, in shard order, into the decrypted archive. This only copies data
+  /// and doesn't need the key or the encrypted archive. It's still a full copy of the archive, fragments are
+  /// written to their final offsets in parallel but on a single machine, so
+  /// its time depends on the storage throughput rather than the number of shards.
+  /// Returns ERROR_SHARD_PLAN_INVALID if a fragment is missing or doesn't belong to the plan
+  DLLEXPORT int pak_merge_shards(const char *planPath, const char **fragmentPaths, int numFragments, const char *outputPath);
+
+  /// decrypt the entire archive, replacing the encrypted file with the unencrypted version without
+  /// writing a second copy.
+  /// Progress is tracked in a journal next to the archive (<encryptedPath>.journal). If this is interrupted
+  /// (crash, power loss) the archive must not be used, calling this again with the same key resumes
+  /// where it stopped
+  DLLEXPORT int pak_decrypt_in_place(const char *encryptedPath, const unsigned char *key, short keySize);
+
   /// list files in the archive
   /// fileNames will have each file name zero terminated in a single buffer, with a second \0 at the very end.
   /// this buffer has to be freed with freeBuffer
   DLLEXPORT int pak_list_files(const char *encryptedPath, const unsigned char *key, short keySize, char **fileNames);
 
+  /// verify the integrity of all files in the archive without writing anything. Every file is decrypted,
+  /// inflated if necessary and its size and crc compared against the archive directory. Uses all cores.
+  /// fileNames receives the names of all files in the same format as pak_list_files, results receives
+  /// a PakVerifyStatus for each of them (in the same order), numEntries the number of files.
+  /// Both buffers have to be freed with pak_free.
+  /// Returns ERROR_VERIFY_FAILED if at least one file is damaged
+  DLLEXPORT int pak_verify(const char *encryptedPath, const unsigned char *key, short keySize,
+                           char **fileNames, int **results, int *numEntries);
+
+  /// decrypt all files of the archive into outputDirectory, recreating the directory tree from the file names.
+  /// Directories are created as needed, existing files are overwritten. Files are written in parallel on all cores.
+  /// flags is a combination of PakExtractFlags.
+  /// Fails with ERROR_INVALID_ENTRY_NAME, before anything is written, if a name is absolute or contains "..".
+  /// With PAK_EXTRACT_INFLATE, fails with ERROR_UNSUPPORTED_COMPRESSION for entries that are neither stored nor
+  /// deflated and ERROR_VERIFY_FAILED if an entry can't be inflated
+  DLLEXPORT int pak_extract_to_directory(const char *encryptedPath, const unsigned char *key, short keySize,
+                                         const char *outputDirectory, int flags);
+
   /// decrypt a list of files to memory buffers.
   /// buffers will be set to an array of character pointers pointing to the buffers, bufferSizes will receive an
-  /// array of the same size specifying the size of each buffer (both in the order of the files input)
+  /// array of the same size specifying the size of each buffer (both in the order of the files input).
+  /// Files not found in the archive get a null buffer and size 0
   /// "buffers" has to be freed with "pak_free_array", "bufferSizes" has to be freed with "pak_free"
   DLLEXPORT int pak_decrypt_files(const char *encryptedPath, const unsigned char *key, short keySize,
                                   const char **files, int numFiles,
                                   char ***buffers, int **bufferSizes);
 
+  /// like pak_decrypt_files but everything is returned in a single allocation.
+  /// entries receives a buffer starting with one PakArenaEntry per file (in the order of files), followed by the
+  /// data of all entries (in the same format as pak_decrypt_files returns it). Free it with a single call to pak_free
+  DLLEXPORT int pak_decrypt_files_arena(const char *encryptedPath, const unsigned char *key, short keySize,
+                                        const char **files, int numFiles, PakArenaEntry **entries);
+
+  /// like pak_decrypt_files but the entries are handed to the callback one at a time (on the calling thread) as
+  /// soon as they are decrypted, instead of all at the end.
+  /// At most maxInFlightBytes of entry data are held at a time, counting buffers that were handed to the callback
+  /// and not released yet. Reading and decrypting pause until enough buffers were released. An entry larger than
+  /// the budget is processed once all other buffers were released.
+  /// The decryption itself holds a few MB of buffers on top of that, copies kept by the entry cache count against
+  /// the cache budget.
+  /// Note: if buffers are kept past the callback they have to be released from another thread, otherwise this
+  /// blocks forever once the budget is used up.
+  /// Names not found in the archive are skipped
+  DLLEXPORT int pak_decrypt_files_budgeted(const char *encryptedPath, const unsigned char *key, short keySize,
+                                           const char **files, int numFiles, unsigned long long maxInFlightBytes,
+                                           PakEntryCallback callback, void *userData);
+
+  /// release a buffer handed out by pak_decrypt_files_budgeted
+  DLLEXPORT int pak_release_buffer(char *buffer);
+
+  /// open an archive for repeated access. The directory is decrypted once and kept in memory until pak_close.
+  /// An open archive can be read from any number of threads at the same time, reads don't share any state
+  DLLEXPORT int pak_open(const char *encryptedPath, const unsigned char *key, short keySize, PakArchive **archive);
+
+  /// close an archive. Outstanding asynchronous reads are cancelled (callbacks are still invoked) and
+  /// the call waits for reads in flight. If entries were indexed with pak_index_entry the seek index is saved,
+  /// ERROR_WRITE_FAILED is returned if that fails. The archive is closed either way
+  DLLEXPORT int pak_close(PakArchive *archive);
+
+  /// create an empty keyring for archives whose key isn't known up front. Free it with pak_keyring_free
+  DLLEXPORT int pak_keyring_create(PakKeyring **keyring);
+
+  /// add a public key to the keyring, it's imported only once here. keyIndex (may be null) receives its index
+  DLLEXPORT int pak_keyring_add(PakKeyring *keyring, const unsigned char *key, short keySize, int *keyIndex);
+
+  /// find the key an archive was encrypted for. Only a single key slot of the archive is tried against
+  /// every key (in parallel) and the result is remembered, so this is cheap even for large keyrings.
+  /// Returns ERROR_UNKNOWN_KEY if none of the keys matches
+  DLLEXPORT int pak_keyring_identify(PakKeyring *keyring, const char *encryptedPath, int *keyIndex);
+
+  /// like pak_open with the matching key from the keyring. keyIndex (may be null) receives the index of that key.
+  /// Returns ERROR_UNKNOWN_KEY if none of the keys matches
+  DLLEXPORT int pak_keyring_open(PakKeyring *keyring, const char *encryptedPath, PakArchive **archive, int *keyIndex);
+
+  DLLEXPORT int pak_keyring_free(PakKeyring *keyring);
+
+  /// read the named entry on the calling thread, buffer receives it in the same format as pak_decrypt_files returns it.
+  /// Free the buffer with pak_free. Returns ERROR_FILE_NOT_FOUND if there is no such entry
+  DLLEXPORT int pak_read(PakArchive *archive, const char *name, char **buffer, int *size);
+
+  /// build an index of access points for pak_read_range into a deflated entry, in a full pass over it.
+  /// An access point is created roughly every spacing bytes of uncompressed data (0 for the default of 4MB),
+  /// each costs about 32KB. Indices are stored next to the archive (<archive>.seekindex) by pak_close and loaded by
+  /// pak_open. Does nothing for stored entries
+  DLLEXPORT int pak_index_entry(PakArchive *archive, const char *name, unsigned long long spacing);
+
+  /// read up to size bytes of the uncompressed data of an entry, starting at offset, into buffer.
+  /// Stored entries are read directly, deflated ones are inflated from the nearest access point if
+  /// the entry was indexed with pak_index_entry, from the start otherwise.
+  /// bytesRead is less than size only at the end of the entry
+  DLLEXPORT int pak_read_range(PakArchive *archive, const char *name, unsigned long long offset, unsigned long long size,
+                               char *buffer, unsigned long long *bytesRead);
+
+  /// announce entries that will be read soon. Returns immediately, the data is loaded in the background.
+  /// The byte ranges of the entries are merged where they are close together and the os is asked to read
+  /// them ahead. With PAK_PREFETCH_DECRYPT, or on platforms without readahead hints (Windows), the entries
+  /// are instead read by the background workers, queued behind all pak_read_async requests.
+  /// Names not found in the archive are skipped
+  DLLEXPORT int pak_prefetch(PakArchive *archive, const char **names, int numNames, int flags);
+
+  /// queue a read of the named entry in the background. Requests with a higher priority are processed first,
+  /// those with equal priority in the order they were submitted.
+  /// If callback is set it receives the completion on a worker thread, otherwise the completion is queued
+  /// for pak_poll_completions.
+  /// Returns ERROR_FILE_NOT_FOUND if there is no such entry
+  DLLEXPORT int pak_read_async(PakArchive *archive, const char *name, int priority,
+                               PakReadCallback callback, void *userData, PakTicket *ticket);
+
+  /// change the priority of a queued request. Returns ERROR_REQUEST_NOT_FOUND if it's already in flight or completed
+  DLLEXPORT int pak_set_priority(PakArchive *archive, PakTicket ticket, int priority);
+
+  /// cancel a queued or in-flight request, it completes with ERROR_CANCELLED (unless it finished before the
+  /// cancellation was noticed). Returns ERROR_REQUEST_NOT_FOUND if it already completed
+  DLLEXPORT int pak_cancel(PakArchive *archive, PakTicket ticket);
+
+  /// retrieve up to maxCompletions completions of requests without callback, doesn't block.
+  /// numCompletions receives the number of completions written
+  DLLEXPORT int pak_poll_completions(PakArchive *archive, PakCompletion *completions, int maxCompletions, int *numCompletions);
+
+  /// handle that gets signaled while there are completions for pak_poll_completions, to wait on it in an event loop.
+  /// On linux this is an eventfd (usable with epoll/poll/select), on other posix systems the read end of a pipe,
+  /// on windows an event HANDLE
+  DLLEXPORT int pak_completion_handle(PakArchive *archive, intptr_t *handle);
+
+  /// start recording the order in which entries of the archive are requested through pak_read_async.
+  /// Restarts the trace if one is already being recorded
+  DLLEXPORT int pak_trace_start(PakArchive *archive);
+
+  /// stop recording and write the trace to tracePath for use with pak_decrypt_ordered.
+  /// If tracePath is null the trace is discarded
+  DLLEXPORT int pak_trace_stop(PakArchive *archive, const char *tracePath);
+
+  /// serve archives to other processes through a unix domain socket at socketPath, see the pak_client functions.
+  /// Archives are opened on first request (all with the same key) and stay open, together with the entry cache,
+  /// so requests for them don't pay for decrypting the directory again.
+  /// The socket is only accessible to the user running the server, connections from other users are closed right away.
+  /// Blocks until a client calls pak_client_shutdown. Not available on Windows
+  DLLEXPORT int pak_serve(const char *socketPath, const unsigned char *key, short keySize);
+
+  /// connect to a server started with pak_serve. A client can be used from multiple threads, requests are
+  /// processed one at a time though. Returns ERROR_CONNECTION_FAILED if there is no server
+  DLLEXPORT int pak_client_connect(const char *socketPath, PakClient **client);
+
+  DLLEXPORT int pak_client_close(PakClient *client);
+
+  /// like pak_list_files, for an archive served by the server. archivePath is interpreted by the server so
+  /// it should be absolute
+  DLLEXPORT int pak_client_list(PakClient *client, const char *archivePath, char **fileNames);
+
+  /// sizes, crc and compression method of an entry
+  DLLEXPORT int pak_client_stat(PakClient *client, const char *archivePath, const char *name, PakEntryInfo *info);
+
+  /// decrypt a single entry, buffer receives it in the same format as pak_decrypt_files returns it, or null on error.
+  /// Large entries are decrypted by the server straight into shared memory and buffer points to its mapping, so
+  /// they aren't copied at all. Free the buffer with pak_client_release
+  DLLEXPORT int pak_client_extract(PakClient *client, const char *archivePath, const char *name, char **buffer, int *size);
+
+  /// free a buffer returned by pak_client_extract, size is the size that was returned with it
+  DLLEXPORT int pak_client_release(char *buffer, int size);
+
+  /// stop the server, it closes all connections and pak_serve returns
+  DLLEXPORT int pak_client_shutdown(PakClient *client);
+
+  /// set the memory budget (in bytes) of the decrypted entry cache shared by all archives.
+  /// pak_decrypt_files serves entries it has decrypted before from this cache, also when the archive was
+  /// opened through a different path. The budget is split evenly between 8 shards, entries larger than an eighth of
+  /// it aren't cached. 0 (the default) disables the cache
+  DLLEXPORT int pak_cache_set_budget(unsigned long long bytes);
+
+  /// retrieve cache statistics. Any of the parameters may be null
+  DLLEXPORT int pak_cache_statistics(unsigned long long *hits, unsigned long long *misses, unsigned long long *bytes, unsigned long long *entries);
+
+  /// drop all cached entries and reset the statistics
+  DLLEXPORT int pak_cache_clear();
+
+  /// set the memory budget (in bytes) of the cache of decrypted 64KB blocks used by pak_read_range, shared
+  /// by all open archives. Repeated reads of the same ranges are then served from memory instead of reading and
+  /// decrypting them again. The budget is split evenly between 8 shards, a budget below 512KB caches nothing.
+  /// 0 (the default) disables the cache
+  DLLEXPORT int pak_block_cache_set_budget(unsigned long long bytes);
+
+  /// retrieve block cache statistics. Any of the parameters may be null
+  DLLEXPORT int pak_block_cache_statistics(unsigned long long *hits, unsigned long long *misses, unsigned long long *bytes, unsigned long long *blocks);
+
+  /// drop all cached blocks and reset the statistics
+  DLLEXPORT int pak_block_cache_clear();
+
   /// free a buffer as returned 
   DLLEXPORT int pak_free_array(void **buffer, int length);
 